@@ -0,0 +1,70 @@
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+#include "AllocationStats.h"
+
+// Relaxed atomics: every thread bumps the same counters, but nobody needs
+// them to be in step with anything else, only to add up in the end
+static std::atomic<uint64_t> allocationCount( 0 );
+static std::atomic<uint64_t> freeCount( 0 );
+static std::atomic<uint64_t> allocatedBytes( 0 );
+
+AllocationStats AllocationStats::total()
+{
+	AllocationStats stats;
+	stats.allocations = allocationCount.load(std::memory_order_relaxed);
+	stats.frees = freeCount.load(std::memory_order_relaxed);
+	stats.bytes = allocatedBytes.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void AllocationStats::reset()
+{
+	allocationCount.store(0, std::memory_order_relaxed);
+	freeCount.store(0, std::memory_order_relaxed);
+	allocatedBytes.store(0, std::memory_order_relaxed);
+}
+
+static void* countedAllocation( size_t size )
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+
+	// malloc(0) may give back null, which new mustn't
+	void* p = malloc(size ? size : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+static void countedFree( void* p )
+{
+	if (p) {
+		freeCount.fetch_add(1, std::memory_order_relaxed);
+		free(p);
+	}
+}
+
+// The sized, nothrow and array forms that aren't here all end up in
+// these four by default
+void* operator new( size_t size )
+{
+	return countedAllocation(size);
+}
+
+void* operator new[]( size_t size )
+{
+	return countedAllocation(size);
+}
+
+void operator delete( void* p ) noexcept
+{
+	countedFree(p);
+}
+
+void operator delete[]( void* p ) noexcept
+{
+	countedFree(p);
+}
@@ -0,0 +1,28 @@
+#ifndef __ALLOCATIONSTATS_H__
+#define __ALLOCATIONSTATS_H__
+
+// Counts every trip to the heap the program makes. AllocationStats.cpp
+// replaces the global operator new and delete with ones that bump a
+// counter on their way to malloc() and free(), so the statistics can say
+// how many allocations a render made per ray traced. Nothing on the hot
+// path should allocate at all: hit records are plain values, and the
+// per-thread queues and stacks grow to what they need once and are
+// reused from then on.
+
+#include <stdint.h>
+
+struct AllocationStats
+{
+	AllocationStats()
+		: allocations( 0 ), frees( 0 ), bytes( 0 ) {}
+
+	uint64_t allocations;	// calls to operator new
+	uint64_t frees;			// calls to operator delete with a pointer
+	uint64_t bytes;			// asked for by those allocations
+
+	// Since the program started, or since the last reset()
+	static AllocationStats total();
+	static void reset();
+};
+
+#endif // __ALLOCATIONSTATS_H__
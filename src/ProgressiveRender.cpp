@@ -0,0 +1,51 @@
+#include "ProgressiveRender.h"
+#include "RayTracer.h"
+
+ProgressiveRender::ProgressiveRender( RayTracer* tracer, int width, int height, int antialiasingSamples )
+	: raytracer( tracer ), width( width ), height( height ), passCount( 0 ), pass( 0 ), row( 0 )
+{
+	passCount = previewPasses() + (antialiasingSamples > 0 ? antialiasingSamples : 0);
+}
+
+// Blocks of 16, 8, 4, 2 and 1
+int ProgressiveRender::previewPasses() const
+{
+	int passes = 1;
+	for (int size = PREVIEW_BLOCK; size > 1; size /= 2) {
+		passes++;
+	}
+	return passes;
+}
+
+bool ProgressiveRender::traceRow()
+{
+	if (pass >= passCount || height < 1) {
+		return false;
+	}
+
+	int step = 1;
+	if (pass < previewPasses()) {
+		// The pixels on the corners of this pass's blocks, skipping those
+		// that were already the corners of the last pass's bigger blocks
+		step = PREVIEW_BLOCK >> pass;
+		bool tracedBefore = pass > 0 && row % (2 * step) == 0;
+		int first = tracedBefore ? step : 0;
+		int across = tracedBefore ? 2 * step : step;
+
+		for (int i = first; i < width; i += across) {
+			raytracer->tracePreviewPixel( i, row, step );
+		}
+	} else {
+		int sample = pass - previewPasses();
+		for (int i = 0; i < width; i++) {
+			raytracer->accumulateSample( i, row, sample );
+		}
+	}
+
+	row += step;
+	if (row >= height) {
+		row = 0;
+		pass++;
+	}
+	return true;
+}
@@ -0,0 +1,52 @@
+#ifndef __PROGRESSIVERENDER_H__
+#define __PROGRESSIVERENDER_H__
+
+// Renders the image in passes, for the GUI to show after each one and
+// stop whenever it looks good enough. The first pass traces one pixel in
+// every 16x16 block and fills the block with it; each pass after that
+// halves the blocks, tracing only the pixels the earlier passes haven't,
+// until every pixel has its own ray. That image is exactly the one a
+// render without antialiasing makes. With antialiasing, each pass after
+// that adds one more of the jittered samples tracePixel() would take to
+// every pixel, averaged in a float accumulation buffer, so the image
+// keeps sharpening up to the full sample count.
+//
+// The passes go a row at a time so the caller can keep the window
+// responsive in between.
+
+class RayTracer;
+
+class ProgressiveRender
+{
+public:
+	// antialiasingSamples is 0 for no antialiasing
+	ProgressiveRender( RayTracer* tracer, int width, int height, int antialiasingSamples );
+
+	// Trace the next row of the current pass. Returns false, having
+	// traced nothing, once every pass is done
+	bool traceRow();
+
+	// Whether the row just traced was the last of its pass
+	bool passFinished() const { return row == 0 && pass > 0; }
+
+	// Passes done, and how many there are
+	int getPass() const { return pass; }
+	int getPassCount() const { return passCount; }
+
+	// How far through the current pass it is, from 0 to 1
+	double passProgress() const { return double(row) / double(height); }
+
+	// Pixels along each side of the first pass's blocks
+	static const int PREVIEW_BLOCK = 16;
+
+private:
+	int previewPasses() const;
+
+	RayTracer* raytracer;
+	int width, height;
+	int passCount;
+	int pass;		// the pass being traced
+	int row;		// the next row of it
+};
+
+#endif // __PROGRESSIVERENDER_H__
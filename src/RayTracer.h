@@ -4,18 +4,45 @@
 // The main ray tracer.
 
 #include "scene/ray.h"
-#include <random>
+#include "scene/sampler.h"
+#include "scene/rayRecorder.h"
+#include <iostream>
+#include <vector>
+#include <stdint.h>
 
 class Scene;
 
+// A reflected or refracted ray still to be traced, with what it is to be
+// traced with and the weight its color adds into its parent ray's with
+struct SecondaryRay
+{
+	Vec3d position;
+	Vec3d direction;
+	ray::RayType type;
+	int depth;
+	int glossyReflectionDepth;
+	Sampler sampler;
+	Vec3d weight;
+};
+
 class RayTracer
 {
 public:
     RayTracer();
     ~RayTracer();
 
-    Vec3d trace( double x, double y );
-	Vec3d traceRay( const ray& r, const Vec3d& thresh, int depth, int glossyReflectionDepth );
+    Vec3d trace( double x, double y, const Sampler& sampler );
+	Vec3d traceRay( const ray& r, const Vec3d& thresh, int depth, int glossyReflectionDepth, const Sampler& sampler );
+	Vec3d shadeHit( const ray& r, const isect& i, const Vec3d& thresh, int depth, int glossyReflectionDepth,
+		const Sampler& sampler, const uint32_t* blockedLights = 0 );
+
+	// Glossy reflection rays cast per hit, and the most secondary rays one
+	// hit can spawn: those, the mirror reflection and the refraction
+	static const int GLOSSY_REFLECTION_RAYS = 10;
+	static const int MAX_SECONDARY_RAYS = GLOSSY_REFLECTION_RAYS + 2;
+
+	int secondaryRays( const ray& r, const isect& i, int depth, int glossyReflectionDepth,
+		const Sampler& sampler, SecondaryRay* secondary ) const;
 
 	double dotProduct(const Vec3d v1, const Vec3d v2) const {
 		return v1[0] * v2[0] + v1[1] * v2[1] + v1[2] * v2[2];
@@ -29,13 +56,33 @@ public:
 	double aspectRatio();
 
 	bool createBVH();
+	void printBVHStats( std::ostream& out ) const;
 
 	void traceSetup( int w, int h, bool enableBVH, bool enableAntialiasing, bool enableGlossyReflection );
 	void tracePixel( int i, int j );
 
+	// For rendering in passes (see ProgressiveRender). A preview traces
+	// the one ray through pixel (i, j) that tracePixel() would without
+	// antialiasing, and shows it over the size x size block the pixel is
+	// the corner of. An accumulated sample adds the sample'th of the
+	// jittered rays tracePixel() would antialias with into the pixel's
+	// running sum, starting it over at sample 0, and shows the average
+	void tracePreviewPixel( int i, int j, int size );
+	void accumulateSample( int i, int j, int sample );
+
+	// Traces the pixels [i0, i1) x [j0, j1), at most a 4x4 block, as one
+	// packet of camera rays. Only for renders tracePixel() would trace with
+	// a single ray each; see packetTracingEnabled()
+	void tracePacket( int i0, int j0, int i1, int j1 );
+	bool packetTracingEnabled() const;
+
+	// Trace with the WavefrontIntegrator instead of ray by ray. Not while
+	// recording rays, which the debugging view wants pixel by pixel
+	bool wavefrontEnabled() const;
+
 	bool loadScene( char* fn );
 
-	bool sceneLoaded() { return scene != 0; }
+	bool sceneLoaded() const { return scene != 0; }
 
     void setReady( bool ready )
       { m_bBufferReady = ready; }
@@ -44,9 +91,18 @@ public:
 	
 	bool enableBVHEnabled() const { return m_enableBVH; }
 
+	// Record the rays traced for each pixel for the debugging view.
+	// Must be switched off while tracePixel is called from more than one thread
+	void enableRayRecording( bool value );
+	bool rayRecordingEnabled() const { return m_recordRays; }
+	const RayRecorder& getRayRecorder() const { return m_rayRecorder; }
+
 	const Scene& getScene() { return *scene; }
 
 private:
+	// Traces tiles through the same scene and into the same buffer
+	friend class WavefrontIntegrator;
+
 	unsigned char *buffer;
 	int buffer_width, buffer_height;
 	int bufferSize;
@@ -57,14 +113,24 @@ private:
 	bool m_enableBVH;
 
 	// For antialiasing
-	// These are from the <random> library and are supposedly a huge
-	// improvement over rand(), and offers built-in support for
-	// floats/doubles by way of the uniform_real_distribution
 	bool m_enableAntialiasing;
-	std::uniform_real_distribution<double> valueRange;
-	std::default_random_engine randomNumberEngine;
 
 	bool m_enableGlossyReflection;
+
+	void setPixel( int i, int j, const Vec3d& col );
+
+	// The color of the sample'th jittered ray through pixel (i, j)
+	Vec3d traceSample( int i, int j, int sample );
+	bool preSampledBlack( int i, int j, int totalSamples );
+
+	// The sums of the samples accumulated so far, three floats a pixel,
+	// and which pixels are left black without any
+	std::vector<float> accumulation;
+	std::vector<bool> blackPixels;
+
+	// For the debugging view
+	bool m_recordRays;
+	RayRecorder m_rayRecorder;
 };
 
 #endif // __RAYTRACER_H__
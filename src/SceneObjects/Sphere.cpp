@@ -64,4 +64,33 @@ bool Sphere::intersectLocal( const ray& r, isect& i ) const {
 	i.setUVCoordinates(uvCoordinates);
 
 	return true;
+}
+
+// intersectLocal() without the normal and uv coordinates
+bool Sphere::occludedLocal( const ray& r, double tMax ) const {
+	Vec3d rayPosition = r.getPosition();
+	Vec3d rayDirection = r.getDirection();
+
+	double radius = 1.0;
+	double threshold = RAY_EPSILON+NORMAL_EPSILON;
+
+	double a = dotProduct(rayDirection, rayDirection);
+	double b = 2 * dotProduct(rayPosition, rayDirection);
+	double c = dotProduct(rayPosition, rayPosition) - radius;
+
+	double discriminant = (b*b) - (4*a*c);
+
+    if (discriminant < 0) {
+        return false;
+    }
+
+    double squareRootOfTheDiscriminant = sqrt(discriminant);
+	double denominator = 2*a;
+	double t1 = (-b - squareRootOfTheDiscriminant) / denominator;
+	double t2 = (-b + squareRootOfTheDiscriminant) / denominator;
+
+	double tValue = t1 < t2 ? t1 : t2;
+	double distanceFromRayOriginToIntersectionPoint = (rayPosition - r.at(tValue)).length();
+
+	return distanceFromRayOriginToIntersectionPoint > threshold && tValue > threshold && tValue < tMax;
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #include <cmath>
 #include <float.h>
+#include <string.h>
+#include <limits>
 #include "trimesh.h"
+#include "../scene/qbvh.h"
+#include "../fileio/rmesh.h"
+#include "../fileio/meshimport.h"
 
 using namespace std;
 
@@ -8,12 +13,14 @@ Trimesh::~Trimesh()
 {
 	for( Materials::iterator i = materials.begin(); i != materials.end(); ++i )
 		delete *i;
+	delete bvh;
+	delete meshFile;
 }
 
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const Vec3d &v )
 {
-    vertices.push_back( v );
+    vertices.push_back( Vec3f( v[0], v[1], v[2] ) );
 }
 
 void Trimesh::addMaterial( Material *m )
@@ -23,7 +30,29 @@ void Trimesh::addMaterial( Material *m )
 
 void Trimesh::addNormal( const Vec3d &n )
 {
-    normals.push_back( n );
+    normals.push_back( Vec3f( n[0], n[1], n[2] ) );
+}
+
+void Trimesh::addVertices( const double *xyz, size_t count )
+{
+    vertices.reserve( vertices.size() + count );
+    for( size_t k = 0; k < count; ++k, xyz += 3 )
+        vertices.push_back( Vec3f( xyz[0], xyz[1], xyz[2] ) );
+}
+
+void Trimesh::addNormals( const double *xyz, size_t count )
+{
+    normals.reserve( normals.size() + count );
+    for( size_t k = 0; k < count; ++k, xyz += 3 )
+        normals.push_back( Vec3f( xyz[0], xyz[1], xyz[2] ) );
+}
+
+void Trimesh::reserveFaces( size_t count )
+{
+    indices.reserve( indices.size() + 3 * count );
+#ifdef TRIANGLE_KERNEL_MOLLER_TRUMBORE
+    edges.reserve( edges.size() + count );
+#endif
 }
 
 // Returns false if the vertices a,b,c don't all exist
@@ -31,16 +60,291 @@ bool Trimesh::addFace( int a, int b, int c )
 {
     int vcnt = vertices.size();
 
-    if( a >= vcnt || b >= vcnt || c >= vcnt )
+    if( a < 0 || b < 0 || c < 0 || a >= vcnt || b >= vcnt || c >= vcnt )
+        return false;
+
+    // A face is nothing but its three vertex indices; it's shaded with the
+    // trimesh's material, so there's nothing else to keep per face
+    indices.push_back( a );
+    indices.push_back( b );
+    indices.push_back( c );
+
+#ifdef TRIANGLE_KERNEL_MOLLER_TRUMBORE
+    TriangleEdges e;
+    e.e1 = vertices[b] - vertices[a];
+    e.e2 = vertices[c] - vertices[a];
+    edges.push_back( e );
+#endif
+    return true;
+}
+
+// The arrays are pointed into the mapped file as they are; the file keeps
+// its vectors in exactly the layout of Vec3f
+const char *Trimesh::mapFile( const std::string& path )
+{
+    static_assert( sizeof(Vec3f) == 3 * sizeof(float), "Vec3f should be three packed floats" );
+
+    delete meshFile;
+    meshFile = new MappedFile();
+    if( !meshFile->open( path ) )
+        return "couldn't open the file";
+
+    RMeshArrays arrays;
+    if( const char *error = readRMesh( *meshFile, arrays ) )
+        return error;
+
+    vertices.view( (const Vec3f*)arrays.vertices, arrays.vertexCount );
+    indices.view( arrays.indices, 3 * (size_t)arrays.triangleCount );
+    if( arrays.normalCount )
+        normals.view( (const Vec3f*)arrays.normals, arrays.normalCount );
+
+#ifdef TRIANGLE_KERNEL_MOLLER_TRUMBORE
+    // The edges aren't in the file; they're worked out from what is, like
+    // addFace() would have
+    edges.resize( triangleCount() );
+    computeEdges();
+#endif
+    return 0;
+}
+
+// An imported mesh's vertices and faces go straight into the arrays
+class TrimeshSink : public MeshSink
+{
+public:
+    TrimeshSink( Trimesh *mesh )
+        : mesh( mesh ) {}
+
+    virtual void reserve( size_t vertices, size_t normals, size_t triangles )
+    {
+        mesh->vertices.reserve( vertices );
+        mesh->normals.reserve( normals );
+        mesh->reserveFaces( triangles );
+    }
+
+    virtual void vertex( double x, double y, double z ) { mesh->vertices.push_back( Vec3f( x, y, z ) ); }
+    virtual void normal( double x, double y, double z ) { mesh->normals.push_back( Vec3f( x, y, z ) ); }
+    virtual void clearNormals() { mesh->normals = Trimesh::Normals(); }
+    virtual size_t vertexCount() const { return mesh->vertices.size(); }
+    virtual bool face( int a, int b, int c ) { return mesh->addFace( a, b, c ); }
+
+private:
+    Trimesh *mesh;
+};
+
+bool Trimesh::loadFile( const std::string& path, std::string& error )
+{
+    fromFile = true;
+    if( isImportedMesh( path ) )
+    {
+        TrimeshSink sink( this );
+        return importMesh( path, sink, error );
+    }
+
+    if( const char *mapError = mapFile( path ) )
+    {
+        error = mapError;
+        return false;
+    }
+    return true;
+}
+
+bool Trimesh::writeFile( const std::string& path ) const
+{
+    RMeshArrays arrays;
+    arrays.vertices = vertices.empty() ? 0 : vertices[0].n;
+    arrays.vertexCount = vertices.size();
+    arrays.indices = indices.data();
+    arrays.triangleCount = triangleCount();
+    arrays.normals = normals.empty() ? 0 : normals[0].n;
+    arrays.normalCount = normals.size();
+    return writeRMesh( path, arrays );
+}
+
+bool Trimesh::sameGeometry( const Trimesh& other ) const
+{
+    return vertices.size() == other.vertices.size() &&
+        indices.size() == other.indices.size() &&
+        normals.size() == other.normals.size() &&
+        ( vertices.empty() || memcmp( vertices.data(), other.vertices.data(), vertices.size() * sizeof(Vec3f) ) == 0 ) &&
+        ( indices.empty() || memcmp( indices.data(), other.indices.data(), indices.size() * sizeof(uint32_t) ) == 0 ) &&
+        ( normals.empty() || memcmp( normals.data(), other.normals.data(), normals.size() * sizeof(Vec3f) ) == 0 );
+}
+
+#ifdef TRIANGLE_KERNEL_MOLLER_TRUMBORE
+void Trimesh::computeEdges()
+{
+    for( int k = 0; k < triangleCount(); ++k ) {
+        edges[k].e1 = vertices[indices[3*k + 1]] - vertices[indices[3*k]];
+        edges[k].e2 = vertices[indices[3*k + 2]] - vertices[indices[3*k]];
+    }
+}
+#endif
+
+void Trimesh::createBVH( const BVHBuildOptions& options )
+{
+    // Instances use the tree of the mesh they share
+    if( isInstance() )
+        return;
+
+    // The key for the BVH cache covers exactly what the tree is built
+    // from: the triangles' vertices, in the space they ended up in, and
+    // which vertices each one has
+    uint64_t key = 0;
+    if( scene->bvhCache() ) {
+        key = BVHCache::hash( vertices.data(), vertices.size() * sizeof(Vec3f) );
+        key = BVHCache::hash( indices.data(), indices.size() * sizeof(uint32_t), key );
+        key = BVHCache::hashOptions( options, key );
+    }
+
+    delete bvh;
+    bvh = createBVHTree(TrimeshTriangles(this), options, scene->bvhCache(), key);
+}
+
+// The vertices and normals go through the transform once here instead of
+// every ray going through its inverse. Shared geometry has to stay where
+// it is for its other transforms, and a mirroring transform is left alone
+// too, since it would turn the triangles' normals inside out. So is a
+// mesh mapped in from a file: the mapping is read only, and moving it
+// would mean the copy the file is there to save
+bool Trimesh::moveToWorldSpace( TransformNode* world )
+{
+    if( isInstance() || instanced || isMapped() || transform->kind() == TransformNode::IDENTITY )
         return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    faces.push_back( newFace );
-    scene->add(newFace);
+    Mat4d xform = transform->transform();
+    Mat3d linear = xform.upper33();
+    double det = linear[0][0] * (linear[1][1] * linear[2][2] - linear[1][2] * linear[2][1])
+        - linear[0][1] * (linear[1][0] * linear[2][2] - linear[1][2] * linear[2][0])
+        + linear[0][2] * (linear[1][0] * linear[2][1] - linear[1][1] * linear[2][0]);
+    if( det <= 0.0 )
+        return false;
+
+    Vec3f *v = vertices.writable();
+    for( size_t k = 0; k < vertices.size(); ++k ) {
+        Vec3d p = xform * Vec3d( v[k][0], v[k][1], v[k][2] );
+        v[k] = Vec3f( p[0], p[1], p[2] );
+    }
+
+    Vec3f *n = normals.writable();
+    for( size_t k = 0; k < normals.size(); ++k ) {
+        Vec3d normal = transform->normalTransform() * Vec3d( n[k][0], n[k][1], n[k][2] );
+        normal.normalize();
+        n[k] = Vec3f( normal[0], normal[1], normal[2] );
+    }
+
+#ifdef TRIANGLE_KERNEL_MOLLER_TRUMBORE
+    computeEdges();
+#endif
+
+    // A tree over the old positions is no use any more
+    delete bvh;
+    bvh = 0;
+
+    transform = world;
     return true;
 }
 
+BoundingBox Trimesh::ComputeLocalBoundingBox()
+{
+    BoundingBox localbounds;
+    for( const Vec3f *v = mesh->vertices.begin(); v != mesh->vertices.end(); ++v )
+        localbounds.merge( Vec3d( (*v)[0], (*v)[1], (*v)[2] ) );
+    return localbounds;
+}
+
+// Instances own nothing but their transform and material
+size_t Trimesh::geometryBytes() const
+{
+    if( isInstance() )
+        return 0;
+
+    return vertices.size() * sizeof(Vec3f) + indices.size() * sizeof(uint32_t) +
+        normals.size() * sizeof(Vec3f) + materials.size() * (sizeof(Material*) + sizeof(Material))
+#ifdef TRIANGLE_KERNEL_MOLLER_TRUMBORE
+        + edges.size() * sizeof(TriangleEdges)
+#endif
+        ;
+}
+
+const char *Trimesh::triangleKernel()
+{
+#if defined(TRIANGLE_KERNEL_PLANE)
+    return "plane, then inside-outside";
+#elif defined(TRIANGLE_KERNEL_WATERTIGHT)
+    return "watertight";
+#else
+    return "Moller-Trumbore";
+#endif
+}
+
+BoundingBox Trimesh::triangleBounds( int k ) const
+{
+    BoundingBox localbounds;
+    for( int v = 0; v < 3; ++v )
+        localbounds.merge( vertex( indices[3*k + v] ) );
+    return localbounds;
+}
+
+// The ray is already in the mesh's local space. Hits report this trimesh
+// as the object, so an instance is shaded with its own material.
+bool Trimesh::intersectLocal( const ray& r, isect& i ) const
+{
+    bool have_one = false;
+
+    if( scene->bvhEnabled() && mesh->bvh ) {
+        have_one = mesh->bvh->intersect( r, i );
+    } else {
+        for( int k = 0; k < mesh->triangleCount(); ++k ) {
+            isect cur;
+            if( mesh->intersectTriangle( k, r, cur ) && (!have_one || cur.t < i.t) ) {
+                i = cur;
+                have_one = true;
+            }
+        }
+    }
+
+    if( have_one )
+        i.setObject( this );
+
+    return have_one;
+}
+
+bool Trimesh::occludedLocal( const ray& r, double tMax ) const
+{
+    if( scene->bvhEnabled() && mesh->bvh )
+        return mesh->bvh->occluded( r, tMax );
+
+    for( int k = 0; k < mesh->triangleCount(); ++k ) {
+        if( mesh->occludedTriangle( k, r, tMax ) )
+            return true;
+    }
+
+    return false;
+}
+
+// The packet versions walk the mesh's tree once for the whole packet,
+// which is where the packets pay off
+uint32_t Trimesh::intersectLocalPacket( const RayPacket& packet, uint32_t mask, isect* hits ) const
+{
+    if( !scene->bvhEnabled() || !mesh->bvh )
+        return MaterialSceneObject::intersectLocalPacket( packet, mask, hits );
+
+    uint32_t found = mesh->bvh->intersectPacket( packet, mask, hits );
+    for( int k = 0; k < packet.size; ++k ) {
+        if( found & (1u << k) )
+            hits[k].setObject( this );
+    }
+    return found;
+}
+
+uint32_t Trimesh::occludedLocalPacket( const RayPacket& packet, uint32_t mask, const double* tMax ) const
+{
+    if( !scene->bvhEnabled() || !mesh->bvh )
+        return MaterialSceneObject::occludedLocalPacket( packet, mask, tMax );
+
+    return mesh->bvh->occludedPacket( packet, mask, tMax );
+}
+
 char *
 Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
@@ -54,12 +358,15 @@ Trimesh::doubleCheck()
     return 0;
 }
 
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
+#ifdef TRIANGLE_KERNEL_PLANE
+
+// Calculates and returns the normal of the triangle too. The vertices are
+// stored as floats, but all the arithmetic is still done in doubles.
+bool Trimesh::intersectTriangle( int k, const ray& r, isect& i ) const
 {
-    const Vec3d& a = parent->vertices[ids[0]];
-    const Vec3d& b = parent->vertices[ids[1]];
-    const Vec3d& c = parent->vertices[ids[2]];
+    const Vec3d a = vertex( indices[3*k] );
+    const Vec3d b = vertex( indices[3*k + 1] );
+    const Vec3d c = vertex( indices[3*k + 2] );
 
     // Solve the ray-plane intersection first
 	Vec3d rayPosition = r.getPosition();
@@ -117,6 +424,7 @@ bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
 
         Vec2d uvCoordinates = Vec2d(uCoordinate, vCoordinate);
         i.setUVCoordinates(uvCoordinates);
+        i.setPrimitive(k);
 
         return true;
     }
@@ -124,37 +432,245 @@ bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
     return false;
 }
 
+// The same test as intersectTriangle(), minus the normal and uv coordinates,
+// and a hit beyond tMax is thrown out before the point-in-triangle test.
+bool Trimesh::occludedTriangle( int k, const ray& r, double tMax ) const
+{
+    const Vec3d a = vertex( indices[3*k] );
+    const Vec3d b = vertex( indices[3*k + 1] );
+    const Vec3d c = vertex( indices[3*k + 2] );
+
+	Vec3d rayPosition = r.getPosition();
+	Vec3d rayDirection = r.getDirection();
+    Vec3d normalVector = crossProduct(b-a, c-a);
+
+    double denominator = dotProduct(normalVector, rayDirection);
+    if (denominator == 0) {
+        // The ray is parallel to the plane, no intersection
+        return false;
+    }
+
+    double tValue = dotProduct(normalVector, a - rayPosition) / denominator;
+	double threshold = RAY_EPSILON+NORMAL_EPSILON;
+
+	if ((rayPosition - normalVector).length() <= threshold || tValue <= threshold || tValue >= tMax) {
+		return false;
+	}
+
+    Vec3d x = r.at(tValue);
+    double v1 = dotProduct(crossProduct(b-a, x-a), normalVector);
+    double v2 = dotProduct(crossProduct(c-b, x-b), normalVector);
+    double v3 = dotProduct(crossProduct(a-c, x-c), normalVector);
+
+    return (v1 > 0 && v2 > 0 && v3 > 0) || (v1 < 0 && v2 < 0 && v3 < 0);
+}
+
+#else
+
+// The tests below find the hit distance t and the barycentric weights of
+// the triangle's first two vertices (the third's is whatever is left of
+// 1), rejecting hits at or closer than the self intersection threshold
+// and at or beyond tMax. Both sides of the triangle count.
+
+#ifdef TRIANGLE_KERNEL_WATERTIGHT
+
+// Watertight ray/triangle intersection (Woop, Benthin and Wald, 2013).
+// The vertices are moved into a space where the ray starts at the origin
+// and runs down +z, so the inside test is three 2D edge functions. Two
+// triangles sharing an edge compute that edge's function from the same
+// numbers, so a ray can't slip between them or hit both.
+static bool hitTriangle( const Vec3r& a, const Vec3r& b, const Vec3r& c, const Vec3r& p, const Vec3r& d,
+    Real tMax, Real& t, Real& weightA, Real& weightB )
+{
+    // z is the direction's largest axis; swapping x and y for a negative
+    // z keeps the triangles' winding the same
+    int kz = 0;
+    if( fabs(d[1]) > fabs(d[kz]) ) kz = 1;
+    if( fabs(d[2]) > fabs(d[kz]) ) kz = 2;
+    int kx = (kz + 1) % 3;
+    int ky = (kx + 1) % 3;
+    if( d[kz] < 0.0 )
+        std::swap( kx, ky );
+
+    Real Sx = d[kx] / d[kz];
+    Real Sy = d[ky] / d[kz];
+    Real Sz = (Real)1.0 / d[kz];
+
+    Vec3r A = a - p;
+    Vec3r B = b - p;
+    Vec3r C = c - p;
+
+    Real Ax = A[kx] - Sx * A[kz];
+    Real Ay = A[ky] - Sy * A[kz];
+    Real Bx = B[kx] - Sx * B[kz];
+    Real By = B[ky] - Sy * B[kz];
+    Real Cx = C[kx] - Sx * C[kz];
+    Real Cy = C[ky] - Sy * C[kz];
+
+    Real U = Cx * By - Cy * Bx;
+    Real V = Ax * Cy - Ay * Cx;
+    Real W = Bx * Ay - By * Ax;
+
+    if( (U < 0.0 || V < 0.0 || W < 0.0) && (U > 0.0 || V > 0.0 || W > 0.0) )
+        return false;
+
+    Real det = U + V + W;
+    if( det == 0.0 )
+        return false;
+
+    t = (U * Sz * A[kz] + V * Sz * B[kz] + W * Sz * C[kz]) / det;
+    if( t <= RAY_EPSILON + NORMAL_EPSILON || t >= tMax )
+        return false;
+
+    weightA = U / det;
+    weightB = V / det;
+    return true;
+}
+
+#else
+
+// Moller-Trumbore, on the edges addFace() worked out: one cross product
+// for the determinant, one more for the second barycentric weight, and
+// the weights fall out of the same numbers used to reject the miss
+static bool hitTriangle( const Vec3r& a, const Vec3r& e1, const Vec3r& e2, const Vec3r& p, const Vec3r& d,
+    Real tMax, Real& t, Real& weightA, Real& weightB )
+{
+    Vec3r pvec = d ^ e2;
+    Real det = e1 * pvec;
+
+    if( det == 0.0 ) {
+        // The ray is parallel to the plane, no intersection
+        return false;
+    }
+
+    Real invDet = (Real)1.0 / det;
+    Vec3r tvec = p - a;
+
+    Real u = (tvec * pvec) * invDet;
+    if( u < 0.0 || u > 1.0 )
+        return false;
+
+    Vec3r qvec = tvec ^ e1;
+    Real v = (d * qvec) * invDet;
+    if( v < 0.0 || u + v > 1.0 )
+        return false;
+
+    t = (e2 * qvec) * invDet;
+    if( t <= RAY_EPSILON + NORMAL_EPSILON || t >= tMax )
+        return false;
+
+    weightA = (Real)1.0 - u - v;
+    weightB = u;
+    return true;
+}
+
+#endif
+
+static Vec3r toReal( const Vec3d& v )
+{
+    return Vec3r( (Real)v[0], (Real)v[1], (Real)v[2] );
+}
+
+// A limit past what Real can hold (a shadow ray to a directional light
+// goes on forever) becomes the largest one it can
+static Real toRealLimit( double tMax )
+{
+    return (Real)std::min( tMax, (double)std::numeric_limits<Real>::max() );
+}
+
+// Calculates and returns the normal of the triangle too. The vertices are
+// stored as floats; the arithmetic is done in Real, double unless built
+// with SINGLE_PRECISION.
+bool Trimesh::intersectTriangle( int k, const ray& r, isect& i ) const
+{
+    const Vec3r a = realVertex( indices[3*k] );
+    const Vec3r p = toReal( r.getPosition() );
+    const Vec3r d = toReal( r.getDirection() );
+    Real t, weightA, weightB;
+
+#ifdef TRIANGLE_KERNEL_WATERTIGHT
+    const Vec3r b = realVertex( indices[3*k + 1] );
+    const Vec3r c = realVertex( indices[3*k + 2] );
+    if( !hitTriangle( a, b, c, p, d, std::numeric_limits<Real>::max(), t, weightA, weightB ) )
+        return false;
+    Vec3r normalVector = (b - a) ^ (c - a);
+#else
+    const Vec3r e1 = realEdge( edges[k].e1 );
+    const Vec3r e2 = realEdge( edges[k].e2 );
+    if( !hitTriangle( a, e1, e2, p, d, std::numeric_limits<Real>::max(), t, weightA, weightB ) )
+        return false;
+    Vec3r normalVector = e1 ^ e2;
+#endif
+
+    i.setT( t );
+
+    // Not normalized; Geometry::intersect() does that when it takes the
+    // normal to world space
+    i.setN( Vec3d( normalVector[0], normalVector[1], normalVector[2] ) );
+    i.setObject( this );
+
+    // Texture coordinates are the barycentric weights of the first two
+    // vertices, as they always have been
+    i.setUVCoordinates( Vec2d( weightA, weightB ) );
+    i.setPrimitive( k );
+    return true;
+}
+
+bool Trimesh::occludedTriangle( int k, const ray& r, double tMax ) const
+{
+    const Vec3r a = realVertex( indices[3*k] );
+    const Vec3r p = toReal( r.getPosition() );
+    const Vec3r d = toReal( r.getDirection() );
+    Real t, weightA, weightB;
+
+#ifdef TRIANGLE_KERNEL_WATERTIGHT
+    return hitTriangle( a, realVertex( indices[3*k + 1] ), realVertex( indices[3*k + 2] ), p, d, toRealLimit( tMax ), t, weightA, weightB );
+#else
+    return hitTriangle( a, realEdge( edges[k].e1 ), realEdge( edges[k].e2 ), p, d, toRealLimit( tMax ), t, weightA, weightB );
+#endif
+}
+
+#endif
 
 void
 Trimesh::generateNormals()
 // Once you've loaded all the verts and faces, we can generate per
 // vertex normals by averaging the normals of the neighboring faces.
 {
+    // A mapped file's normals are there already, and can't be replaced
+    if( normals.isView() )
+        return;
+
     int cnt = vertices.size();
-    normals.resize( cnt );
+    // summed in double, then stored as floats like the vertices
+    std::vector<Vec3d> sums( cnt );
     int *numFaces = new int[ cnt ]; // the number of faces assoc. with each vertex
     memset( numFaces, 0, sizeof(int)*cnt );
     
-    for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
+    for( int f = 0; f < triangleCount(); ++f )
     {
-        Vec3d a = vertices[(**fi)[0]];
-        Vec3d b = vertices[(**fi)[1]];
-        Vec3d c = vertices[(**fi)[2]];
+        const uint32_t *face = &indices[3*f];
+        Vec3d a = vertex( face[0] );
+        Vec3d b = vertex( face[1] );
+        Vec3d c = vertex( face[2] );
         
         Vec3d faceNormal = ((b-a) ^ (c-a));
 		faceNormal.normalize();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            sums[face[i]] += faceNormal;
+            ++numFaces[face[i]];
         }
     }
 
+    normals.resize( cnt );
+    Vec3f *n = normals.writable();
     for( int i = 0; i < cnt; ++i )
     {
         if( numFaces[i] )
-            normals[i]  /= numFaces[i];
+            sums[i]  /= numFaces[i];
+        n[i] = Vec3f( sums[i][0], sums[i][1], sums[i][2] );
     }
 
     delete [] numFaces;
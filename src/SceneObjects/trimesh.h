@@ -3,45 +3,116 @@
 
 #include <list>
 #include <vector>
+#include <string>
+#include <stdint.h>
 
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
-class TrimeshFace;
-
+#include "../scene/bvh.h"
+#include "../scene/flatarray.h"
+#include "../fileio/mappedfile.h"
+
+// The ray/triangle test is picked when building. The default is
+// Moller-Trumbore, on two edge vectors per triangle worked out once when
+// the face is added. Define TRIANGLE_KERNEL_WATERTIGHT for the watertight
+// test of Woop, Benthin and Wald, which never lets a ray through the
+// crack between two triangles sharing an edge, or TRIANGLE_KERNEL_PLANE
+// for the original plane-then-inside test, to benchmark against
+// (make DEFINES=-DTRIANGLE_KERNEL_WATERTIGHT). A SINGLE_PRECISION build
+// gets the watertight test unless it asks for another: Moller-Trumbore in
+// float lets enough rays through between triangles to speckle the meshes.
+#if defined(SINGLE_PRECISION) && !defined(TRIANGLE_KERNEL_MOLLER_TRUMBORE) && !defined(TRIANGLE_KERNEL_PLANE)
+#define TRIANGLE_KERNEL_WATERTIGHT
+#endif
+#if !defined(TRIANGLE_KERNEL_WATERTIGHT) && !defined(TRIANGLE_KERNEL_PLANE)
+#define TRIANGLE_KERNEL_MOLLER_TRUMBORE
+#endif
+
+// A triangle mesh, kept as plain arrays: single precision vertex
+// positions, three 32 bit vertex indices per triangle, and per-vertex
+// normals and materials only if the mesh was given (or generated) them.
+// The arrays are either parsed into the mesh or, for a mesh from an
+// .rmesh file, read straight out of the file mapped into memory.
+// Rounding the positions to float moves a mesh a hundred units across by
+// about a float's step there, which is more than RAY_EPSILON, so a ray
+// leaving a triangle has to start from offsetRayOrigin() (ray.h) to miss it.
+// Triangles aren't objects of their own; the mesh's BVH refers to them by
+// number and the mesh tests them itself, in its local space.
 class Trimesh : public MaterialSceneObject
 {
-    friend class TrimeshFace;
-    typedef std::vector<Vec3d> Normals;
-    typedef std::vector<Vec3d> Vertices;
-    typedef std::vector<TrimeshFace*> Faces;
+    typedef FlatArray<Vec3f> Normals;
+    typedef FlatArray<Vec3f> Vertices;
+    typedef FlatArray<uint32_t> Indices;
     typedef std::vector<Material*> Materials;
     Vertices vertices;
-    Faces faces;
+    Indices indices;
     Normals normals;
     Materials materials;
 
-    // BVH specific
+#ifdef TRIANGLE_KERNEL_MOLLER_TRUMBORE
+    // b - a and c - a for each triangle, for the intersection test
+    struct TriangleEdges
+    {
+        Vec3f e1, e2;
+    };
+    std::vector<TriangleEdges> edges;
+    void computeEdges();
+#endif
+
+    // The .rmesh file the arrays are in, if they came from one
+    MappedFile *meshFile;
+
+    // Whether the mesh was read from a file (see loadFile())
+    bool fromFile;
+    friend class TrimeshSink;
+
+    // BVH specific: the bottom level tree over the triangles, built in the
+    // mesh's local space so it doesn't care where the mesh is placed
     BVH *bvh;
+
+    // The trimesh whose vertices, triangles and BVH this one uses. That's
+    // this one, unless it is another instance of an earlier mesh
+    const Trimesh *mesh;
+
+    // Whether another trimesh uses this one's geometry
+    mutable bool instanced;
 public:
     Trimesh( Scene *scene, Material *mat, TransformNode *transform )
-        : MaterialSceneObject(scene, mat), 
+        : MaterialSceneObject(scene, mat),
+			meshFile(0),
+			fromFile(false),
+			bvh(0),
+			mesh(this),
+			instanced(false),
 			displayListWithMaterials(0),
 			displayListWithoutMaterials(0)
     {
         this->transform = transform;
     }
 
-    // This is needed for the trimesh on bvh creation, otherwise I get a seg fault,
-    // as it isn't able to properly parse for the trimesh faces
-	virtual void createBVH() {
-		bvh = new BVHNode<TrimeshFace>(faces);
-	}
+    // Reuse source's geometry under this trimesh's own transform and
+    // material, instead of holding a copy of it
+    void setInstanceOf( const Trimesh *source ) { mesh = source->mesh; mesh->instanced = true; }
+    bool isInstance() const { return mesh != this; }
+
+    // Bakes the transform into the vertices, unless the geometry is shared
+    virtual bool moveToWorldSpace( TransformNode* world );
 
-	bool intersectLocal(const ray&r, isect&i) const { return false; } 
+	virtual void createBVH( const BVHBuildOptions& options );
+	virtual const BVH* bottomLevelBVH() const { return isInstance() ? 0 : bvh; }
+	virtual size_t geometryBytes() const;
+
+	bool intersectLocal(const ray&r, isect&i) const;
+	bool occludedLocal(const ray&r, double tMax) const;
+	uint32_t intersectLocalPacket( const RayPacket& packet, uint32_t mask, isect* hits ) const;
+	uint32_t occludedLocalPacket( const RayPacket& packet, uint32_t mask, const double* tMax ) const;
+
+    virtual bool hasBoundingBoxCapability() const { return true; }
+    virtual BoundingBox ComputeLocalBoundingBox();
 
     ~Trimesh();
-    
+
     // must add vertices, normals, and materials IN ORDER
     void addVertex( const Vec3d & );
     void addMaterial( Material *m );
@@ -49,51 +120,110 @@ public:
 
     bool addFace( int a, int b, int c );
 
+    // A whole list of vertices or normals at once, three numbers each,
+    // and room for count more faces before adding them
+    void addVertices( const double *xyz, size_t count );
+    void addNormals( const double *xyz, size_t count );
+    void reserveFaces( size_t count );
+
+    // Use the vertices, faces and normals in an .rmesh file (see rmesh.h)
+    // instead of adding them. Returns 0, or what's wrong with the file
+    const char *mapFile( const std::string& path );
+    bool isMapped() const { return meshFile != 0; }
+
+    // Read the mesh out of a file: an .rmesh is mapped (as above), an
+    // .obj or .ply imported (see meshimport.h). Returns false, with what
+    // went wrong in error, if it can't
+    bool loadFile( const std::string& path, std::string& error );
+    bool hasFile() const { return fromFile; }
+
+    // Save the vertices, faces and normals as an .rmesh file
+    bool writeFile( const std::string& path ) const;
+
+    // Whether other has exactly these vertices, faces and normals
+    bool sameGeometry( const Trimesh& other ) const;
+    int vertexCount() const { return vertices.size(); }
+
     char *doubleCheck();
-    
+
     void generateNormals();
 
+    // The triangles, by number, in the mesh's local space. These only look
+    // at this trimesh's own arrays, so an instance goes through its mesh
+    int triangleCount() const { return indices.size() / 3; }
+    BoundingBox triangleBounds( int k ) const;
+    bool intersectTriangle( int k, const ray& r, isect& i ) const;
+    bool occludedTriangle( int k, const ray& r, double tMax ) const;
+
+    // Which of the kernels above was compiled in, for the statistics
+    static const char *triangleKernel();
+
 protected:
 	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
 
 	mutable int displayListWithMaterials;
 	mutable int displayListWithoutMaterials;
-};
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
+private:
+    Vec3d vertex( uint32_t v ) const
     {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
+        const Vec3f& p = vertices[v];
+        return Vec3d( p[0], p[1], p[2] );
     }
 
-    int operator[]( int i ) const
+    // The triangle tests' numbers, in the hot path's precision (see Real)
+    Vec3r realVertex( uint32_t v ) const
     {
-        return ids[i];
+        const Vec3f& p = vertices[v];
+        return Vec3r( p[0], p[1], p[2] );
     }
 
-    virtual bool intersectLocal( const ray& r, isect& i ) const;
-
-    virtual bool hasBoundingBoxCapability() const { return true; }
-      
-    virtual BoundingBox ComputeLocalBoundingBox()
+    static Vec3r realEdge( const Vec3f& e )
     {
-        BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-        
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
-        return localbounds;
+        return Vec3r( e[0], e[1], e[2] );
     }
- };
+};
+
+// What a trimesh's BVH holds: its triangles, tested in the mesh's local
+// space. The ray has already been transformed once for the whole mesh
+// by Geometry::intersect(), so they go straight to the triangle tests
+struct TrimeshTriangles
+{
+	TrimeshTriangles( const Trimesh* mesh )
+		: mesh( mesh ) {}
+
+	int size() const { return mesh->triangleCount(); }
+	BoundingBox bounds( int k ) const { return mesh->triangleBounds(k); }
+	bool intersect( int k, const ray& r, isect& i ) const { return mesh->intersectTriangle(k, r, i); }
+	bool occluded( int k, const ray& r, double tMax ) const { return mesh->occludedTriangle(k, r, tMax); }
+
+	// A packet's rays, one at a time, against one triangle
+	uint32_t intersectPacket( int k, const RayPacket& packet, RayMask mask, isect* hits ) const
+	{
+		uint32_t found = 0;
+		for (int r = 0; r < packet.size; r++) {
+			isect cur;
+			if ((mask & (1u << r)) && mesh->intersectTriangle(k, packet.getRay(r), cur) && cur.t < hits[r].t) {
+				hits[r] = cur;
+				found |= 1u << r;
+			}
+		}
+		return found;
+	}
+
+	uint32_t occludedPacket( int k, const RayPacket& packet, RayMask mask, const double* tMax ) const
+	{
+		uint32_t blocked = 0;
+		for (int r = 0; r < packet.size; r++) {
+			if ((mask & (1u << r)) && mesh->occludedTriangle(k, packet.getRay(r), tMax[r])) {
+				blocked |= 1u << r;
+			}
+		}
+		return blocked;
+	}
+
+	const Trimesh* mesh;
+};
 
 
 #endif // TRIMESH_H__
@@ -0,0 +1,155 @@
+#include "TileScheduler.h"
+#include "RayTracer.h"
+#include "WavefrontIntegrator.h"
+
+#include <algorithm>
+#include <thread>
+
+TileScheduler::TileScheduler( RayTracer* tracer, int width, int height, int tileSize, int numThreads )
+	: raytracer( tracer ), width( width ), height( height ), tileSize( tileSize ), numThreads( numThreads ), numTiles( 0 )
+{
+	if (this->tileSize < 1) {
+		this->tileSize = 1;
+	}
+	if (this->numThreads < 1) {
+		this->numThreads = hardwareThreads();
+	}
+
+	for (int i = 0; i < this->numThreads; i++) {
+		queues.push_back(new WorkQueue());
+	}
+
+	int tilesAcross = (width + this->tileSize - 1) / this->tileSize;
+	int tilesDown = (height + this->tileSize - 1) / this->tileSize;
+	numTiles = tilesAcross * tilesDown;
+}
+
+TileScheduler::~TileScheduler()
+{
+	for (size_t i = 0; i < queues.size(); i++) {
+		delete queues[i];
+	}
+}
+
+int TileScheduler::hardwareThreads()
+{
+	int threads = std::thread::hardware_concurrency();
+	return threads > 0 ? threads : 1;
+}
+
+// Deal the tiles out round-robin in scanline order, so every worker starts
+// with a spread of tiles from the whole image rather than one band of it
+void TileScheduler::dealTiles()
+{
+	int n = 0;
+
+	for (int y = 0; y < height; y += tileSize) {
+		for (int x = 0; x < width; x += tileSize) {
+			Tile tile;
+			tile.x0 = x;
+			tile.y0 = y;
+			tile.x1 = std::min(x + tileSize, width);
+			tile.y1 = std::min(y + tileSize, height);
+
+			queues[n % numThreads]->tiles.push_back(tile);
+			n++;
+		}
+	}
+}
+
+void TileScheduler::render()
+{
+	dealTiles();
+
+	// The debugging ray recorder is shared state, so it can only be
+	// filled in while a single thread is tracing
+	bool recordRays = raytracer->rayRecordingEnabled();
+	if (numThreads > 1) {
+		raytracer->enableRayRecording(false);
+	}
+
+	// The calling thread does its share of the work as worker 0, so a single
+	// threaded render never has to start a thread at all
+	std::vector<std::thread> workers;
+
+	for (int i = 1; i < numThreads; i++) {
+		workers.push_back(std::thread(&TileScheduler::workerLoop, this, i));
+	}
+
+	workerLoop(0);
+
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+
+	raytracer->enableRayRecording(recordRays);
+}
+
+void TileScheduler::workerLoop( int worker )
+{
+	Tile tile;
+
+	// Each worker keeps its own queues, reused from tile to tile
+	WavefrontIntegrator wavefront(raytracer);
+
+	while (nextTile(worker, tile)) {
+		traceTile(tile, wavefront);
+	}
+}
+
+// Take the next tile from the front of this worker's own queue. If it is
+// empty, steal from the back of the other queues, starting with the
+// neighbouring worker so that the thieves spread out over the victims.
+// Returns false once every queue has been drained.
+bool TileScheduler::nextTile( int worker, Tile& tile )
+{
+	{
+		WorkQueue* own = queues[worker];
+		std::lock_guard<std::mutex> guard(own->lock);
+
+		if (!own->tiles.empty()) {
+			tile = own->tiles.front();
+			own->tiles.pop_front();
+			return true;
+		}
+	}
+
+	for (int i = 1; i < numThreads; i++) {
+		WorkQueue* victim = queues[(worker + i) % numThreads];
+		std::lock_guard<std::mutex> guard(victim->lock);
+
+		if (!victim->tiles.empty()) {
+			tile = victim->tiles.back();
+			victim->tiles.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Tiles never overlap, so each pixel of RayTracer::buffer is written by
+// exactly one thread and no locking is needed around tracePixel
+void TileScheduler::traceTile( const Tile& tile, WavefrontIntegrator& wavefront )
+{
+	if (raytracer->wavefrontEnabled()) {
+		wavefront.traceTile(tile.x0, tile.y0, tile.x1, tile.y1);
+		return;
+	}
+
+	if (raytracer->packetTracingEnabled()) {
+		// 4x4 blocks of pixels, one packet of rays each
+		for (int j = tile.y0; j < tile.y1; j += PACKET_SIDE) {
+			for (int i = tile.x0; i < tile.x1; i += PACKET_SIDE) {
+				raytracer->tracePacket(i, j, std::min(i + PACKET_SIDE, tile.x1), std::min(j + PACKET_SIDE, tile.y1));
+			}
+		}
+		return;
+	}
+
+	for (int j = tile.y0; j < tile.y1; j++) {
+		for (int i = tile.x0; i < tile.x1; i++) {
+			raytracer->tracePixel(i, j);
+		}
+	}
+}
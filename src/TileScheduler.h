@@ -0,0 +1,63 @@
+#ifndef __TILESCHEDULER_H__
+#define __TILESCHEDULER_H__
+
+// Splits the image into square tiles and hands them out to a pool of
+// render threads. Each worker owns a queue of tiles; once its own queue
+// runs dry it steals from the back of the other workers' queues, so a
+// thread that drew the empty corner of the scene keeps busy helping
+// with the expensive tiles instead of sitting idle.
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+class RayTracer;
+class WavefrontIntegrator;
+
+class TileScheduler
+{
+public:
+	TileScheduler( RayTracer* tracer, int width, int height, int tileSize, int numThreads );
+	~TileScheduler();
+
+	// Trace every pixel of the image, blocking until all tiles are done.
+	// Can be called again to trace the image over
+	void render();
+
+	int getThreadCount() const { return numThreads; }
+	int getTileCount() const { return numTiles; }
+
+	// Number of hardware threads, never less than 1
+	static int hardwareThreads();
+
+private:
+	// Pixels along each side of the blocks traced as one ray packet
+	static const int PACKET_SIDE = 4;
+
+	struct Tile
+	{
+		int x0, y0;		// top left corner, inclusive
+		int x1, y1;		// bottom right corner, exclusive
+	};
+
+	struct WorkQueue
+	{
+		std::mutex lock;
+		std::deque<Tile> tiles;
+	};
+
+	void dealTiles();
+	void workerLoop( int worker );
+	bool nextTile( int worker, Tile& tile );
+	void traceTile( const Tile& tile, WavefrontIntegrator& wavefront );
+
+	RayTracer* raytracer;
+	int width, height;
+	int tileSize;
+	int numThreads;
+	int numTiles;
+
+	std::vector<WorkQueue*> queues;
+};
+
+#endif // __TILESCHEDULER_H__
@@ -0,0 +1,308 @@
+#include "WavefrontIntegrator.h"
+#include "RayTracer.h"
+#include "scene/scene.h"
+#include "scene/light.h"
+#include "scene/material.h"
+#include "ui/TraceUI.h"
+
+#include <algorithm>
+
+extern TraceUI* traceUI;
+
+// The ray queues' rays sort into this many octant buckets
+static const int OCTANT_KEYS = 64;
+
+// Made on the render thread that uses it, so it gets that thread's arena
+WavefrontIntegrator::WavefrontIntegrator( RayTracer* tracer )
+	: raytracer( tracer ),
+	  queued( Arena::frame() ), batch( Arena::frame() ),
+	  hits( Arena::frame() ), hit( Arena::frame() ), blockedLights( Arena::frame() ),
+	  shadowsTraced( false ),
+	  samples( Arena::frame() ), supersampled( Arena::frame() )
+{
+}
+
+WavefrontIntegrator::RayQueue::RayQueue( Arena& arena )
+	: position( arena ), direction( arena ), type( arena ), weight( arena ),
+	  sample( arena ), depth( arena ), glossyReflectionDepth( arena ), sampler( arena )
+{
+}
+
+void WavefrontIntegrator::RayQueue::push( const Vec3d& p, const Vec3d& d, ray::RayType t, const Vec3d& w, int s,
+	int rayDepth, int glossyDepth, const Sampler& rayStream )
+{
+	position.push_back(p);
+	direction.push_back(d);
+	type.push_back((unsigned char)t);
+	weight.push_back(w);
+	sample.push_back(s);
+	depth.push_back(rayDepth);
+	glossyReflectionDepth.push_back(glossyDepth);
+	sampler.push_back(rayStream);
+}
+
+void WavefrontIntegrator::RayQueue::append( const RayQueue& other, int k )
+{
+	push(other.position[k], other.direction[k], (ray::RayType)other.type[k], other.weight[k], other.sample[k],
+		other.depth[k], other.glossyReflectionDepth[k], other.sampler[k]);
+}
+
+void WavefrontIntegrator::RayQueue::resize( int n )
+{
+	position.resize(n);
+	direction.resize(n);
+	type.resize(n);
+	weight.resize(n);
+	sample.resize(n);
+	depth.resize(n);
+	glossyReflectionDepth.resize(n);
+	sampler.resize(n);
+}
+
+// Works like tracePixel(), including antialiasing's five samples first
+// to find out whether a pixel needs any more, only a tile at a time
+void WavefrontIntegrator::traceTile( int x0, int y0, int x1, int y1 )
+{
+	const BoundingBox& bounds = raytracer->scene->bounds();
+	sceneCenter = (bounds.min + bounds.max) / 2;
+
+	double width = raytracer->buffer_width;
+	double height = raytracer->buffer_height;
+
+	if (!raytracer->m_enableAntialiasing) {
+		samples.assign((x1 - x0) * (y1 - y0), Vec3d(0.0, 0.0, 0.0));
+
+		int n = 0;
+		for (int j = y0; j < y1; j++) {
+			for (int i = x0; i < x1; i++, n++) {
+				addCameraRay(n, i / width, j / height, Sampler(i, j, 0));
+			}
+		}
+		traceQueued();
+
+		n = 0;
+		for (int j = y0; j < y1; j++) {
+			for (int i = x0; i < x1; i++, n++) {
+				samples[n].clamp();
+				raytracer->setPixel(i, j, samples[n]);
+			}
+		}
+		return;
+	}
+
+	// The four corners and the center of each pixel
+	static const int PRE_SAMPLES = 5;
+	static const double corners[PRE_SAMPLES][2] = { { -1, -1 }, { -1, 1 }, { 1, -1 }, { 1, 1 }, { 0, 0 } };
+	int totalSamples = traceUI->getAntialiasingSamples();
+
+	samples.assign((x1 - x0) * (y1 - y0) * PRE_SAMPLES, Vec3d(0.0, 0.0, 0.0));
+
+	int n = 0;
+	for (int j = y0; j < y1; j++) {
+		for (int i = x0; i < x1; i++, n++) {
+			for (int k = 0; k < PRE_SAMPLES; k++) {
+				addCameraRay(n * PRE_SAMPLES + k, i / width + corners[k][0], j / height + corners[k][1],
+					Sampler(i, j, totalSamples + k));
+			}
+		}
+	}
+	traceQueued();
+
+	// The pixels that aren't pure black get supersampled
+	supersampled.clear();
+
+	n = 0;
+	for (int j = y0; j < y1; j++) {
+		for (int i = x0; i < x1; i++, n++) {
+			Vec3d col;
+			for (int k = 0; k < PRE_SAMPLES; k++) {
+				Vec3d sample = samples[n * PRE_SAMPLES + k];
+				sample.clamp();
+				col += sample;
+			}
+			col = col / PRE_SAMPLES;
+
+			if (col[0] != 0 || col[1] != 0 || col[2] != 0) {
+				supersampled.push_back(j * raytracer->buffer_width + i);
+			} else {
+				raytracer->setPixel(i, j, col);
+			}
+		}
+	}
+
+	if (supersampled.empty()) {
+		return;
+	}
+
+	samples.assign(supersampled.size() * totalSamples, Vec3d(0.0, 0.0, 0.0));
+
+	for (size_t p = 0; p < supersampled.size(); p++) {
+		int i = supersampled[p] % raytracer->buffer_width;
+		int j = supersampled[p] / raytracer->buffer_width;
+
+		for (int k = 0; k < totalSamples; k++) {
+			Sampler sampler(i, j, k);
+			double randomXValue = (sampler.next() * 2 - 1) / width;
+			double randomYValue = (sampler.next() * 2 - 1) / height;
+			addCameraRay(p * totalSamples + k, i / width + randomXValue, j / height + randomYValue, sampler);
+		}
+	}
+	traceQueued();
+
+	for (size_t p = 0; p < supersampled.size(); p++) {
+		Vec3d col;
+		for (int k = 0; k < totalSamples; k++) {
+			Vec3d sample = samples[p * totalSamples + k];
+			sample.clamp();
+			col += sample;
+		}
+		raytracer->setPixel(supersampled[p] % raytracer->buffer_width, supersampled[p] / raytracer->buffer_width,
+			col / totalSamples);
+	}
+}
+
+void WavefrontIntegrator::addCameraRay( int sampleIndex, double x, double y, const Sampler& sampler )
+{
+	ray r( Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY );
+	raytracer->scene->getCamera().rayThrough( x, y, r );
+
+	int initialGlossyDepth = raytracer->m_enableGlossyReflection ? 10 : 0;
+	queued.push(r.getPosition(), r.getDirection(), ray::VISIBILITY, Vec3d(1.0, 1.0, 1.0), sampleIndex,
+		traceUI->getDepth(), initialGlossyDepth, sampler);
+}
+
+// Run batches through the stages until no rays are left. The batches come
+// off the end of the queue, where the last batch's reflections and
+// refractions went, so a tile's rays are followed down bounce by bounce
+// and the queue never holds much more than a batch per bounce
+void WavefrontIntegrator::traceQueued()
+{
+	while (queued.size() > 0) {
+		takeBatch();
+		intersectBatch();
+		traceShadows();
+		shadeBatch();
+	}
+}
+
+// Which way a ray goes (one bit per axis for the sign of its direction),
+// and which side of the scene's center it starts on
+int WavefrontIntegrator::octantKey( const Vec3d& position, const Vec3d& direction ) const
+{
+	int key = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		if (direction[axis] < 0) {
+			key |= 1 << axis;
+		}
+		if (position[axis] < sceneCenter[axis]) {
+			key |= 8 << axis;
+		}
+	}
+	return key;
+}
+
+// Move the last BATCH_SIZE queued rays into batch, counting sorted by
+// octant. Rays with the same key keep their order, so the camera rays of
+// a tile stay in scanline order
+void WavefrontIntegrator::takeBatch()
+{
+	int count = std::min(queued.size(), BATCH_SIZE);
+	int first = queued.size() - count;
+
+	int keys[BATCH_SIZE];
+	int bucketStart[OCTANT_KEYS + 1] = { 0 };
+	for (int k = 0; k < count; k++) {
+		keys[k] = octantKey(queued.position[first + k], queued.direction[first + k]);
+		bucketStart[keys[k] + 1]++;
+	}
+	for (int b = 0; b < OCTANT_KEYS; b++) {
+		bucketStart[b + 1] += bucketStart[b];
+	}
+
+	int order[BATCH_SIZE];
+	for (int k = 0; k < count; k++) {
+		order[bucketStart[keys[k]]++] = first + k;
+	}
+
+	batch.resize(0);
+	for (int k = 0; k < count; k++) {
+		batch.append(queued, order[k]);
+	}
+	queued.resize(first);
+}
+
+void WavefrontIntegrator::intersectBatch()
+{
+	if (hits.size() < (size_t)batch.size()) {
+		hits.resize(batch.size());
+		hit.resize(batch.size());
+		blockedLights.resize(batch.size());
+	}
+
+	for (int k = 0; k < batch.size(); k++) {
+		ray r( batch.position[k], batch.direction[k], (ray::RayType)batch.type[k] );
+
+		// Starting over with an empty isect also drops any material the
+		// last hit in this slot set
+		hits[k] = isect();
+		hit[k] = raytracer->scene->intersect(r, hits[k]);
+	}
+}
+
+// The same shadow rays Material::shade() would trace, light by light
+// across the batch. Like the packet tracer, a scene with more lights than
+// there are bits for leaves them to shade()
+void WavefrontIntegrator::traceShadows()
+{
+	Scene* scene = raytracer->scene;
+	shadowsTraced = scene->endLights() - scene->beginLights() <= 32;
+	if (!shadowsTraced) {
+		return;
+	}
+
+	for (int k = 0; k < batch.size(); k++) {
+		blockedLights[k] = 0;
+	}
+
+	int l = 0;
+	for (std::vector<Light*>::const_iterator litr = scene->beginLights(); litr != scene->endLights(); ++litr, ++l) {
+		for (int k = 0; k < batch.size(); k++) {
+			if (!hit[k]) {
+				continue;
+			}
+
+			ray r( batch.position[k], batch.direction[k], (ray::RayType)batch.type[k] );
+			double tMax;
+			Vec3d P = r.at(hits[k].t);
+			ray shadowRay = (*litr)->shadowRay( offsetRayOrigin(P, hits[k].N, (*litr)->getDirection(P)), tMax );
+			if (scene->occluded( shadowRay, tMax )) {
+				blockedLights[k] |= 1u << l;
+			}
+		}
+	}
+}
+
+// Misses add nothing: the background is black
+void WavefrontIntegrator::shadeBatch()
+{
+	SecondaryRay secondary[RayTracer::MAX_SECONDARY_RAYS];
+
+	for (int k = 0; k < batch.size(); k++) {
+		if (!hit[k]) {
+			continue;
+		}
+
+		ray r( batch.position[k], batch.direction[k], (ray::RayType)batch.type[k] );
+		const isect& i = hits[k];
+
+		const Material& m = i.getMaterial();
+		Vec3d shading = m.shade(raytracer->scene, r, i, shadowsTraced ? &blockedLights[k] : 0);
+		samples[batch.sample[k]] += prod(batch.weight[k], shading);
+
+		int count = raytracer->secondaryRays(r, i, batch.depth[k], batch.glossyReflectionDepth[k], batch.sampler[k], secondary);
+		for (int s = 0; s < count; s++) {
+			queued.push(secondary[s].position, secondary[s].direction, secondary[s].type, prod(batch.weight[k], secondary[s].weight),
+				batch.sample[k], secondary[s].depth, secondary[s].glossyReflectionDepth, secondary[s].sampler);
+		}
+	}
+}
@@ -0,0 +1,91 @@
+#ifndef __WAVEFRONTINTEGRATOR_H__
+#define __WAVEFRONTINTEGRATOR_H__
+
+// A second way of tracing a tile, next to RayTracer::traceRay()'s
+// recursion. Instead of following each ray down through all its bounces
+// before starting on the next one, rays wait in queues and every stage of
+// the work is run over a whole batch of them at once:
+//
+//   camera     the rays through each of the tile's samples
+//   intersect  a batch of rays against the scene, sorted first so rays
+//              heading the same way from the same part of the scene go
+//              through the BVH one after another
+//   shadow     the shadow rays from every hit in the batch, light by light
+//   shade      each hit's own color, added into its sample weighted by the
+//              path that led to it, and its reflected and refracted rays
+//              queued up for a later batch
+//
+// The colors of a path are added up in a different order than the
+// recursion adds them, so a pixel can come out one step off here and
+// there, but otherwise the image is the same.
+
+#include "scene/ray.h"
+#include "scene/sampler.h"
+#include "scene/arena.h"
+
+#include <vector>
+#include <stdint.h>
+
+class RayTracer;
+
+class WavefrontIntegrator
+{
+public:
+	WavefrontIntegrator( RayTracer* tracer );
+
+	// Trace the pixels [x0, x1) x [y0, y1) into the ray tracer's buffer
+	void traceTile( int x0, int y0, int x1, int y1 );
+
+	// Most rays taken from the queue to intersect at once
+	static const int BATCH_SIZE = 1024;
+
+private:
+	// Rays as a structure of arrays, one entry per ray in each
+	struct RayQueue
+	{
+		RayQueue( Arena& arena );
+
+		ArenaVector<Vec3d> position;
+		ArenaVector<Vec3d> direction;
+		ArenaVector<unsigned char> type;
+		ArenaVector<Vec3d> weight;		// what the ray's color is multiplied by in its sample
+		ArenaVector<int> sample;		// which of the tile's samples it adds into
+		ArenaVector<int> depth;
+		ArenaVector<int> glossyReflectionDepth;
+		ArenaVector<Sampler> sampler;
+
+		int size() const { return (int)position.size(); }
+		void push( const Vec3d& p, const Vec3d& d, ray::RayType t, const Vec3d& w, int s,
+			int rayDepth, int glossyDepth, const Sampler& rayStream );
+		void append( const RayQueue& other, int k );
+		void resize( int n );
+	};
+
+	void addCameraRay( int sampleIndex, double x, double y, const Sampler& sampler );
+	void traceQueued();
+
+	// The stages
+	void takeBatch();
+	void intersectBatch();
+	void traceShadows();
+	void shadeBatch();
+
+	int octantKey( const Vec3d& position, const Vec3d& direction ) const;
+
+	RayTracer* raytracer;
+
+	// Everything below is scratch space for this frame, in the render
+	// thread's frame arena
+	RayQueue queued;		// rays waiting to be traced
+	RayQueue batch;			// the rays being traced now, sorted
+	ArenaVector<isect> hits;
+	ArenaVector<unsigned char> hit;
+	ArenaVector<uint32_t> blockedLights;	// a bit per light, for each hit
+	bool shadowsTraced;
+
+	ArenaVector<Vec3d> samples;	// the color of each of the tile's samples so far
+	ArenaVector<int> supersampled;	// the pixels antialiasing takes more samples of
+	Vec3d sceneCenter;
+};
+
+#endif // __WAVEFRONTINTEGRATOR_H__
@@ -0,0 +1,42 @@
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+#include "imagediff.h"
+
+ImageDiff compareImages(const unsigned char * a, const unsigned char * b, int width, int height, int tolerance)
+{
+	ImageDiff diff;
+	diff.pixels = width * height;
+	diff.differing = 0;
+	diff.overTolerance = 0;
+	diff.maxDifference = 0;
+
+	double sum = 0.0;
+	double squares = 0.0;
+
+	for (int p = 0; p < diff.pixels; p++) {
+		int worst = 0;
+		for (int rgb = 0; rgb < 3; rgb++) {
+			int d = std::abs(a[3*p + rgb] - b[3*p + rgb]);
+			sum += d;
+			squares += d * d;
+			if (d > worst)
+				worst = d;
+		}
+
+		if (worst > 0)
+			diff.differing++;
+		if (worst > tolerance)
+			diff.overTolerance++;
+		if (worst > diff.maxDifference)
+			diff.maxDifference = worst;
+	}
+
+	int channels = 3 * diff.pixels;
+	diff.meanDifference = channels > 0 ? sum / channels : 0.0;
+
+	double meanSquare = channels > 0 ? squares / channels : 0.0;
+	diff.psnr = meanSquare > 0.0 ? 10.0 * log10(255.0 * 255.0 / meanSquare) : std::numeric_limits<double>::infinity();
+	return diff;
+}
@@ -0,0 +1,26 @@
+//imagediff header file
+
+// Pixel by pixel comparison of two images of the same size, such as a
+// render against a reference traced by another build (SINGLE_PRECISION
+// against double precision) or another way of tracing the same scene.
+
+#ifndef _IMAGEDIFF_H_
+#define _IMAGEDIFF_H_
+
+struct ImageDiff
+{
+	int pixels;				// in each image
+	int differing;			// pixels with any channel different at all
+	int overTolerance;		// pixels with a channel off by more than the tolerance
+	int maxDifference;		// the largest difference of any channel, 0 to 255
+	double meanDifference;	// over every channel of every pixel
+	double psnr;			// peak signal to noise ratio in dB, infinite for identical images
+
+	bool withinTolerance() const { return overTolerance == 0; }
+};
+
+// Compare two width x height RGB images, counting the pixels with any
+// channel more than tolerance apart
+extern ImageDiff compareImages(const unsigned char * a, const unsigned char * b, int width, int height, int tolerance);
+
+#endif
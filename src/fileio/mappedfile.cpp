@@ -0,0 +1,96 @@
+#include "mappedfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+	: base( 0 ), length( 0 ), mapped( false )
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open( const std::string& path )
+{
+	close();
+
+#ifndef _WIN32
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+		::close(fd);
+		return false;
+	}
+
+	void* p = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	// The mapping holds on to the file by itself
+	::close(fd);
+
+	if (p == MAP_FAILED) {
+		return false;
+	}
+
+	base = (const char*)p;
+	length = info.st_size;
+	mapped = true;
+	return true;
+#else
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f) {
+		return false;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	char* buffer = size > 0 ? (char*)malloc(size) : 0;
+	if (!buffer || fread(buffer, 1, size, f) != (size_t)size) {
+		free(buffer);
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+
+	base = buffer;
+	length = size;
+	mapped = false;
+	return true;
+#endif
+}
+
+void MappedFile::close()
+{
+	if (!base) {
+		return;
+	}
+
+#ifndef _WIN32
+	if (mapped) {
+		munmap((void*)base, length);
+	} else {
+		free((void*)base);
+	}
+#else
+	free((void*)base);
+#endif
+
+	base = 0;
+	length = 0;
+	mapped = false;
+}
@@ -0,0 +1,39 @@
+//mappedfile header file
+
+// A whole file, read only, mapped into memory rather than read into a
+// buffer: the pages are only read from disk as they are touched, and the
+// operating system can share them between processes mapping the same
+// file. Platforms without mmap() get the file read into memory instead,
+// behind the same interface.
+
+#ifndef _MAPPEDFILE_H_
+#define _MAPPEDFILE_H_
+
+#include <stddef.h>
+#include <string>
+
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Map the file at path, replacing whatever was mapped before. Returns
+	// false (and maps nothing) if it can't be opened or is empty
+	bool open( const std::string& path );
+	void close();
+
+	const char* data() const { return base; }
+	size_t size() const { return length; }
+
+private:
+	const char* base;
+	size_t length;
+	bool mapped;		// by mmap(), rather than read into a buffer
+
+	// No copying, there would be two owners of the mapping
+	MappedFile( const MappedFile& );
+	MappedFile& operator =( const MappedFile& );
+};
+
+#endif
@@ -0,0 +1,636 @@
+#include "meshimport.h"
+#include "../parser/Tokenizer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+#include <new>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+
+static MeshImportStats totals;
+
+MeshImportStats MeshImportStats::total()
+{
+	return totals;
+}
+
+void MeshImportStats::reset()
+{
+	totals = MeshImportStats();
+}
+
+namespace {
+
+// The file, read a buffer at a time. A line has to fit in the buffer;
+// no mesh file has lines anywhere near that long
+class MeshInput
+{
+public:
+	static const size_t BUFFER_SIZE = 1 << 20;
+
+	MeshInput()
+		: file( 0 ), buffer( BUFFER_SIZE + 1 ), first( 0 ), last( 0 ), atEnd( false ), tooLong( false ), lines( 0 ), bytes( 0 ), size( 0 ) {}
+	~MeshInput() { if (file) fclose(file); }
+
+	bool open( const string& path )
+	{
+		file = fopen(path.c_str(), "rb");
+		if (!file) {
+			return false;
+		}
+
+		if (0 == fseek(file, 0, SEEK_END)) {
+			long end = ftell(file);
+			size = end > 0 ? (uint64_t)end : 0;
+		}
+		rewind(file);
+		return true;
+	}
+
+	// The next line, without its line ending and with a '\0' after it.
+	// Returns false at the end of the file, or if the line is too long
+	bool line( char*& text, char*& textEnd )
+	{
+		for (;;) {
+			char* newline = (char*)memchr(&buffer[first], '\n', last - first);
+
+			if (newline || (atEnd && first < last)) {
+				text = &buffer[first];
+				textEnd = newline ? newline : &buffer[last];
+				first = newline ? newline - &buffer[0] + 1 : last;
+				if (textEnd > text && '\r' == textEnd[-1]) {
+					textEnd--;
+				}
+				*textEnd = '\0';
+				lines++;
+				return true;
+			}
+			if (atEnd) {
+				return false;
+			}
+			if (first == 0 && last == BUFFER_SIZE) {
+				tooLong = true;
+				return false;
+			}
+			fill();
+		}
+	}
+
+	// The next count bytes, for binary files
+	bool read( void* out, size_t count )
+	{
+		char* to = (char*)out;
+		while (count > 0) {
+			if (first == last) {
+				if (atEnd) {
+					return false;
+				}
+				fill();
+				continue;
+			}
+			size_t n = min(count, last - first);
+			memcpy(to, &buffer[first], n);
+			first += n;
+			to += n;
+			count -= n;
+		}
+		return true;
+	}
+
+	int lineNumber() const { return lines; }
+	bool lineTooLong() const { return tooLong; }
+	uint64_t bytesRead() const { return bytes; }
+
+	// How big the file is, or 0 if that can't be told
+	uint64_t fileSize() const { return size; }
+
+private:
+	// Move what's left to the front and read in behind it
+	void fill()
+	{
+		memmove(&buffer[0], &buffer[first], last - first);
+		last -= first;
+		first = 0;
+
+		size_t n = fread(&buffer[last], 1, BUFFER_SIZE - last, file);
+		last += n;
+		bytes += n;
+		atEnd = n == 0;
+	}
+
+	FILE* file;
+	vector<char> buffer;
+	size_t first, last;		// what's been read in and not used yet
+	bool atEnd;
+	bool tooLong;
+	int lines;
+	uint64_t bytes;
+	uint64_t size;
+};
+
+// The next whitespace separated word of a line, in [begin, end)
+bool nextWord( char*& p, char*& begin, char*& end )
+{
+	while (' ' == *p || '\t' == *p) {
+		p++;
+	}
+	begin = p;
+	while (*p && ' ' != *p && '\t' != *p) {
+		p++;
+	}
+	end = p;
+	return begin != end;
+}
+
+bool nextNumber( char*& p, double& value )
+{
+	char *begin, *end;
+	if (!nextWord(p, begin, end)) {
+		return false;
+	}
+	value = Tokenizer::ParseScalar(begin, end);
+	return true;
+}
+
+// An .obj index: from 1, or back from the last one read if negative
+bool parseIndex( const char*& p, const char* end, size_t count, int& index )
+{
+	bool negative = p != end && '-' == *p;
+	if (negative) {
+		p++;
+	}
+	if (p == end || !isdigit((unsigned char)*p)) {
+		return false;
+	}
+
+	long long n = 0;
+	for (; p != end && isdigit((unsigned char)*p) && n < (1LL << 32); p++) {
+		n = n * 10 + (*p - '0');
+	}
+	if (n == 0) {
+		return false;
+	}
+
+	long long resolved = negative ? (long long)count - n : n - 1;
+	index = resolved < 0 || resolved > 0x7fffffff ? -1 : (int)resolved;
+	return true;
+}
+
+string at( const MeshInput& in, const char* what )
+{
+	ostringstream oss;
+	oss << "line " << in.lineNumber() << ": " << what;
+	return oss.str();
+}
+
+// .obj: "v x y z", "vn x y z", and "f v/vt/vn ..." are all that's used.
+// Normals belong to the corners of the faces there rather than to the
+// vertices, so they're only kept if every corner has the normal with
+// the same number as its vertex, as exporters write smooth meshes
+bool importOBJ( MeshInput& in, MeshSink& sink, uint64_t& triangles, string& error )
+{
+	size_t normals = 0;
+	bool normalsMatch = true;
+	vector<int> polygon;
+
+	char *text, *textEnd;
+	while (in.line(text, textEnd)) {
+		char* p = text;
+		char *keyword, *keywordEnd;
+		if (!nextWord(p, keyword, keywordEnd)) {
+			continue;
+		}
+		size_t length = keywordEnd - keyword;
+
+		if (1 == length && 'v' == keyword[0]) {
+			double x, y, z;
+			if (!nextNumber(p, x) || !nextNumber(p, y) || !nextNumber(p, z)) {
+				error = at(in, "a vertex needs three coordinates");
+				return false;
+			}
+			sink.vertex(x, y, z);
+		} else if (2 == length && 'v' == keyword[0] && 'n' == keyword[1]) {
+			double x, y, z;
+			if (!nextNumber(p, x) || !nextNumber(p, y) || !nextNumber(p, z)) {
+				error = at(in, "a normal needs three coordinates");
+				return false;
+			}
+			sink.normal(x, y, z);
+			normals++;
+		} else if (1 == length && 'f' == keyword[0]) {
+			polygon.clear();
+
+			char *corner, *cornerEnd;
+			while (nextWord(p, corner, cornerEnd)) {
+				const char* c = corner;
+				int vertex, normal = -1;
+				if (!parseIndex(c, cornerEnd, sink.vertexCount(), vertex)) {
+					error = at(in, "bad face");
+					return false;
+				}
+
+				// v, v/vt, v//vn or v/vt/vn
+				if (c != cornerEnd && '/' == *c) {
+					const char* slash = (const char*)memchr(c + 1, '/', cornerEnd - c - 1);
+					if (slash && (c = slash + 1) != cornerEnd && !parseIndex(c, cornerEnd, normals, normal)) {
+						error = at(in, "bad face");
+						return false;
+					}
+				}
+				if (normal != vertex) {
+					normalsMatch = false;
+				}
+				polygon.push_back(vertex);
+			}
+
+			if (polygon.size() < 3) {
+				error = at(in, "a face needs at least three vertices");
+				return false;
+			}
+			for (size_t k = 2; k < polygon.size(); k++) {
+				if (!sink.face(polygon[0], polygon[k - 1], polygon[k])) {
+					error = at(in, "a face refers to a vertex that isn't there");
+					return false;
+				}
+				triangles++;
+			}
+		}
+	}
+
+	if (in.lineTooLong()) {
+		error = at(in, "line too long");
+		return false;
+	}
+
+	if (normals > 0 && (!normalsMatch || normals != sink.vertexCount())) {
+		sink.clearNormals();
+	}
+	return true;
+}
+
+// .ply: a header listing the elements, each with its count and its
+// properties, then the elements' rows in that order
+enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_NONE };
+
+struct PlyProperty
+{
+	string name;
+	PlyType type;
+	PlyType countType;		// PLY_NONE unless it's a list
+};
+
+struct PlyElement
+{
+	string name;
+	uint64_t count;
+	vector<PlyProperty> properties;
+};
+
+PlyType plyType( const string& name )
+{
+	static const char* NAMES[][2] = {
+		{ "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+		{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+	};
+	for (int t = 0; t < PLY_NONE; t++) {
+		if (name == NAMES[t][0] || name == NAMES[t][1]) {
+			return (PlyType)t;
+		}
+	}
+	return PLY_NONE;
+}
+
+// The rows of the elements, one value at a time, from text or binary
+class PlyValues
+{
+public:
+	enum Format { ASCII, LITTLE_ENDIAN_BINARY, BIG_ENDIAN_BINARY };
+
+	PlyValues( MeshInput& in, Format format )
+		: in( in ), format( format ), p( 0 )
+	{
+		uint16_t one = 1;
+		bool little = *(const char*)&one == 1;
+		swap = format != ASCII && little != (format == LITTLE_ENDIAN_BINARY);
+	}
+
+	// Text files have a row to a line
+	bool startRow()
+	{
+		if (format != ASCII) {
+			return true;
+		}
+		char* textEnd;
+		return in.line(p, textEnd);
+	}
+
+	bool next( PlyType type, double& value )
+	{
+		if (format == ASCII) {
+			return nextNumber(p, value);
+		}
+
+		static const int SIZES[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+		unsigned char bytes[8];
+		int size = SIZES[type];
+		if (!in.read(bytes, size)) {
+			return false;
+		}
+		if (swap) {
+			for (int i = 0; i < size / 2; i++) {
+				std::swap(bytes[i], bytes[size - 1 - i]);
+			}
+		}
+
+		switch (type) {
+		case PLY_INT8: { int8_t v; memcpy(&v, bytes, 1); value = v; break; }
+		case PLY_UINT8: { uint8_t v; memcpy(&v, bytes, 1); value = v; break; }
+		case PLY_INT16: { int16_t v; memcpy(&v, bytes, 2); value = v; break; }
+		case PLY_UINT16: { uint16_t v; memcpy(&v, bytes, 2); value = v; break; }
+		case PLY_INT32: { int32_t v; memcpy(&v, bytes, 4); value = v; break; }
+		case PLY_UINT32: { uint32_t v; memcpy(&v, bytes, 4); value = v; break; }
+		case PLY_FLOAT32: { float v; memcpy(&v, bytes, 4); value = v; break; }
+		default: { double v; memcpy(&v, bytes, 8); value = v; break; }
+		}
+		return true;
+	}
+
+	// A list's values, or a plain property's one value
+	bool property( const PlyProperty& property, vector<double>& values )
+	{
+		values.clear();
+		double count = 1;
+		if (property.countType != PLY_NONE && !next(property.countType, count)) {
+			return false;
+		}
+		for (double v; count > 0; count--) {
+			if (!next(property.type, v)) {
+				return false;
+			}
+			values.push_back(v);
+		}
+		return true;
+	}
+
+private:
+	MeshInput& in;
+	Format format;
+	bool swap;
+	char* p;		// where an ascii row is up to
+};
+
+bool readPlyHeader( MeshInput& in, PlyValues::Format& format, vector<PlyElement>& elements, string& error )
+{
+	char *text, *textEnd;
+	if (!in.line(text, textEnd) || strcmp(text, "ply") != 0) {
+		error = "not a .ply file";
+		return false;
+	}
+
+	bool hasFormat = false;
+	while (in.line(text, textEnd)) {
+		istringstream words(text);
+		string keyword;
+		words >> keyword;
+
+		if (keyword == "format") {
+			string name;
+			words >> name;
+			hasFormat = true;
+			if (name == "ascii") {
+				format = PlyValues::ASCII;
+			} else if (name == "binary_little_endian") {
+				format = PlyValues::LITTLE_ENDIAN_BINARY;
+			} else if (name == "binary_big_endian") {
+				format = PlyValues::BIG_ENDIAN_BINARY;
+			} else {
+				error = at(in, "unknown format");
+				return false;
+			}
+		} else if (keyword == "element") {
+			PlyElement element;
+			if (!(words >> element.name >> element.count)) {
+				error = at(in, "bad element");
+				return false;
+			}
+			elements.push_back(element);
+		} else if (keyword == "property") {
+			PlyProperty property;
+			string type;
+			words >> type;
+			property.countType = PLY_NONE;
+			if (type == "list") {
+				string countType;
+				words >> countType >> type;
+				property.countType = plyType(countType);
+				if (property.countType == PLY_NONE || property.countType == PLY_FLOAT32 || property.countType == PLY_FLOAT64) {
+					error = at(in, "bad list property");
+					return false;
+				}
+			}
+			property.type = plyType(type);
+			words >> property.name;
+			if (property.type == PLY_NONE || property.name.empty() || elements.empty()) {
+				error = at(in, "bad property");
+				return false;
+			}
+			elements.back().properties.push_back(property);
+		} else if (keyword == "end_header") {
+			if (!hasFormat) {
+				error = "no format in the header";
+				return false;
+			}
+			return true;
+		}
+		// comment, obj_info and anything else new are skipped
+	}
+
+	error = "no end to the header";
+	return false;
+}
+
+// How many of element's rows the file could hold at most. A
+// value takes at least a byte either way, and a list at least four (its
+// count and three indices), so a header can't claim more rows than that
+// and have the mesh sized for them
+uint64_t rowsThatFit( const MeshInput& in, const PlyElement& element )
+{
+	uint64_t rowBytes = 0;
+	for (size_t k = 0; k < element.properties.size(); k++) {
+		rowBytes += element.properties[k].countType == PLY_NONE ? 1 : 4;
+	}
+	if (0 == in.fileSize() || 0 == rowBytes) {
+		return 0;
+	}
+	return min(element.count, in.fileSize() / rowBytes);
+}
+
+int findProperty( const PlyElement& element, const char* name )
+{
+	for (size_t k = 0; k < element.properties.size(); k++) {
+		if (element.properties[k].name == name) {
+			return (int)k;
+		}
+	}
+	return -1;
+}
+
+bool importPLY( MeshInput& in, MeshSink& sink, uint64_t& triangles, string& error )
+{
+	PlyValues::Format format = PlyValues::ASCII;
+	vector<PlyElement> elements;
+	if (!readPlyHeader(in, format, elements, error)) {
+		return false;
+	}
+
+	// The counts are all there in the header, so the mesh can be sized
+	// up front; a face is at least one triangle. They're only taken as far
+	// as the file could back them up: a broken or hostile header's count
+	// would otherwise go straight to the allocator
+	uint64_t vertexCount = 0, faceCount = 0;
+	bool hasNormals = false;
+	for (size_t e = 0; e < elements.size(); e++) {
+		if (elements[e].name == "vertex") {
+			vertexCount = rowsThatFit(in, elements[e]);
+			hasNormals = findProperty(elements[e], "nx") >= 0 && findProperty(elements[e], "ny") >= 0 && findProperty(elements[e], "nz") >= 0;
+		} else if (elements[e].name == "face") {
+			faceCount = rowsThatFit(in, elements[e]);
+		}
+	}
+	sink.reserve(vertexCount, hasNormals ? vertexCount : 0, faceCount);
+
+	PlyValues values(in, format);
+	vector<double> value;
+	vector<double> row;
+
+	for (size_t e = 0; e < elements.size(); e++) {
+		const PlyElement& element = elements[e];
+		bool vertices = element.name == "vertex";
+		bool faces = element.name == "face";
+
+		int x = findProperty(element, "x"), y = findProperty(element, "y"), z = findProperty(element, "z");
+		int nx = findProperty(element, "nx"), ny = findProperty(element, "ny"), nz = findProperty(element, "nz");
+		int indices = findProperty(element, "vertex_indices");
+		if (indices < 0) {
+			indices = findProperty(element, "vertex_index");
+		}
+
+		if (vertices && (x < 0 || y < 0 || z < 0)) {
+			error = "the vertices have no x, y and z";
+			return false;
+		}
+		if (faces && (indices < 0 || element.properties[indices].countType == PLY_NONE)) {
+			error = "the faces have no vertex_indices list";
+			return false;
+		}
+
+		for (uint64_t r = 0; r < element.count; r++) {
+			if (!values.startRow()) {
+				error = "the file ends early";
+				return false;
+			}
+
+			// A vertex's plain properties go in row, to pick x, y, z and
+			// the normal out of; a face's list is all that matters
+			row.resize(element.properties.size());
+			for (size_t k = 0; k < element.properties.size(); k++) {
+				if (!values.property(element.properties[k], value)) {
+					error = format == PlyValues::ASCII ? at(in, "too few values") : "the file ends early";
+					return false;
+				}
+				row[k] = value.empty() ? 0.0 : value[0];
+
+				if (faces && (int)k == indices) {
+					if (value.size() < 3) {
+						error = format == PlyValues::ASCII ? at(in, "a face needs at least three vertices") : "a face with fewer than three vertices";
+						return false;
+					}
+					for (size_t c = 2; c < value.size(); c++) {
+						if (!sink.face((int)value[0], (int)value[c - 1], (int)value[c])) {
+							error = "a face refers to a vertex that isn't there";
+							return false;
+						}
+						triangles++;
+					}
+				}
+			}
+
+			if (vertices) {
+				sink.vertex(row[x], row[y], row[z]);
+				if (hasNormals) {
+					sink.normal(row[nx], row[ny], row[nz]);
+				}
+			}
+		}
+	}
+
+	if (in.lineTooLong()) {
+		error = at(in, "line too long");
+		return false;
+	}
+	return true;
+}
+
+bool hasExtension( const string& path, const char* extension )
+{
+	size_t length = strlen(extension);
+	if (path.size() < length) {
+		return false;
+	}
+	for (size_t i = 0; i < length; i++) {
+		if (tolower((unsigned char)path[path.size() - length + i]) != extension[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+}
+
+bool isImportedMesh( const string& path )
+{
+	return hasExtension(path, ".obj") || hasExtension(path, ".ply");
+}
+
+bool importMesh( const string& path, MeshSink& sink, string& error )
+{
+	if (!isImportedMesh(path)) {
+		error = "not an .obj or .ply file";
+		return false;
+	}
+
+	MeshInput in;
+	if (!in.open(path)) {
+		error = "couldn't open the file";
+		return false;
+	}
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	size_t vertices = sink.vertexCount();
+	uint64_t triangles = 0;
+
+	// A mesh too big for memory is an error in the file like any other,
+	// not the end of the program
+	bool loaded;
+	try {
+		loaded = hasExtension(path, ".obj") ?
+			importOBJ(in, sink, triangles, error) :
+			importPLY(in, sink, triangles, error);
+	} catch (const bad_alloc&) {
+		error = "not enough memory for the mesh";
+		loaded = false;
+	}
+
+	if (loaded) {
+		totals.files++;
+		totals.bytes += in.bytesRead();
+		totals.vertices += sink.vertexCount() - vertices;
+		totals.triangles += triangles;
+		totals.seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+	return loaded;
+}
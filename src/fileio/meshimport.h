@@ -0,0 +1,61 @@
+//meshimport header file
+
+// Triangle meshes out of the files other programs write: Wavefront .obj
+// and Stanford .ply (ascii, and binary of either byte order). The file
+// is read through a fixed size buffer and every vertex and face goes
+// straight into the mesh as it's read, so loading a mesh takes the
+// mesh's own memory and not much more, however big the file is.
+//
+// Polygons are split into fans of triangles, as a .ray trimesh's faces
+// are. Only positions and per-vertex normals are taken; texture
+// coordinates, materials and groups are skipped over.
+
+#ifndef _MESHIMPORT_H_
+#define _MESHIMPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Where an imported mesh goes as it is read
+class MeshSink
+{
+public:
+	virtual ~MeshSink() {}
+
+	// Room for what's coming, when the file says up front
+	virtual void reserve( size_t vertices, size_t normals, size_t triangles ) = 0;
+
+	virtual void vertex( double x, double y, double z ) = 0;
+	virtual void normal( double x, double y, double z ) = 0;
+	virtual void clearNormals() = 0;
+	virtual size_t vertexCount() const = 0;
+
+	// Returns false if a, b and c aren't all vertices already read
+	virtual bool face( int a, int b, int c ) = 0;
+};
+
+// Everything imported since the last reset(), for the load statistics
+struct MeshImportStats
+{
+	MeshImportStats()
+		: files( 0 ), bytes( 0 ), vertices( 0 ), triangles( 0 ), seconds( 0.0 ) {}
+
+	int files;
+	uint64_t bytes;
+	uint64_t vertices;
+	uint64_t triangles;
+	double seconds;
+
+	static MeshImportStats total();
+	static void reset();
+};
+
+// Read the .obj or .ply at path (by its extension) into sink. Returns
+// false, with what went wrong and where in error, if it can't
+bool importMesh( const std::string& path, MeshSink& sink, std::string& error );
+
+// Whether path is a file importMesh() reads
+bool isImportedMesh( const std::string& path );
+
+#endif
@@ -0,0 +1,138 @@
+#include "rmesh.h"
+#include "mappedfile.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Bump this whenever the layout changes
+static const uint32_t FORMAT_VERSION = 1;
+static const char MAGIC[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+// Where every array starts, relative to the start of the file
+static const uint64_t ALIGNMENT = 64;
+
+struct RMeshHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;			// BYTE_ORDER_MARK, as the writer stored it
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+	uint32_t normalCount;
+	uint32_t unused;
+	uint64_t vertexOffset;
+	uint64_t indexOffset;
+	uint64_t normalOffset;
+	uint64_t fileSize;
+};
+
+static_assert( sizeof(RMeshHeader) == 64, "RMeshHeader should be 64 bytes" );
+
+static uint64_t alignUp( uint64_t offset )
+{
+	return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+// The header for mesh's arrays, laid out one after the other
+static RMeshHeader layout( const RMeshArrays& mesh )
+{
+	RMeshHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = FORMAT_VERSION;
+	header.byteOrder = BYTE_ORDER_MARK;
+	header.vertexCount = mesh.vertexCount;
+	header.triangleCount = mesh.triangleCount;
+	header.normalCount = mesh.normalCount;
+
+	header.vertexOffset = alignUp(sizeof(RMeshHeader));
+	header.indexOffset = alignUp(header.vertexOffset + 3 * sizeof(float) * (uint64_t)mesh.vertexCount);
+	header.normalOffset = alignUp(header.indexOffset + 3 * sizeof(uint32_t) * (uint64_t)mesh.triangleCount);
+	header.fileSize = header.normalOffset + 3 * sizeof(float) * (uint64_t)mesh.normalCount;
+	return header;
+}
+
+const char* readRMesh( const MappedFile& file, RMeshArrays& mesh )
+{
+	if (file.size() < sizeof(RMeshHeader)) {
+		return "too short to be an .rmesh file";
+	}
+
+	const RMeshHeader* header = (const RMeshHeader*)file.data();
+	if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {
+		return "not an .rmesh file";
+	}
+	if (header->byteOrder != BYTE_ORDER_MARK) {
+		return "written on a machine with the other byte order";
+	}
+	if (header->version != FORMAT_VERSION) {
+		return "an .rmesh file from another version";
+	}
+	if (header->normalCount != 0 && header->normalCount != header->vertexCount) {
+		return "wrong number of normals";
+	}
+
+	// Everything has to be exactly where a writer would have put it,
+	// which also keeps every array inside the file
+	RMeshArrays counts;
+	counts.vertexCount = header->vertexCount;
+	counts.triangleCount = header->triangleCount;
+	counts.normalCount = header->normalCount;
+	RMeshHeader expected = layout(counts);
+
+	if (header->vertexOffset != expected.vertexOffset || header->indexOffset != expected.indexOffset ||
+		header->normalOffset != expected.normalOffset || header->fileSize != expected.fileSize ||
+		file.size() != expected.fileSize) {
+		return "truncated or damaged";
+	}
+
+	mesh.vertices = (const float*)(file.data() + header->vertexOffset);
+	mesh.vertexCount = header->vertexCount;
+	mesh.indices = (const uint32_t*)(file.data() + header->indexOffset);
+	mesh.triangleCount = header->triangleCount;
+	mesh.normals = header->normalCount ? (const float*)(file.data() + header->normalOffset) : 0;
+	mesh.normalCount = header->normalCount;
+
+	// Reading the indices once pages them in, which the BVH build is about
+	// to do anyway, and means a bad one can't take a ray outside the file
+	for (uint64_t i = 0; i < 3 * (uint64_t)mesh.triangleCount; i++) {
+		if (mesh.indices[i] >= mesh.vertexCount) {
+			return "a face refers to a vertex that isn't there";
+		}
+	}
+
+	return 0;
+}
+
+// Zeros up to where the next array starts
+static bool pad( FILE* f, uint64_t offset )
+{
+	static const char zeros[ALIGNMENT] = { 0 };
+	long at = ftell(f);
+	return at >= 0 && (uint64_t)at <= offset && fwrite(zeros, 1, offset - at, f) == offset - at;
+}
+
+bool writeRMesh( const std::string& path, const RMeshArrays& mesh )
+{
+	RMeshHeader header = layout(mesh);
+
+	FILE* f = fopen(path.c_str(), "wb");
+	if (!f) {
+		return false;
+	}
+
+	bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		pad(f, header.vertexOffset) &&
+		fwrite(mesh.vertices, 3 * sizeof(float), mesh.vertexCount, f) == mesh.vertexCount &&
+		pad(f, header.indexOffset) &&
+		fwrite(mesh.indices, 3 * sizeof(uint32_t), mesh.triangleCount, f) == mesh.triangleCount &&
+		pad(f, header.normalOffset) &&
+		fwrite(mesh.normals, 3 * sizeof(float), mesh.normalCount, f) == mesh.normalCount;
+	written = fclose(f) == 0 && written;
+
+	if (!written) {
+		remove(path.c_str());
+	}
+	return written;
+}
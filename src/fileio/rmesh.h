@@ -0,0 +1,41 @@
+//rmesh header file
+
+// .rmesh files: a triangle mesh stored the way a Trimesh holds it in
+// memory, so loading one is mapping the file and pointing the mesh's
+// arrays into it. After a 64 byte header come the vertex positions (three
+// floats each), the triangles (three 32 bit vertex indices each) and,
+// optionally, one normal per vertex (three floats each), every array
+// starting on a 64 byte boundary. Numbers are in the byte order of the
+// machine that wrote the file; a file from a machine of the other order
+// is turned away rather than swapped, since that would mean a copy.
+
+#ifndef _RMESH_H_
+#define _RMESH_H_
+
+#include <stdint.h>
+#include <string>
+
+class MappedFile;
+
+// A mesh's arrays, wherever they happen to be
+struct RMeshArrays
+{
+	RMeshArrays()
+		: vertices( 0 ), vertexCount( 0 ), indices( 0 ), triangleCount( 0 ), normals( 0 ), normalCount( 0 ) {}
+
+	const float* vertices;
+	uint32_t vertexCount;
+	const uint32_t* indices;
+	uint32_t triangleCount;
+	const float* normals;		// none, or one per vertex
+	uint32_t normalCount;
+};
+
+// Point mesh's arrays into a mapped .rmesh file. Returns 0 if the file
+// holds together (every index names a vertex in it), or what's wrong
+const char* readRMesh( const MappedFile& file, RMeshArrays& mesh );
+
+// Returns false if the file couldn't be written
+bool writeRMesh( const std::string& path, const RMeshArrays& mesh );
+
+#endif
@@ -0,0 +1,351 @@
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "MeshConverter.h"
+#include "Parser.h"
+
+using namespace std;
+
+namespace {
+
+// [begin, end) in the scene's text
+struct Span
+{
+  Span( size_t begin, size_t end ) : begin( begin ), end( end ) {}
+  size_t begin, end;
+};
+
+// A trimesh block in the text, and where its geometry attributes are
+struct MeshBlock
+{
+  MeshBlock() : hasPoints( false ) {}
+  vector<Span> attributes;
+  bool hasPoints;
+};
+
+bool isWordChar( char c )
+{
+  return isalnum( (unsigned char)c ) || '_' == c;
+}
+
+// Past the comment or quoted string starting at at, or at itself if
+// there isn't one there; the same comments the Tokenizer skips
+size_t skipCommentOrString( const string& text, size_t at )
+{
+  size_t end = at;
+  if( text.compare( at, 2, "//" ) == 0 )
+    end = text.find( '\n', at );
+  else if( text.compare( at, 2, "/*" ) == 0 )
+    end = (end = text.find( "*/", at + 2 )) == string::npos ? end : end + 2;
+  else if( '"' == text[at] )
+    end = (end = text.find( '"', at + 1 )) == string::npos ? end : end + 1;
+  return end == string::npos ? text.size() : end;
+}
+
+size_t skipSpace( const string& text, size_t at )
+{
+  while( at < text.size() )
+  {
+    size_t next = skipCommentOrString( text, at );
+    if( next != at && '"' != text[at] )
+      at = next;
+    else if( isspace( (unsigned char)text[at] ) )
+      at++;
+    else
+      break;
+  }
+  return at;
+}
+
+// The block of the trimesh whose keyword ends at at. Returns where the
+// block ends. Only the attributes directly inside the braces count, not
+// anything of the same name in a material
+size_t scanMeshBlock( const string& text, size_t at, MeshBlock& block )
+{
+  at = skipSpace( text, at );
+  if( at >= text.size() || '{' != text[at] )
+    return at;
+
+  int depth = 0;
+  size_t attribute = string::npos;
+  while( at < text.size() )
+  {
+    size_t next = skipCommentOrString( text, at );
+    if( next != at )
+    {
+      at = next;
+      continue;
+    }
+
+    char c = text[at];
+    if( '{' == c || '(' == c )
+      depth++;
+    else if( '}' == c || ')' == c )
+    {
+      if( --depth == 0 )
+        return at + 1;
+    }
+    else if( ';' == c && 1 == depth && attribute != string::npos )
+    {
+      block.attributes.push_back( Span( attribute, at + 1 ) );
+      attribute = string::npos;
+    }
+    else if( isWordChar( c ) && !isWordChar( text[at - 1] ) )
+    {
+      size_t end = at;
+      while( end < text.size() && isWordChar( text[end] ) )
+        end++;
+
+      string word = text.substr( at, end - at );
+      if( 1 == depth && attribute == string::npos &&
+        ( "points" == word || "faces" == word || "normals" == word || "gennormals" == word ) )
+      {
+        attribute = at;
+        if( "points" == word )
+        {
+          // An empty list leaves the mesh with nothing to convert
+          size_t open = skipSpace( text, skipSpace( text, end ) + 1 );
+          if( open < text.size() && '(' == text[open] )
+          {
+            size_t first = skipSpace( text, open + 1 );
+            block.hasPoints = first < text.size() && ')' != text[first];
+          }
+        }
+      }
+      at = end;
+      continue;
+    }
+    at++;
+  }
+  return at;
+}
+
+vector<MeshBlock> findMeshBlocks( const string& text )
+{
+  vector<MeshBlock> blocks;
+  size_t at = 0;
+  while( at < text.size() )
+  {
+    size_t next = skipCommentOrString( text, at );
+    if( next != at )
+    {
+      at = next;
+    }
+    else if( isWordChar( text[at] ) )
+    {
+      size_t end = at;
+      while( end < text.size() && isWordChar( text[end] ) )
+        end++;
+
+      string word = text.substr( at, end - at );
+      at = end;
+      if( "trimesh" == word || "polymesh" == word )
+      {
+        MeshBlock block;
+        at = scanMeshBlock( text, end, block );
+        if( block.hasPoints )
+          blocks.push_back( block );
+      }
+    }
+    else
+    {
+      at++;
+    }
+  }
+  return blocks;
+}
+
+// A span that is all there is on its lines grows to take the lines with it
+Span wholeLines( const string& text, Span span )
+{
+  size_t begin = span.begin, end = span.end;
+  while( begin > 0 && (' ' == text[begin - 1] || '\t' == text[begin - 1]) )
+    begin--;
+  while( end < text.size() && (' ' == text[end] || '\t' == text[end] || '\r' == text[end]) )
+    end++;
+
+  if( (begin == 0 || '\n' == text[begin - 1]) && end < text.size() && '\n' == text[end] )
+    return Span( begin, end + 1 );
+  return span;
+}
+
+string directoryOf( const string& path )
+{
+  size_t slash = path.find_last_of( "\\/" );
+  return slash == string::npos ? "." : path.substr( 0, slash );
+}
+
+string fileNameOf( const string& path )
+{
+  size_t slash = path.find_last_of( "\\/" );
+  return slash == string::npos ? path : path.substr( slash + 1 );
+}
+
+// The scene in text, with relative paths from directory, or 0 and why not
+Scene* parseSceneText( const string& text, const string& directory, string& error )
+{
+  Tokenizer tokenizer( text.data(), text.size(), false );
+  Parser parser( tokenizer, directory );
+  try {
+    return parser.parseScene();
+  }
+  catch( SyntaxErrorException& pe ) {
+    error = pe.formattedMessage();
+  }
+  catch( ParserException& pe ) {
+    error = "Parser: fatal exception " + pe.message();
+  }
+  catch( TextureMapException e ) {
+    error = "Texture mapping exception: " + e.message();
+  }
+  return 0;
+}
+
+// The trimeshes with geometry of their own, in the order they're parsed
+vector<const Trimesh*> sceneMeshes( const Scene* scene )
+{
+  vector<const Trimesh*> meshes;
+  for( Scene::cgiter i = scene->beginObjects(); i != scene->endObjects(); ++i )
+  {
+    const Trimesh* mesh = dynamic_cast<const Trimesh*>( *i );
+    if( mesh && !mesh->isInstance() )
+      meshes.push_back( mesh );
+  }
+  return meshes;
+}
+
+// Reads the converted scene back, to be sure every mesh comes out of it
+// exactly as it was in the original
+bool checkConversion( const Scene* scene, const string& outFile, string& error )
+{
+  ifstream in( outFile.c_str(), ios::in | ios::binary );
+  ostringstream contents;
+  contents << in.rdbuf();
+  string text = contents.str();
+
+  Scene* converted = parseSceneText( text, directoryOf( outFile ), error );
+  if( !converted )
+  {
+    error = "the converted scene doesn't load: " + error;
+    return false;
+  }
+
+  vector<const Trimesh*> before = sceneMeshes( scene );
+  vector<const Trimesh*> after = sceneMeshes( converted );
+  bool same = before.size() == after.size();
+  for( size_t m = 0; same && m < before.size(); m++ )
+  {
+    if( !before[m]->sameGeometry( *after[m] ) )
+    {
+      ostringstream oss;
+      oss << "trimesh " << m << " of the converted scene (" << after[m]->vertexCount() << " vertices, "
+        << after[m]->triangleCount() << " triangles) isn't the original's (" << before[m]->vertexCount()
+        << " vertices, " << before[m]->triangleCount() << " triangles)";
+      error = oss.str();
+      same = false;
+    }
+  }
+  if( before.size() != after.size() )
+    error = "the converted scene doesn't have the original's trimeshes";
+
+  delete converted;
+  return same;
+}
+
+}
+
+bool convertSceneMeshes( const string& sceneFile, const string& outFile, ostream& log, string& error )
+{
+  if( sceneFile == outFile )
+  {
+    error = "won't write the converted scene over the original";
+    return false;
+  }
+
+  ifstream in( sceneFile.c_str(), ios::in | ios::binary );
+  if( !in )
+  {
+    error = "couldn't read scene file " + sceneFile;
+    return false;
+  }
+  ostringstream contents;
+  contents << in.rdbuf();
+  string text = contents.str();
+
+  // The meshes come out of the parser in the order their blocks are in
+  // the text, which is what pairs each block up with its mesh
+  Scene* scene = parseSceneText( text, directoryOf( sceneFile ), error );
+  if( !scene )
+    return false;
+
+  vector<const Trimesh*> meshes;
+  vector<const Trimesh*> all = sceneMeshes( scene );
+  for( size_t m = 0; m < all.size(); m++ )
+  {
+    if( !all[m]->hasFile() && all[m]->vertexCount() > 0 )
+      meshes.push_back( all[m] );
+  }
+
+  vector<MeshBlock> blocks = findMeshBlocks( text );
+  if( blocks.size() != meshes.size() )
+  {
+    ostringstream oss;
+    oss << "found " << blocks.size() << " trimesh blocks with points but parsed " << meshes.size() << " trimeshes";
+    error = oss.str();
+    delete scene;
+    return false;
+  }
+
+  string base = fileNameOf( outFile );
+  if( base.size() > 4 && base.compare( base.size() - 4, 4, ".ray" ) == 0 )
+    base.erase( base.size() - 4 );
+
+  string converted;
+  size_t copied = 0;
+  for( size_t m = 0; m < meshes.size(); m++ )
+  {
+    ostringstream name;
+    name << base << "-" << m << ".rmesh";
+    string path = directoryOf( outFile ) + "/" + name.str();
+
+    if( !meshes[m]->writeFile( path ) )
+    {
+      error = "couldn't write " + path;
+      delete scene;
+      return false;
+    }
+    log << path << ": " << meshes[m]->vertexCount() << " vertices, "
+      << meshes[m]->triangleCount() << " triangles" << endl;
+
+    // The first of the block's attributes makes way for the file, the
+    // rest just go
+    const vector<Span>& attributes = blocks[m].attributes;
+    for( size_t a = 0; a < attributes.size(); a++ )
+    {
+      Span span = a == 0 ? attributes[a] : wholeLines( text, attributes[a] );
+      converted.append( text, copied, span.begin - copied );
+      if( a == 0 )
+        converted.append( "file = \"" + name.str() + "\";" );
+      copied = span.end;
+    }
+  }
+  converted.append( text, copied, string::npos );
+
+  ofstream out( outFile.c_str(), ios::out | ios::binary );
+  if( !(out << converted) || !(out.flush()) )
+  {
+    error = "couldn't write " + outFile;
+    delete scene;
+    return false;
+  }
+  out.close();
+
+  bool checked = checkConversion( scene, outFile, error );
+  delete scene;
+  if( !checked )
+    return false;
+
+  log << outFile << ": " << meshes.size() << " trimeshes now read from .rmesh files" << endl;
+  return true;
+}
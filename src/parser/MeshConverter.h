@@ -0,0 +1,27 @@
+#ifndef __MESHCONVERTER_H__
+
+#define __MESHCONVERTER_H__
+
+#include <string>
+#include <iostream>
+
+/*
+  Turns a scene's trimeshes into .rmesh files (see fileio/rmesh.h).
+
+  The scene is parsed as usual, and every trimesh that has vertices of
+  its own is written out, in its local space, next to outFile as
+  <outFile's name>-<n>.rmesh. outFile gets the scene's text with each of
+  those trimesh blocks' points, faces, normals and gennormals replaced by
+  a file = "..."; line; everything else, materials and transforms and
+  comments included, is left exactly as it was. Relative paths in the
+  scene (texture maps) are relative to wherever outFile ends up.
+
+  outFile is then loaded back, and has to give exactly the meshes the
+  scene did, read out of their files.
+
+  Returns false, with the reason in error, if it couldn't.
+*/
+bool convertSceneMeshes( const std::string& sceneFile, const std::string& outFile,
+  std::ostream& log, std::string& error );
+
+#endif
@@ -4,6 +4,7 @@
 #include <fstream>
 #include <sstream>
 #include <memory>
+#include <climits>
 
 #include "Parser.h"
 #include "Tokenizer.h"
@@ -22,12 +23,12 @@ Scene* Parser::parseScene()
 {
   _tokenizer.Read(SBT_RAYTRACER);
 
-  auto_ptr<Token> versionNumber( _tokenizer.Read(SCALAR) );
+  double versionNumber = _tokenizer.Read(SCALAR)->value();
 
-  if( versionNumber->value() > 1.1 )
+  if( versionNumber > 1.1 )
   {
     ostringstream ost;
-    ost << "SBT-raytracer version number " << versionNumber->value() << 
+    ost << "SBT-raytracer version number " << versionNumber << 
       " too high; only able to parser v1.1 and below.";
     throw ParserException( ost.str() );
   }
@@ -560,6 +561,19 @@ void Parser::parseCone(Scene* scene, TransformNode* transform, const Material& m
   }
 }
 
+// A trimesh has its points, faces and optionally normals and per-vertex
+// materials in the scene file, or takes them all from a file=.  Given a
+// name=, a later trimesh with that name and no geometry of its own is
+// another instance of it:
+//
+//   trimesh { name="bunny"; file="bunny.rmesh"; material={ ... }; }
+//   translate( 2,0,0, trimesh { name="bunny"; material={ ... }; } )
+//
+// The instance shares the first one's points, faces, normals and BVH, and
+// only gets its own transform and material (material=). Anything that
+// would change the geometry, normals=, materials= or gennormals, can't
+// be given to an instance. A named trimesh with nothing in it and no
+// earlier one to instance is just an empty mesh, as it always was
 void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material& mat)
 {
   Trimesh* tmesh = new Trimesh( scene, new Material(mat), transform);
@@ -568,7 +582,12 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   _tokenizer.Read( LBRACE );
 
   bool generateNormals( false );
-  list<Vec3d> faces;
+  bool hasPoints( false );
+  bool hasNormals( false );
+  bool hasMaterials( false );
+  string name;
+  string file;
+  vector<int> faces;    // three vertices per triangle
 
   char* error;
   for( ;; )
@@ -588,10 +607,19 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case NAME:
-         parseIdentExpression();
+         name = parseIdentExpression();
+         break;
+
+      // The vertices, faces and normals out of an .rmesh, .obj or .ply
+      // file, relative to the scene file like texture maps are
+      case FILENAME:
+         file = _basePath;
+         file.append( "/" );
+         file.append( parseIdentExpression() );
          break;
 
       case MATERIALS:
+        hasMaterials = true;
         _tokenizer.Read( MATERIALS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
@@ -612,10 +640,16 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         break;
 
       case NORMALS:
+        hasNormals = true;
         _tokenizer.Read( NORMALS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        if( _tokenizer.ReadTupleList( _tuples, 3, 3 ) )
+        {
+          _tuples.convert( _threads );
+          tmesh->addNormals( _tuples.data(), _tuples.size() );
+        }
+        else if( RPAREN != _tokenizer.Peek()->kind() )
         {
           tmesh->addNormal( parseVec3d() );
           for( ;; )
@@ -635,7 +669,12 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         _tokenizer.Read( FACES );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        if( _tokenizer.ReadTupleList( _tuples, 3, INT_MAX ) )
+        {
+          _tuples.convert( _threads );
+          addFaces( _tuples, faces );
+        }
+        else if( RPAREN != _tokenizer.Peek()->kind() )
         {
           parseFaces( faces );
           for( ;; )
@@ -651,11 +690,20 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         _tokenizer.Read( SEMICOLON );
         break;
 
+      // The big lists, the points and normals and faces, are read in one
+      // go where they can be (see TupleList); the token at a time path is
+      // for the odd list with comments in it, and for reporting errors
       case POLYPOINTS:
+        hasPoints = true;
         _tokenizer.Read( POLYPOINTS );
         _tokenizer.Read( EQUALS );
         _tokenizer.Read( LPAREN );
-        if( RPAREN != _tokenizer.Peek()->kind() )
+        if( _tokenizer.ReadTupleList( _tuples, 3, 3 ) )
+        {
+          _tuples.convert( _threads );
+          tmesh->addVertices( _tuples.data(), _tuples.size() );
+        }
+        else if( RPAREN != _tokenizer.Peek()->kind() )
         {
           tmesh->addVertex( parseVec3d() );
           for( ;; )
@@ -676,16 +724,45 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
       {
         _tokenizer.Read( RBRACE );
 
-        // Now add all the faces into the trimesh, since hopefully
-        // the vertices have been parsed out
-        for( list<Vec3d>::const_iterator vitr = faces.begin(); vitr != faces.end(); vitr++ )
+        // A trimesh with no geometry of its own but the name of an earlier
+        // one is another instance of that one: it shares that mesh's
+        // vertices, faces and BVH under its own transform and material
+        map<string, Trimesh*>::const_iterator source = meshes.find( name );
+        if( !hasPoints && faces.empty() && file.empty() && source != meshes.end() )
+        {
+          if( hasNormals || hasMaterials || generateNormals )
+            throw ParserException( "Trimesh '" + name + "' is an instance of the earlier one with that name, "
+              "so it can't have normals, materials or gennormals of its own" );
+
+          tmesh->setInstanceOf( source->second );
+          scene->add( tmesh );
+          return;
+        }
+
+        if( !file.empty() )
+        {
+          if( hasPoints || hasNormals || !faces.empty() )
+            throw ParserException( "A trimesh with a file can't have points, faces or normals too" );
+
+          string fileError;
+          if( !tmesh->loadFile( file, fileError ) )
+            throw ParserException( "Trimesh file '" + file + "': " + fileError );
+        }
+        else
         {
-          if( !tmesh->addFace((int) (*vitr)[0], (int) (*vitr)[1], (int) (*vitr)[2] ) )
+          // Now add all the faces into the trimesh, since hopefully
+          // the vertices have been parsed out. A mesh from a file has its
+          // faces already, and a mapped one's arrays can't be added to
+          tmesh->reserveFaces( faces.size() / 3 );
+          for( size_t f = 0; f < faces.size(); f += 3 )
           {
-            ostringstream oss;
-            oss << "Bad face in trimesh: (" << (*vitr)[0] << ", " << (*vitr)[1] << 
-              ", " << (*vitr)[2] << ")";
-            throw ParserException( oss.str() );
+            if( !tmesh->addFace( faces[f], faces[f + 1], faces[f + 2] ) )
+            {
+              ostringstream oss;
+              oss << "Bad face in trimesh: (" << faces[f] << ", " << faces[f + 1] << 
+                ", " << faces[f + 2] << ")";
+              throw ParserException( oss.str() );
+            }
           }
         }
 
@@ -695,6 +772,9 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         if( error = tmesh->doubleCheck() )
           throw ParserException( error );
 
+        if( !name.empty() )
+          meshes[name] = tmesh;
+
         scene->add( tmesh );
         return;
       }
@@ -705,7 +785,7 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
   }
 }
 
-void Parser::parseFaces( list< Vec3d >& faces )
+void Parser::parseFaces( vector<int>& faces )
 {
   list< double > points = parseScalarList();
 
@@ -715,16 +795,42 @@ void Parser::parseFaces( list< Vec3d >& faces )
      throw SyntaxErrorException( "Faces must have at least 3 vertices.", _tokenizer );
 
   list<double>::const_iterator i = points.begin();
-  double a = (*i++);
-  double b = (*i++);
+  int a = (int) (*i++);
+  int b = (int) (*i++);
   while( i != points.end() )
   {
-    double c = (*i++);
-    faces.push_back( Vec3d( a, b, c ) );
+    int c = (int) (*i++);
+    faces.push_back( a );
+    faces.push_back( b );
+    faces.push_back( c );
     b = c;
   }
 }
 
+// The same fans as parseFaces(), out of a list read in one go
+void Parser::addFaces( const TupleList& tuples, vector<int>& faces )
+{
+  size_t triangles = 0;
+  for( size_t k = 0; k < tuples.size(); k++ )
+    triangles += tuples.count( k ) - 2;
+  faces.reserve( faces.size() + 3 * triangles );
+
+  for( size_t k = 0; k < tuples.size(); k++ )
+  {
+    const double* points = tuples.tuple( k );
+    int a = (int) points[0];
+    int b = (int) points[1];
+    for( int n = 2; n < tuples.count( k ); n++ )
+    {
+      int c = (int) points[n];
+      faces.push_back( a );
+      faces.push_back( b );
+      faces.push_back( c );
+      b = c;
+    }
+  }
+}
+
 // Ambient lights are a bit special in that we don't actually
 // create a separate Light for each ambient light; instead
 // we simply sum all the ambient intensities and put them in
@@ -907,16 +1013,12 @@ string Parser::parseIdentExpression()
 
 double Parser::parseScalar()
 {
-  auto_ptr<Token> scalar( _tokenizer.Read( SCALAR ) );
-
-  return scalar->value();
+  return _tokenizer.Read( SCALAR )->value();
 }
 
 string Parser::parseIdent()
 {
-  auto_ptr<Token> scalar( _tokenizer.Read( IDENT ) );
-
-  return scalar->ident();
+  return _tokenizer.Read( IDENT )->ident();
 }
 
 
@@ -961,35 +1063,31 @@ bool Parser::parseBoolean()
 
 Vec3d Parser::parseVec3d()
 {
+  // The tokens don't outlast the next read, so take the values as they come
   _tokenizer.Read( LPAREN );
-  auto_ptr<Token> value1( _tokenizer.Read( SCALAR ) );
+  double value1 = _tokenizer.Read( SCALAR )->value();
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value2( _tokenizer.Read( SCALAR ) );
+  double value2 = _tokenizer.Read( SCALAR )->value();
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value3( _tokenizer.Read( SCALAR ) );
+  double value3 = _tokenizer.Read( SCALAR )->value();
   _tokenizer.Read( RPAREN );
 
-  return Vec3d( value1->value(), 
-    value2->value(), 
-    value3->value() );
+  return Vec3d( value1, value2, value3 );
 }
 
 Vec4d Parser::parseVec4d()
 {
   _tokenizer.Read( LPAREN );
-  auto_ptr<Token> value1( _tokenizer.Read( SCALAR ) );
+  double value1 = _tokenizer.Read( SCALAR )->value();
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value2( _tokenizer.Read( SCALAR ) );
+  double value2 = _tokenizer.Read( SCALAR )->value();
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value3( _tokenizer.Read( SCALAR ) );
+  double value3 = _tokenizer.Read( SCALAR )->value();
   _tokenizer.Read( COMMA );
-  auto_ptr<Token> value4( _tokenizer.Read( SCALAR ) );
+  double value4 = _tokenizer.Read( SCALAR )->value();
   _tokenizer.Read( RPAREN );
 
-  return Vec4d( value1->value(), 
-    value2->value(), 
-    value3->value(),
-    value4->value() );
+  return Vec4d( value1, value2, value3, value4 );
 }
 
 Material* Parser::parseMaterial( Scene* scene, const Material& parent )
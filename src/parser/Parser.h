@@ -6,6 +6,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "ParserException.h"
 #include "Tokenizer.h"
@@ -43,12 +44,16 @@ class Parser
     // We need the path for referencing files from the
     // base file.
     Parser( Tokenizer& tokenizer, string basePath )
-      : _tokenizer( tokenizer ), _basePath( basePath )
+      : _tokenizer( tokenizer ), _basePath( basePath ), _threads( 0 )
       { }
 
     // Parse the top-level scene
     Scene* parseScene();
 
+    // Threads for reading the trimeshes' big lists, 0 for one per
+    // hardware thread
+    void setThreads( int threads ) { _threads = threads; }
+
 private:
 
     // Highest level parsing routines
@@ -71,7 +76,8 @@ private:
     void      parseCylinder(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseCone(Scene* scene, TransformNode* transform, const Material& mat);
     void      parseTrimesh(Scene* scene, TransformNode* transform, const Material& mat);
-    void      parseFaces( std::list< Vec3d >& faces );
+    void      parseFaces( std::vector<int>& faces );
+    void      addFaces( const TupleList& tuples, std::vector<int>& faces );
 
     // Parse transforms
     void parseTranslate(Scene* scene, TransformNode* transform, const Material& mat);
@@ -106,6 +112,13 @@ private:
     Tokenizer& _tokenizer;
     mmap materials;
     std::string _basePath;
+    int _threads;
+
+    // The list being read, kept for its memory from one list to the next
+    TupleList _tuples;
+
+    // Named trimeshes seen so far, which later trimeshes can instance
+    std::map<string, Trimesh*> meshes;
 };
 
 #endif
@@ -88,6 +88,7 @@ string getNameForToken( const SYMBOL kind )
     tokenNames[ NAME ]              = "name";
     tokenNames[ MAP ]               = "map";
 	tokenNames[ LOOK_AT ]			= "look_at";
+    tokenNames[ FILENAME ]          = "file";
   }
   // search tokenNames table
   std::map<int, string>::const_iterator itr = 
@@ -133,6 +134,7 @@ SYMBOL lookupReservedWord(const string& ident) {
     reservedWords["directional_light"] = DIRECTIONAL_LIGHT;
     reservedWords["emissive"] = EMISSIVE;
     reservedWords["faces"] = FACES;
+    reservedWords["file"] = FILENAME;
     reservedWords["false"] = SYMFALSE;
     reservedWords["fov"] = FOV;
     reservedWords["gennormals"] = GENNORMALS;
@@ -181,7 +183,13 @@ SYMBOL lookupReservedWord(const string& ident) {
 
 string Token::toString() const
 {
-  return getNameForToken( kind() );
+  ostringstream oss;
+  oss << getNameForToken( kind() );
+  if( IDENT == kind() )
+    oss << ": \"" << ident() << "\"";
+  else if( SCALAR == kind() )
+    oss << ": " << value();
+  return oss.str();
 }
 
 void Token::Print( ostream& out ) const {
@@ -192,15 +200,4 @@ void Token::Print( ) const {
   Print( std::cout );
 }
 
-string IdentToken::toString( ) const {
-  ostringstream oss( Token::toString() );
-  oss << ": \"" << _ident << "\"";
-  return oss.str();
-}
-
-string ScalarToken::toString( ) const {
-  ostringstream oss( Token::toString() );
-  oss << ": " << _value;
-  return oss.str();
-}
  
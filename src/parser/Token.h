@@ -82,60 +82,56 @@ enum SYMBOL {
   SHININESS, INDEX,
   NAME,
   MAP,
-  LOOK_AT
+  LOOK_AT,
+  FILENAME					// a trimesh's .rmesh, .obj or .ply file
 };
 
 // Helper functions
 string getNameForToken( const SYMBOL kind );
 SYMBOL lookupReservedWord( const string& name );
 
+// A token is a plain value: its kind and, for identifiers and scalars,
+// what it said. The tokenizer keeps the couple it needs at a time in an
+// array of its own and hands out pointers to them, so scanning a scene
+// doesn't allocate anything per token. An identifier's text points
+// into the tokenizer's buffer.
 class Token {
   public:
-    Token(SYMBOL kind) : _kind( kind ) { }
+    Token(SYMBOL kind = UNKNOWN)
+      : _kind( kind ), _value( 0.0 ), _text( 0 ), _length( 0 ) { }
 
     SYMBOL kind() const { return _kind; }
 
     // Note that these errors should not ever be encountered at runtime,
     // and signify parser bugs of some kind.
-    virtual std::string ident() const   
-      { throw ParserFatalException("not an IdentToken"); return std::string(); }
-    virtual double value() const   
-      { throw ParserFatalException("not a ScalarToken"); return 0.0; }
-
-
-    // Utility functions
-    virtual void Print(std::ostream& out) const;
-    virtual void Print() const;
-    virtual string toString() const;
-
-	virtual ~Token() {}
-  protected:
-    const SYMBOL _kind;
-};
-
-class IdentToken : public Token {
-  public:
-    IdentToken(std::string ident) : Token(IDENT), _ident( ident ) { 
+    std::string ident() const
+    {
+      if( IDENT != _kind )
+        throw ParserFatalException("not an identifier token");
+      return std::string( _text, _length );
+    }
+    double value() const
+    {
+      if( SCALAR != _kind )
+        throw ParserFatalException("not a scalar token");
+      return _value;
     }
 
-    std::string ident() const { return _ident; }
-
-    string toString() const;
-
-  protected:
-    const std::string _ident;
-};
-
-class ScalarToken : public Token {
-  public:
-    ScalarToken(double value) : Token(SCALAR), _value( value ) { }
-    
-    double value() const { return _value; }
+    // For the tokenizer, filling the token in
+    void set( SYMBOL kind ) { _kind = kind; }
+    void setScalar( double value ) { _kind = SCALAR; _value = value; }
+    void setIdent( const char* text, size_t length ) { _kind = IDENT; _text = text; _length = length; }
 
+    // Utility functions
+    void Print(std::ostream& out) const;
+    void Print() const;
     string toString() const;
 
-  protected:
-    const double _value;
+  private:
+    SYMBOL _kind;
+    double _value;
+    const char* _text;
+    size_t _length;
 };
 
 
@@ -3,8 +3,10 @@
 #include <string> 
 #include <map>
 #include <sstream>
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdint.h>
 
-#include "../fileio/buffer.h"
 #include "Tokenizer.h"
 #include "Token.h"
 
@@ -32,15 +34,42 @@
 // simplifies the scanner part, since we don't have to open it and
 // error check to see if it exists.  We assume that the caller (which
 // will be the main() function) sets up everything and passes us a VALID
-// file pointer.
+// file pointer.  The whole stream is read in up front.
 //
 
 Tokenizer::Tokenizer(istream& fp, bool printTokens) 
-  : buffer( fp, false, false )
 { 
+    std::ostringstream everything;
+    everything << fp.rdbuf();
+    contents = everything.str();
+
+    begin = contents.data();
+    end = begin + contents.size();
+    cursor = begin;
+    LineNumber = 1;
+    LineStart = begin;
+    TokenLine = 1;
     TokenColumn = 0;
-    CurrentCh = ' ';
-    UnGetToken = NULL;
+    TokenLineStart = begin;
+    LastPrintedLine = 0;
+    nextSlot = 0;
+    peeked = false;
+    _printTokens = printTokens;
+}
+
+Tokenizer::Tokenizer(const char* data, size_t size, bool printTokens) 
+{ 
+    begin = data;
+    end = data + size;
+    cursor = begin;
+    LineNumber = 1;
+    LineStart = begin;
+    TokenLine = 1;
+    TokenColumn = 0;
+    TokenLineStart = begin;
+    LastPrintedLine = 0;
+    nextSlot = 0;
+    peeked = false;
     _printTokens = printTokens;
 }
 
@@ -53,74 +82,74 @@ void Tokenizer::ScanProgram() {
     while (Get()->kind() != EOFSYM) ;
 }
 
-
-auto_ptr<Token> Tokenizer::Get() {
-  return auto_ptr<Token>(GetNext());
-}
-
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::Get() method
+// const Token* Tokenizer::Get() method
 //
 // Advance through the source to find the next token. Returns peeked token,
-// if there is one.
+// if there is one.  The two tokens take turns, so the one returned here
+// is still there after the next Peek().
 //
 
-Token* Tokenizer::GetNext() {
-  Token* T = NULL;
-
-  // First check to see if there is an UnGetToken. If there is, use it.
-  if (UnGetToken != NULL) {
-    T = UnGetToken;
-    UnGetToken = NULL;
-    return T;
-  }
+const Token* Tokenizer::Get() {
+  const Token* T = Peek();
+  peeked = false;
+  nextSlot ^= 1;
+  return T;
+}
 
-  // Otherwise, crank up the scanner and get a new token.
+//////////////////////////////////////////////////////////////////////////
+//
+// void Tokenizer::Scan(Token&) method
+//
+//   Crank up the scanner and get a new token.
+//
 
+void Tokenizer::Scan(Token& T) {
   // Get rid of any whitespace
   SkipWhiteSpace();
 
+  // Save the starting position of the symbol, so that nicer error
+  // messages can be produced.
+  MarkToken();
+
   // test for end of file
-  if (buffer.isEOF()) {
-    T = new Token(EOFSYM);
+  if (cursor == end) {
+    T.set(EOFSYM);
 
   } else {
     
-    // Save the starting position of the symbol in a variable,
-    // so that nicer error messages can be produced.
-    TokenColumn = buffer.CurColumn();
-    
     // Check kind of current character
+    char CurrentCh = *cursor;
     
     // Note that _'s are now allowed in identifiers.
-    if (isalpha(CurrentCh) || '_' == CurrentCh) {
+    if (isalpha((unsigned char)CurrentCh) || '_' == CurrentCh) {
       // grab identifier or reserved word
-      T = GetIdent();
+      GetIdent(T);
     } else if ( '"' == CurrentCh)  {
-      T = GetQuotedIdent(); 
-    } else if (isdigit(CurrentCh) || '-' == CurrentCh || '.' == CurrentCh) {
-      T = GetScalar();
+      GetQuotedIdent(T); 
+    } else if (isdigit((unsigned char)CurrentCh) || '-' == CurrentCh || '.' == CurrentCh) {
+      GetScalar(T);
     } else { 
       //
       // Check for other tokens
       //
       
-      T = GetPunct();
+      GetPunct(T);
     }
   }
-  
-  if (T == NULL) {
-    throw ParserFatalException("didn't get a token");
-  }
 
   if (_printTokens) {
     std::cout << "Token read: ";
-    T->Print();
+    T.Print();
     std::cout << std::endl;
   }
+}
 
-  return T;
+void Tokenizer::MarkToken() {
+  TokenLine = LineNumber;
+  TokenLineStart = LineStart;
+  TokenColumn = cursor - LineStart;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -128,179 +157,272 @@ Token* Tokenizer::GetNext() {
 // Skips spaces, tabs, newlines, and comments
 //
 void Tokenizer::SkipWhiteSpace() {
-  while (isspace(CurrentCh) && CurrentCh ) {
-    GetCh();
-  }
+  for (;;) {
+    while (cursor != end && isspace((unsigned char)*cursor)) {
+      if ('\n' == *cursor)
+        NewLine(cursor + 1);
+      cursor++;
+    }
 
-  if( '/' == CurrentCh )  // Look for comments
-  {
-    GetCh();
-    if( '/' == CurrentCh )
+    if (cursor == end || '/' != *cursor)  // Look for comments
+      return;
+
+    MarkToken();
+    char next = cursor + 1 != end ? cursor[1] : '\0';
+
+    if( '/' == next )
     {
       // Throw out everything until the end of the line
-      while( '\n' != CurrentCh )
-      {
-        GetCh();
-      }
+      while (cursor != end && '\n' != *cursor)
+        cursor++;
     }
-    else if ( '*' == CurrentCh )
+    else if ( '*' == next )
     {
-      int startLine = CurLine();
-      while( true )
+      int startLine = LineNumber;
+      cursor += 2;
+      for (;;)
       {
-        GetCh();
-        if( '*' == CurrentCh )
-        {
-          GetCh();
-          if( CondReadCh( '/' ) )
-            break;
-          else if ( buffer.isEOF() )
-          {
-            std::ostringstream ost;
-            ost << "Unterminated comment in line ";
-            ost << startLine;
-            throw SyntaxErrorException( ost.str(), *this );
-          }
-        }
-        else if ( buffer.isEOF() )
+        if (cursor == end)
         {
           std::ostringstream ost;
           ost << "Unterminated comment in line ";
           ost << startLine;
           throw SyntaxErrorException( ost.str(), *this );
         }
+        if ('*' == *cursor && cursor + 1 != end && '/' == cursor[1])
+        {
+          cursor += 2;
+          break;
+        }
+        if ('\n' == *cursor)
+          NewLine(cursor + 1);
+        cursor++;
       }
     }
     else
     {
+      cursor++;
+      MarkToken();
       std::ostringstream ost;
-      ost << "unexpected character: '" << CurrentCh << "'";
-	  throw SyntaxErrorException( ost.str(), *this );
+      ost << "unexpected character: '" << next << "'";
+      throw SyntaxErrorException( ost.str(), *this );
     }
 
-    SkipWhiteSpace();  // We may need to throw out
-                       //  more white space/comments
-                       // This is admittedly tail recursion...
+    // We may need to throw out more white space/comments
   }
 }
 
-Token* Tokenizer::GetQuotedIdent() {
-  GetCh();   // Throw out beginning '"'
+void Tokenizer::GetQuotedIdent(Token& T) {
+  cursor++;   // Throw out beginning '"'
 
-  std::ostringstream ident;
-  while ( '"' != CurrentCh ) {
-    if( '\n' == CurrentCh )
+  const char* start = cursor;
+  while (cursor != end && '"' != *cursor) {
+    if( '\n' == *cursor )
       throw SyntaxErrorException( "Unterminated string constant", *this );
-
-    ident << CurrentCh;
-    GetCh();
+    cursor++;
   }
-  GetCh();
-  return new IdentToken( ident.str() );
+  if (cursor == end)
+    throw SyntaxErrorException( "Unterminated string constant", *this );
+
+  T.setIdent( start, cursor - start );
+  cursor++;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::GetIdent method
+// void Tokenizer::GetIdent method
 //
 //   GetIdent scans an identifier-like token.  It returns an
 //   identifier or a reserved word token.
 //
 
-Token* Tokenizer::GetIdent() {
+void Tokenizer::GetIdent(Token& T) {
   // an IDENTIFIER or a RESERVED WORD token
-  std::ostringstream ident;
-  while (isalnum(CurrentCh) || '_' == CurrentCh || '-' == CurrentCh) { 
+  const char* start = cursor;
+  while (cursor != end && (isalnum((unsigned char)*cursor) || '_' == *cursor || '-' == *cursor)) { 
     // While we still have something that can
-    ident << CurrentCh;
-    GetCh();
+    cursor++;
   }
-  return SearchReserved(ident.str());
+
+  SYMBOL tokSymbol = lookupReservedWord( string( start, cursor - start ) );
+  if( UNKNOWN == tokSymbol )
+    T.setIdent( start, cursor - start );
+  else
+    T.set( tokSymbol );
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::GetInt method
+// void Tokenizer::GetScalar method
 //
-//   GetInt scans an integer.  It returns an integer token.
+//   GetScalar scans a number.  It returns a scalar token.
 //
 
-Token* Tokenizer::GetScalar() {
-  // an INTEGER token
-  string ret( "" );
-  while (isdigit(CurrentCh) || '-' == CurrentCh || '.' == CurrentCh || 'e' == CurrentCh ) {
-    ret += CurrentCh;
-    GetCh();
+void Tokenizer::GetScalar(Token& T) {
+  const char* start = cursor;
+  while (cursor != end && (isdigit((unsigned char)*cursor) || '-' == *cursor || '.' == *cursor || 'e' == *cursor)) {
+    cursor++;
   }
-  return new ScalarToken( atof( ret.c_str() ) );
+  T.setScalar( ParseScalar( start, cursor ) );
+}
+
+// Plain decimals, which is nearly every number in a scene, are read here
+// without going through atof(). While the digits fit in a double's
+// mantissa and there are no more than 22 after the point, both the digits
+// and the power of ten are exact, so the one division rounds just like
+// atof() does and the result is the same to the bit. Exponents and
+// anything odd still go to atof().
+double Tokenizer::ParseScalar(const char* first, const char* last) {
+  static const double POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  const char* p = first;
+  bool negative = p != last && '-' == *p;
+  if (negative)
+    p++;
+
+  uint64_t mantissa = 0;
+  int digits = 0, fraction = 0;
+  for (; p != last && isdigit((unsigned char)*p) && digits < 19; p++, digits++)
+    mantissa = mantissa * 10 + (*p - '0');
+  if (p != last && '.' == *p) {
+    for (p++; p != last && isdigit((unsigned char)*p) && digits < 19; p++, digits++, fraction++)
+      mantissa = mantissa * 10 + (*p - '0');
+  }
+
+  if (p == last && digits > 0 && mantissa <= (1ULL << 53) && fraction <= 22) {
+    double value = (double)mantissa / POWERS_OF_TEN[fraction];
+    return negative ? -value : value;
+  }
+
+  return atof( string( first, last ).c_str() );
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::GetPunct() method
+// bool Tokenizer::ReadTupleList(TupleList&, int, int) method
 //
-//   Gets a punctuation token from input stream and returns it.
+//   The pre-scan of a list of number tuples. Only whitespace is allowed
+//   around the parens, commas and numbers; a comment or anything else
+//   sends the list back to the token at a time path.
 //
 
-Token* Tokenizer::GetPunct() {
-  Token* T;
+bool Tokenizer::ReadTupleList(TupleList& list, int minCount, int maxCount) {
+  list.clear();
+  if (peeked)
+    return false;
 
-  switch (CurrentCh) {
-  case '(':  GetCh(); T = new Token(LPAREN);     break;
-  case ')':  GetCh(); T = new Token(RPAREN);     break;
-  case '{':  GetCh(); T = new Token(LBRACE);     break;
-  case '}':  GetCh(); T = new Token(RBRACE);     break;
-  case ',':  GetCh(); T = new Token(COMMA);      break;
-  case '=':  GetCh(); T = new Token(EQUALS);     break;
-  case ';':  GetCh(); T = new Token(SEMICOLON);  break;
+  int lines = 0;
+  const char* lineStart = LineStart;
+  const char* p = SkipSpaces(cursor, lines, lineStart);
 
-  default:
-    std::ostringstream ost;
-    ost << "unexpected character: '" << CurrentCh << "'";
-    throw SyntaxErrorException(ost.str(), *this);
+  while (p != end && ')' != *p) {
+    if (list.size()) {
+      if (',' != *p)
+        return false;
+      p = SkipSpaces(p + 1, lines, lineStart);
+    }
+    if (p == end || '(' != *p)
+      return false;
+
+    const char* start = p++;
+    int count = 0;
+    char separator;
+    do {
+      // The same numbers GetScalar() takes
+      const char* number = p = SkipSpaces(p, lines, lineStart);
+      while (p != end && (isdigit((unsigned char)*p) || '-' == *p || '.' == *p || 'e' == *p))
+        p++;
+      if (p == number || 'e' == *number)
+        return false;
+      count++;
+
+      p = SkipSpaces(p, lines, lineStart);
+      if (p == end)
+        return false;
+      separator = *p++;
+    } while (',' == separator);
+
+    if (')' != separator || count < minCount || count > maxCount)
+      return false;
+    list.add(start, count);
+
+    p = SkipSpaces(p, lines, lineStart);
   }
 
-  return T;
+  // An empty list, or one that runs off the end, is the parser's to deal with
+  if (p == end || !list.size())
+    return false;
+
+  cursor = p;
+  LineNumber += lines;
+  LineStart = lineStart;
+  return true;
+}
+
+const char* Tokenizer::SkipSpaces(const char* p, int& lines, const char*& lineStart) const {
+  while (p != end && isspace((unsigned char)*p)) {
+    if ('\n' == *p) {
+      lines++;
+      lineStart = p + 1;
+    }
+    p++;
+  }
+  return p;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// void Tokenizer::UnGet(Token*) method
+// void Tokenizer::GetPunct() method
+//
+//   Gets a punctuation token from input stream and returns it.
 //
-//   UnGet returns the last read token to the input, where it will be
-//   returned for the next Get call.  At most 1 token can be pushed back
-//   at a time this way and this token is pointed to by the pointer
-//   TokenToUnGet.  TokenToUnGet must be non null.
 
-void Tokenizer::UnGet(Token* TokenToUnGet) {
-  if (UnGetToken != NULL) {
-    throw ParserFatalException("trying to UnGet more than one token");
+void Tokenizer::GetPunct(Token& T) {
+  switch (*cursor) {
+  case '(':  T.set(LPAREN);     break;
+  case ')':  T.set(RPAREN);     break;
+  case '{':  T.set(LBRACE);     break;
+  case '}':  T.set(RBRACE);     break;
+  case ',':  T.set(COMMA);      break;
+  case '=':  T.set(EQUALS);     break;
+  case ';':  T.set(SEMICOLON);  break;
+
+  default:
+    std::ostringstream ost;
+    ost << "unexpected character: '" << *cursor << "'";
+    throw SyntaxErrorException(ost.str(), *this);
   }
-  UnGetToken = TokenToUnGet;
+
+  cursor++;
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::Peek() method
+// const Token* Tokenizer::Peek() method
 //
-//   Peek reads the next token and pushes it back on the token stream
+//   Peek reads the next token and keeps it to be read again
 //
 
 const Token* Tokenizer::Peek() {
-  Token* T = GetNext();
-  UnGet(T);
-  return T;
+  if (!peeked) {
+    Scan(tokens[nextSlot]);
+    peeked = true;
+  }
+  return &tokens[nextSlot];
 }
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::Read(SYMBOL) method
+// const Token* Tokenizer::Read(SYMBOL) method
 //
 //   Read gets the next token and checks that it's of the expected type.
 //
 
-auto_ptr<Token> Tokenizer::Read(SYMBOL kind) {
-  auto_ptr<Token> T( Get() );
+const Token* Tokenizer::Read(SYMBOL kind) {
+  const Token* T = Get();
   if (T->kind() != kind) {
     string msg( getNameForToken( kind ) );
     msg.append( " expected, " );
@@ -332,46 +454,17 @@ bool Tokenizer::CondRead(SYMBOL kind) {
 
 //////////////////////////////////////////////////////////////////////////
 //
-// Token* Tokenizer::SearchReserved(const string&) private method
-//
-//   SearchReserved() maps a character string to an IdentToken or one of
-// several possible reserved word tokens, using a binary search on the
-// ReservedWords structure.
-//
-
-//
-// The list of all the Reserved words and their associated symbols,
-// in alphabetical order so this can be searched using binary search.
-//
-
-typedef std::map<string, SYMBOL> ReservedWordsMap;
-
-Token* Tokenizer::SearchReserved(const string& ident) const {
-  SYMBOL tokSymbol = lookupReservedWord( ident );
-  if( UNKNOWN == tokSymbol )
-  {
-    return new IdentToken( ident );
-  }
-  else
-  {
-    return new Token( tokSymbol );
-  }
-}
-
-//////////////////////////////////////////////////////////////////////////
-//
-// bool Tokenizer::CondReadCh(char) private method
+// void Tokenizer::PrintLine() method
 //
-//   CondReadCh checks to see if the CurrentCh is the same as the argument.
-// If so, CondReadCh eats that character (by calling GetCh())
-// and returns true.  If not, just return false.
+//   This method displays the line the current token is on.
 //
 
-bool Tokenizer::CondReadCh(char c) {
-  if (c == CurrentCh) {
-    GetCh();
-    return true;
-  } else {
-    return false;
+void Tokenizer::PrintLine( ostream& out ) const {
+  if (TokenLine > LastPrintedLine) {
+    const char* lineEnd = TokenLineStart;
+    while (lineEnd != end && '\n' != *lineEnd)
+      lineEnd++;
+    out << "# " << string( TokenLineStart, lineEnd ) << "\n" << std::endl;
+    LastPrintedLine = TokenLine;
   }
 }
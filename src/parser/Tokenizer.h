@@ -3,17 +3,17 @@
 #define __TOKENIZER_H__
 
 #include "Token.h"
-#include "../fileio/buffer.h"
+#include "TupleList.h"
 
 #include <string>
-#include <memory>
+#include <iostream>
 
 // Needed to correct for annoying "feature" in MSVC's compiler
 #pragma warning (disable: 4786)
 
 using std::string;
 using std::istream;
-using std::auto_ptr;
+using std::ostream;
 
 
 /*
@@ -27,31 +27,57 @@ using std::auto_ptr;
    PL0 project used for CSE401
    (http://www.cs.washington.edu/401).
 
+   It scans the whole file in one buffer, rather than a line and a
+   character at a time out of an istream: the big polymesh scenes are
+   almost all numbers, and loading them was mostly spent getting the
+   characters to the scanner. The tokens it hands out live in the
+   tokenizer and are reused (see Get()).
 */
 
 class Tokenizer {
   public:
+    // Scan everything in the stream, read into memory first
     Tokenizer(istream& fp, bool printTokens);
 
-    // destructively read & return the next token, skipping over whitespace
-    auto_ptr<Token> Get();
+    // Scan the size bytes at data (a mapped file, say), which have to
+    // stay put for as long as the tokenizer and its tokens are in use
+    Tokenizer(const char* data, size_t size, bool printTokens);
+
+    // destructively read & return the next token, skipping over whitespace.
+    // The token is the tokenizer's; it stays valid through one Peek(),
+    // and is reused by the Get() after that
+    const Token* Get();
 
     // non-destructively get the next token, pushing it back to be read again
     const Token* Peek();
 
     // Get() the next token, and check that it's of the expected SYMBOL type
-    auto_ptr<Token> Read(SYMBOL expected);
+    const Token* Read(SYMBOL expected);
 
     // read the next token only if it matches the expected token type.
     // Return whether it matches.
     bool CondRead(SYMBOL expected);
 
+    // If what follows, just after a list's opening paren, is nothing but
+    // tuples of minCount to maxCount numbers, note where they are in list
+    // and move on to the list's closing paren, returning true. Otherwise
+    // (or if a token has been peeked at) leave everything as it was, for
+    // the parser to go through a token at a time; a list with something
+    // wrong with it gets its error from there
+    bool ReadTupleList(TupleList& list, int minCount, int maxCount);
+
+    // The number in [first, last), the way atof() would read it
+    static double ParseScalar(const char* first, const char* last);
+
     // display the current source line onto the screen.
-    void PrintLine( ostream& out) const { buffer.PrintLine(out); }
+    void PrintLine( ostream& out) const;
 
     // return the column number/line number of the current token.
     int CurColumn() const { return TokenColumn; }
-    int CurLine() const { return buffer.CurLine(); }
+    int CurLine() const { return TokenLine; }
+
+    // How many bytes there are to scan
+    size_t size() const { return end - begin; }
 
     // Repeatedly scan tokens and throw them away.  Useful if this is the
     // last phase to be executed
@@ -60,36 +86,41 @@ class Tokenizer {
 protected:
     // private methods:
 
-    // push the argument token back onto the scanner's token stream;
-    // it will be returned by the next Get/Peek/Read/CondRead call
-    Token* GetNext();
-    void UnGet(Token* t);
-
-    Token* SearchReserved(const string&) const; // Convert ident string into token
-
-    void GetCh() { CurrentCh = buffer.GetCh(); }
-    bool CondReadCh(char expected);        // consume a character, if it matches
+    void Scan(Token& T);         // scan the next token into T
+    void MarkToken();            // the next token starts at the cursor
 
     void SkipWhiteSpace();        // skip spaces, tabs, newlines
 
-    Token* GetPunct();            // scan punctuation token
-    Token* GetScalar();           // scan integer token
-    Token* GetIdent();            // scan identifier token
-    Token* GetQuotedIdent();
+    // Past the whitespace at p, counting the lines it ends
+    const char* SkipSpaces(const char* p, int& lines, const char*& lineStart) const;
+    void NewLine(const char* start) { LineNumber++; LineStart = start; }
+
+    void GetPunct(Token& T);      // scan punctuation token
+    void GetScalar(Token& T);     // scan scalar token
+    void GetIdent(Token& T);      // scan identifier token
+    void GetQuotedIdent(Token& T);
 
 
     // private data:
 
-    Buffer buffer;                // The file buffer
-    char CurrentCh;               // The current character in the current line
+    std::string contents;         // The stream's contents, if given a stream
+    const char* begin;            // What is being scanned
+    const char* end;
+    const char* cursor;           // The next character to scan
 
-    Token* UnGetToken;            // The token that has been "ungot"
+    int LineNumber;               // The line the cursor is on, from 1
+    const char* LineStart;        // and where that line starts
 
-    int TokenColumn;              // The column where the last read token starts,
-                                  // for generating error messages
+    int TokenLine;                // The line and column where the last read
+    int TokenColumn;              // token starts, for generating error messages
+    const char* TokenLineStart;
+    mutable int LastPrintedLine;
+
+    Token tokens[2];              // The last token read, and the one peeked at
+    int nextSlot;                 // The one the next token goes in
+    bool peeked;                  // Whether it is already there
 
     bool _printTokens;            // printing flag
 };
 
 #endif
-
@@ -0,0 +1,71 @@
+#include <thread>
+#include <algorithm>
+#include <ctype.h>
+
+#include "TupleList.h"
+#include "Tokenizer.h"
+
+using namespace std;
+
+void TupleList::clear()
+{
+  starts.clear();
+  offsets.assign( 1, 0 );
+}
+
+void TupleList::add( const char* start, int count )
+{
+  if( offsets.empty() )
+    offsets.push_back( 0 );
+  starts.push_back( start );
+  offsets.push_back( offsets.back() + count );
+}
+
+void TupleList::convert( int threads )
+{
+  values.resize( numbers() );
+
+  threadCount = threads > 0 ? threads : max( (int)thread::hardware_concurrency(), 1 );
+  threadCount = (int)min<size_t>( threadCount, numbers() / MIN_NUMBERS_PER_THREAD + 1 );
+
+  vector<thread> workers;
+  for( int t = 1; t < threadCount; t++ )
+    workers.push_back( thread( &TupleList::convertChunk, this, t ) );
+
+  convertChunk( 0 );
+
+  for( size_t t = 0; t < workers.size(); t++ )
+    workers[t].join();
+}
+
+// The chunks are runs of whole tuples, so every thread knows where its
+// numbers start and writes somewhere no other thread does
+void TupleList::convertChunk( int chunk )
+{
+  size_t first = size() * chunk / threadCount;
+  size_t last = size() * (chunk + 1) / threadCount;
+  convertRange( first, last );
+}
+
+// The pre-scan has already checked every tuple is a '(' and numbers
+// separated by commas, with nothing but whitespace in between
+void TupleList::convertRange( size_t first, size_t last )
+{
+  for( size_t k = first; k < last; k++ )
+  {
+    const char* p = starts[k] + 1;
+    double* out = &values[offsets[k]];
+    for( int n = count( k ); n > 0; n-- )
+    {
+      while( isspace( (unsigned char)*p ) )
+        p++;
+      const char* number = p;
+      while( isdigit( (unsigned char)*p ) || '-' == *p || '.' == *p || 'e' == *p )
+        p++;
+      *out++ = Tokenizer::ParseScalar( number, p );
+      while( isspace( (unsigned char)*p ) )
+        p++;
+      p++;    // past the ',' or ')'
+    }
+  }
+}
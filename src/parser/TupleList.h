@@ -0,0 +1,54 @@
+#ifndef __TUPLELIST_H__
+
+#define __TUPLELIST_H__
+
+#include <vector>
+#include <stddef.h>
+
+/*
+  class TupleList:
+    A list of parenthesised tuples of numbers, like a trimesh's
+    points = ( (x,y,z), (x,y,z), ... ) or faces = ( (a,b,c), ... ),
+    read straight out of the scene text instead of a token at a time.
+
+    The Tokenizer pre-scans the list (see Tokenizer::ReadTupleList),
+    which checks its shape and notes where each tuple starts and how
+    many numbers it has. That is all it takes to know where every
+    number goes, so convert() can then turn the text into numbers in
+    chunks on as many threads as it's given. The numbers come out
+    exactly as the tokenizer would have read them.
+*/
+
+class TupleList
+{
+  public:
+    TupleList() : threadCount( 1 ) { }
+
+    void clear();
+    void add( const char* start, int count );
+
+    // How many tuples and numbers there are, and tuple k's numbers
+    size_t size() const { return starts.size(); }
+    size_t numbers() const { return offsets.empty() ? 0 : offsets.back(); }
+    int count( size_t k ) const { return (int)(offsets[k + 1] - offsets[k]); }
+    const double* tuple( size_t k ) const { return &values[offsets[k]]; }
+    const double* data() const { return values.empty() ? 0 : &values[0]; }
+
+    // Read the numbers, with threads threads (0 for one per hardware
+    // thread). Lists too short to be worth it are done on this one
+    void convert( int threads );
+
+    // Numbers per thread, below which starting another isn't worth it
+    static const size_t MIN_NUMBERS_PER_THREAD = 65536;
+
+  private:
+    void convertRange( size_t first, size_t last );
+    void convertChunk( int chunk );
+
+    std::vector<const char*> starts;      // each tuple's '('
+    std::vector<size_t> offsets;          // where each tuple's numbers go, and the total
+    std::vector<double> values;
+    int threadCount;
+};
+
+#endif
@@ -6,6 +6,12 @@
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "SceneObjects/trimesh.h"
+#include "scene/bvh.h"
+#include "scene/arena.h"
+#include "scene/bvhcache.h"
+#include "fileio/mappedfile.h"
+#include "fileio/meshimport.h"
 
 #include "parser/Tokenizer.h"
 #include "parser/Parser.h"
@@ -30,181 +36,256 @@ bool debugMode = false;
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
 // in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
-Vec3d RayTracer::trace( double x, double y )
+// The sampler is the random number stream for this one sample of the pixel.
+Vec3d RayTracer::trace( double x, double y, const Sampler& sampler )
 {
-	// Clear out the ray cache in the scene for debugging purposes,
-	scene->intersectCache.clear();
+	// Clear out the recorded rays for debugging purposes, so
+	// that only the rays for the current pixel get drawn
+	if (m_recordRays) {
+		m_rayRecorder.clear();
+	}
 	ray r( Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY );
 	
 	scene->getCamera().rayThrough( x,y,r );
 	int initialGlossyDepth = m_enableGlossyReflection ? 10 : 0;
-	Vec3d ret = traceRay( r, Vec3d(1.0,1.0,1.0), traceUI->getDepth(), initialGlossyDepth );
+	Vec3d ret = traceRay( r, Vec3d(1.0,1.0,1.0), traceUI->getDepth(), initialGlossyDepth, sampler );
 	ret.clamp();
 	return ret;
 }
 
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
+// Every ray spawned here gets its own child stream split off the
+// sampler, so the numbers a ray draws only depend on the path that
+// led to it and never on the order in which the pixels are traced.
 Vec3d RayTracer::traceRay( const ray& r, 
-	const Vec3d& thresh, int depth, int glossyReflectionDepth )
+	const Vec3d& thresh, int depth, int glossyReflectionDepth, const Sampler& sampler )
 {
 	isect i;
 
 	if( scene->intersect( r, i ) ) {
-		// YOUR CODE HERE
-
-		// An intersection occured!  We've got work to do.  For now,
-		// this code gets the material for the surface that was intersected,
-		// and asks that material to provide a color for the ray.  
+		return shadeHit( r, i, thresh, depth, glossyReflectionDepth, sampler );
+	} else {
+		// No intersection.  This ray travels to infinity, so we color
+		// it according to the background color, which in this (simple) case
+		// is just black.
 
-		// This is a great place to insert code for recursive ray tracing.
-		// Instead of just returning the result of shade(), add some
-		// more steps: add in the contributions from reflected and refracted
-		// rays.
+		return Vec3d( 0.0, 0.0, 0.0 );
+	}
+}
 
-		const Material& m = i.getMaterial();
-		Vec3d shading = m.shade(scene, r, i);
+// Everything traceRay() does once it has found what the ray hit. The
+// packet tracer comes in here too, with hits and shadow rays it traced for
+// a whole packet at once (blockedLights says which lights are blocked).
+// The reflected and refracted rays go off on their own from here: after
+// bouncing off different parts of the scene they rarely stay close enough
+// together to be worth tracing as a packet.
+Vec3d RayTracer::shadeHit( const ray& r, const isect& i,
+	const Vec3d& thresh, int depth, int glossyReflectionDepth, const Sampler& sampler, const uint32_t* blockedLights )
+{
+	// YOUR CODE HERE
 
-		if (depth <= 0) {
-			return shading;
-		}
+	// An intersection occured!  We've got work to do.  For now,
+	// this code gets the material for the surface that was intersected,
+	// and asks that material to provide a color for the ray.  
 
-		Vec3d totalReflection;
-		Vec3d totalRefraction;
-
-		// Common variables used by both reflection and refraction
-		Vec3d rayIntersectionPoint = r.at(i.t);
-		Vec3d theNormalVector = i.N;
-		Vec3d rayDirection = r.getDirection();
-
-		// Calculate reflection recursively
-		Vec3d reflectiveProperty = m.kr(i);
-		if (reflectiveProperty[0] != 0 || reflectiveProperty[1] != 0 || reflectiveProperty[2] != 0) {
-			// Calculate the reflection of the viewing vector, same as for specular, but replace L with V
-			// I switched around the terms slightly compared to the formula from the slides, because my
-			// reflections at depth > 2 were appearing upside down			
-			Vec3d reflectedViewingVector = rayDirection - 2 * (dotProduct(rayDirection, theNormalVector)) * theNormalVector;
-			reflectedViewingVector.normalize();
-
-			int glossyThreshold = 10;
-			Vec3d reflectedVector;
-
-			// If glossy reflection is enabled and the depth is > 0, proceed, otherwise
-			// cast a single ray with the reflected viewing vector like usual
-			if (glossyReflectionDepth > 0) {
-				int conalThreshold = 128;
-
-				for (int i = 0; i < glossyThreshold; i++) {
-					// Generate the initial random real number
-					double randomXValue = (valueRange(randomNumberEngine));
-					double randomYValue = (valueRange(randomNumberEngine));
-					double randomZValue = (valueRange(randomNumberEngine));
-
-					// Generate a phi value for x, y, and z to use with theta for angles
-					double phiValueX = 2 * M_PI * randomXValue;
-					double phiValueY = 2 * M_PI * randomYValue;
-					double phiValueZ = 2 * M_PI * randomZValue;
-
-					// Take the inverse cos of 1-the random value against the respective
-					// reflective property at each color value
-					double thetaX = acos(pow((1 - randomXValue), reflectiveProperty[0]));
-					double thetaY = acos(pow((1 - randomYValue), reflectiveProperty[1]));
-					double thetaZ = acos(pow((1 - randomZValue), reflectiveProperty[2]));
-
-					// Divide by conalThreshold to keep this in a tight conal shape
-					double xOffset = sin(phiValueX) * cos(thetaX)/conalThreshold;
-					double yOffset = cos(phiValueY) * sin(thetaY)/conalThreshold;
-					double zOffset = sin(phiValueZ) * tan(thetaZ)/conalThreshold;
-
-					// Create a new vector for the randomized ray direction, apply the
-					// values for x, y, and z to the true reflected viewing vector
-					Vec3d newRayDirection;
-					newRayDirection[0] = reflectedViewingVector[0] + xOffset;
-					newRayDirection[1] = reflectedViewingVector[1] + yOffset;
-					newRayDirection[2] = reflectedViewingVector[2] + zOffset;
-					newRayDirection.normalize();
-
-					ray reflectionRay(rayIntersectionPoint, newRayDirection, ray::REFLECTION);
-					reflectedVector += traceRay(reflectionRay, thresh, depth, glossyReflectionDepth-1);
-				}
-			}
+	// This is a great place to insert code for recursive ray tracing.
+	// Instead of just returning the result of shade(), add some
+	// more steps: add in the contributions from reflected and refracted
+	// rays.
 
-			// Create and cast a single reflection ray into the scene from the "regular" reflected
-			// viewing vector and get the intersection info, if it occurs. This will be executed for
-			// both glossy reflection and non-glossy (so executed only once for non-glossy)
-			ray reflectionRay(rayIntersectionPoint, reflectedViewingVector, ray::REFLECTION);
-			reflectedVector += traceRay(reflectionRay, thresh, depth-1, glossyReflectionDepth-1);
-			
-			if (m_enableGlossyReflection) {
-				reflectedVector = reflectedVector / glossyThreshold;
-			}
-			
-			
-			// Multiply by the material property for reflection
-			totalReflection = prod(reflectedVector, reflectiveProperty);			
-		}
+	const Material& m = i.getMaterial();
+	Vec3d shading = m.shade(scene, r, i, blockedLights);
 
-		// Calculate refraction recursively
-		Vec3d transmissiveProperty = m.kt(i);
-		if (transmissiveProperty[0] != 0 || transmissiveProperty[1] != 0 || transmissiveProperty[2] != 0) {
-			double indexOfRefractionForAir = 1.00029; // Air ~= 1
-			double angle = -theNormalVector * rayDirection;
-			double indexOfRefractionForRayOrigin, indexOfRefractionAtIntersectionPoint; // the ni and nr terms
-			bool isEnteringObject = angle > 0;
-
-			// Determine if the ray is entering or leave the object, and adjust the
-			// ni (indexOfRefractionForRayOrigin), nr (indexOfRefractionAtIntersectionPoint),
-			// and normalVector terms accordingly
-			if (isEnteringObject) {
-				indexOfRefractionForRayOrigin = indexOfRefractionForAir;
-				indexOfRefractionAtIntersectionPoint = m.index(i);
-			} else {
-				indexOfRefractionForRayOrigin = m.index(i);
-				indexOfRefractionAtIntersectionPoint = indexOfRefractionForAir;
-				theNormalVector = -theNormalVector;
-			}
+	SecondaryRay secondary[MAX_SECONDARY_RAYS];
+	int secondaryCount = secondaryRays(r, i, depth, glossyReflectionDepth, sampler, secondary);
+	if (secondaryCount == 0) {
+		return shading;
+	}
 
-			// Calculate the second term to find out the value of the square root first
-			double viDotProductN = dotProduct(rayDirection, theNormalVector);
-			double secondTermNumerator = (indexOfRefractionForRayOrigin * indexOfRefractionForRayOrigin) * (1 - (viDotProductN * viDotProductN));
-			double secondTermDenominator = indexOfRefractionAtIntersectionPoint * indexOfRefractionAtIntersectionPoint;
-			double secondTermDivision = secondTermNumerator / secondTermDenominator;
-			double secondTermSquareRoot = sqrt(1 - secondTermDivision);
+	Vec3d totalReflection;
+	Vec3d totalRefraction;
+	Vec3d reflectedVector;
+	bool reflected = false;
+
+	// Calculate reflection and refraction recursively
+	for (int k = 0; k < secondaryCount; k++) {
+		const SecondaryRay& s = secondary[k];
+		ray secondaryRay(s.position, s.direction, s.type);
+		Vec3d color = traceRay(secondaryRay, thresh, s.depth, s.glossyReflectionDepth, s.sampler);
+
+		if (s.type == ray::REFLECTION) {
+			reflectedVector += color;
+			reflected = true;
+		} else {
+			// Multiply by the material property for refraction/transmission
+			totalRefraction = prod(color, m.kt(i));
+		}
+	}
 
-			// If the square root term is < 0, then the refracted angle is > than 90 degrees,
-			// making this total internal reflection, not refraction
-			if (secondTermSquareRoot > 0) {
-				Vec3d secondTerm = theNormalVector * secondTermSquareRoot;
+	if (reflected) {
+		if (m_enableGlossyReflection) {
+			reflectedVector = reflectedVector / GLOSSY_REFLECTION_RAYS;
+		}
 
-				Vec3d firstTermBracketTerm = rayDirection - (theNormalVector * viDotProductN);
-				Vec3d firstTermNumerator = indexOfRefractionForRayOrigin * firstTermBracketTerm;
-				Vec3d firstTerm = firstTermNumerator / indexOfRefractionAtIntersectionPoint;
+		// Multiply by the material property for reflection
+		totalReflection = prod(reflectedVector, m.kr(i));
+	}
 
-				Vec3d refractedViewingVector = firstTerm - secondTerm;
+	// Update shading and return it
+	shading += totalReflection + totalRefraction;
+	return shading;
+}
 
-				// Create and cast the refraction ray into the scene and get the intersection info, if it occurs
-				ray refractionRay(rayIntersectionPoint, refractedViewingVector, ray::REFRACTION);
-				Vec3d refractedVector = traceRay(refractionRay, thresh, depth-1, glossyReflectionDepth-1);
+// The reflected and refracted rays to trace from the hit i on r, into
+// secondary, returning how many there are. Each comes with the depths and
+// sampler to trace it with, and the weight its color goes into r's with.
+// shadeHit() traces them right away; the wavefront integrator queues them.
+int RayTracer::secondaryRays( const ray& r, const isect& i, int depth, int glossyReflectionDepth,
+	const Sampler& sampler, SecondaryRay* secondary ) const
+{
+	if (depth <= 0) {
+		return 0;
+	}
 
-				// Multiply by the material property for refraction/transmission
-				totalRefraction = prod(refractedVector, transmissiveProperty);
+	const Material& m = i.getMaterial();
+	int count = 0;
+
+	// Common variables used by both reflection and refraction
+	Vec3d rayIntersectionPoint = r.at(i.t);
+	Vec3d theNormalVector = i.N;
+	Vec3d rayDirection = r.getDirection();
+
+	// The number of glossy reflection rays; the secondary rays are numbered
+	// 0..glossyThreshold-1 for those, then the mirror reflection, then refraction
+	int glossyThreshold = GLOSSY_REFLECTION_RAYS;
+
+	// Calculate reflection
+	Vec3d reflectiveProperty = m.kr(i);
+	if (reflectiveProperty[0] != 0 || reflectiveProperty[1] != 0 || reflectiveProperty[2] != 0) {
+		// Calculate the reflection of the viewing vector, same as for specular, but replace L with V
+		// I switched around the terms slightly compared to the formula from the slides, because my
+		// reflections at depth > 2 were appearing upside down			
+		Vec3d reflectedViewingVector = rayDirection - 2 * (dotProduct(rayDirection, theNormalVector)) * theNormalVector;
+		reflectedViewingVector.normalize();
+
+		// With glossy reflection on, the reflected colors get averaged
+		Vec3d reflectionWeight = m_enableGlossyReflection ? reflectiveProperty / glossyThreshold : reflectiveProperty;
+
+		// If glossy reflection is enabled and the depth is > 0, proceed, otherwise
+		// cast a single ray with the reflected viewing vector like usual
+		if (glossyReflectionDepth > 0) {
+			int conalThreshold = 128;
+
+			for (int i = 0; i < glossyThreshold; i++) {
+				// Generate the initial random real number
+				Sampler glossySampler = sampler.split(i);
+				double randomXValue = glossySampler.next();
+				double randomYValue = glossySampler.next();
+				double randomZValue = glossySampler.next();
+
+				// Generate a phi value for x, y, and z to use with theta for angles
+				double phiValueX = 2 * M_PI * randomXValue;
+				double phiValueY = 2 * M_PI * randomYValue;
+				double phiValueZ = 2 * M_PI * randomZValue;
+
+				// Take the inverse cos of 1-the random value against the respective
+				// reflective property at each color value
+				double thetaX = acos(pow((1 - randomXValue), reflectiveProperty[0]));
+				double thetaY = acos(pow((1 - randomYValue), reflectiveProperty[1]));
+				double thetaZ = acos(pow((1 - randomZValue), reflectiveProperty[2]));
+
+				// Divide by conalThreshold to keep this in a tight conal shape
+				double xOffset = sin(phiValueX) * cos(thetaX)/conalThreshold;
+				double yOffset = cos(phiValueY) * sin(thetaY)/conalThreshold;
+				double zOffset = sin(phiValueZ) * tan(thetaZ)/conalThreshold;
+
+				// Create a new vector for the randomized ray direction, apply the
+				// values for x, y, and z to the true reflected viewing vector
+				Vec3d newRayDirection;
+				newRayDirection[0] = reflectedViewingVector[0] + xOffset;
+				newRayDirection[1] = reflectedViewingVector[1] + yOffset;
+				newRayDirection[2] = reflectedViewingVector[2] + zOffset;
+				newRayDirection.normalize();
+
+				SecondaryRay& glossyRay = secondary[count++];
+				glossyRay.position = offsetRayOrigin(rayIntersectionPoint, theNormalVector, newRayDirection);
+				glossyRay.direction = newRayDirection;
+				glossyRay.type = ray::REFLECTION;
+				glossyRay.depth = depth;
+				glossyRay.glossyReflectionDepth = glossyReflectionDepth-1;
+				glossyRay.sampler = glossySampler;
+				glossyRay.weight = reflectionWeight;
 			}
 		}
 
-		// Update shading and return it
-		shading += totalReflection + totalRefraction;
-		return shading;
-	} else {
-		// No intersection.  This ray travels to infinity, so we color
-		// it according to the background color, which in this (simple) case
-		// is just black.
+		// A single reflection ray from the "regular" reflected viewing vector.
+		// This is cast for both glossy reflection and non-glossy (so only
+		// once for non-glossy)
+		SecondaryRay& reflectionRay = secondary[count++];
+		reflectionRay.position = offsetRayOrigin(rayIntersectionPoint, theNormalVector, reflectedViewingVector);
+		reflectionRay.direction = reflectedViewingVector;
+		reflectionRay.type = ray::REFLECTION;
+		reflectionRay.depth = depth-1;
+		reflectionRay.glossyReflectionDepth = glossyReflectionDepth-1;
+		reflectionRay.sampler = sampler.split(glossyThreshold);
+		reflectionRay.weight = reflectionWeight;
+	}
 
-		return Vec3d( 0.0, 0.0, 0.0 );
+	// Calculate refraction
+	Vec3d transmissiveProperty = m.kt(i);
+	if (transmissiveProperty[0] != 0 || transmissiveProperty[1] != 0 || transmissiveProperty[2] != 0) {
+		double indexOfRefractionForAir = 1.00029; // Air ~= 1
+		double angle = -theNormalVector * rayDirection;
+		double indexOfRefractionForRayOrigin, indexOfRefractionAtIntersectionPoint; // the ni and nr terms
+		bool isEnteringObject = angle > 0;
+
+		// Determine if the ray is entering or leave the object, and adjust the
+		// ni (indexOfRefractionForRayOrigin), nr (indexOfRefractionAtIntersectionPoint),
+		// and normalVector terms accordingly
+		if (isEnteringObject) {
+			indexOfRefractionForRayOrigin = indexOfRefractionForAir;
+			indexOfRefractionAtIntersectionPoint = m.index(i);
+		} else {
+			indexOfRefractionForRayOrigin = m.index(i);
+			indexOfRefractionAtIntersectionPoint = indexOfRefractionForAir;
+			theNormalVector = -theNormalVector;
+		}
+
+		// Calculate the second term to find out the value of the square root first
+		double viDotProductN = dotProduct(rayDirection, theNormalVector);
+		double secondTermNumerator = (indexOfRefractionForRayOrigin * indexOfRefractionForRayOrigin) * (1 - (viDotProductN * viDotProductN));
+		double secondTermDenominator = indexOfRefractionAtIntersectionPoint * indexOfRefractionAtIntersectionPoint;
+		double secondTermDivision = secondTermNumerator / secondTermDenominator;
+		double secondTermSquareRoot = sqrt(1 - secondTermDivision);
+
+		// If the square root term is < 0, then the refracted angle is > than 90 degrees,
+		// making this total internal reflection, not refraction
+		if (secondTermSquareRoot > 0) {
+			Vec3d secondTerm = theNormalVector * secondTermSquareRoot;
+
+			Vec3d firstTermBracketTerm = rayDirection - (theNormalVector * viDotProductN);
+			Vec3d firstTermNumerator = indexOfRefractionForRayOrigin * firstTermBracketTerm;
+			Vec3d firstTerm = firstTermNumerator / indexOfRefractionAtIntersectionPoint;
+
+			Vec3d refractedViewingVector = firstTerm - secondTerm;
+
+			SecondaryRay& refractionRay = secondary[count++];
+			refractionRay.position = offsetRayOrigin(rayIntersectionPoint, theNormalVector, refractedViewingVector);
+			refractionRay.direction = refractedViewingVector;
+			refractionRay.type = ray::REFRACTION;
+			refractionRay.depth = depth-1;
+			refractionRay.glossyReflectionDepth = glossyReflectionDepth-1;
+			refractionRay.sampler = sampler.split(glossyThreshold+1);
+			refractionRay.weight = transmissiveProperty;
+		}
 	}
+
+	return count;
 }
 
 RayTracer::RayTracer()
-	: scene( 0 ), buffer( 0 ), buffer_width( 256 ), buffer_height( 256 ), m_bBufferReady( false )
+	: scene( 0 ), buffer( 0 ), buffer_width( 256 ), buffer_height( 256 ), m_bBufferReady( false ), m_recordRays( false )
 {
 }
 
@@ -229,8 +310,9 @@ double RayTracer::aspectRatio()
 
 bool RayTracer::loadScene( char* fn )
 {
-	ifstream ifs( fn );
-	if( !ifs ) {
+	// The tokenizer scans the file right where it is mapped
+	MappedFile file;
+	if( !file.open( fn ) ) {
 		string msg( "Error: couldn't read scene file " );
 		msg.append( fn );
 		traceUI->alert( msg );
@@ -245,8 +327,10 @@ bool RayTracer::loadScene( char* fn )
 		path = path.substr(0, path.find_last_of( "\\/" ));
 
 	// Call this with 'true' for debug output from the tokenizer
-	Tokenizer tokenizer( ifs, false );
+	Tokenizer tokenizer( file.data(), file.size(), false );
     Parser parser( tokenizer, path );
+	parser.setThreads( traceUI->getThreads() );
+	MeshImportStats::reset();
 	try {
 		delete scene;
 		scene = 0;
@@ -273,6 +357,19 @@ bool RayTracer::loadScene( char* fn )
 	if( ! sceneLoaded() )
 		return false;
 
+	m_rayRecorder.clear();
+	scene->setRayRecorder( m_recordRays ? &m_rayRecorder : 0 );
+
+	// With a cache directory, the meshes' trees are looked up there by
+	// their contents when the BVH is created, and saved there if they
+	// have to be built
+	if( !traceUI->getBVHCacheDir().empty() )
+		scene->setBVHCache( new BVHCache( traceUI->getBVHCacheDir() ) );
+
+	// Meshes nothing else shares go into world space now, so their rays
+	// skip the trip into local space
+	scene->moveToWorldSpace();
+
 	
 	return true;
 }
@@ -285,14 +382,86 @@ bool RayTracer::loadScene( char* fn )
 // (I originally put this in scene and called it after the file
 // was loaded, but sometimes it would not load in time for the code
 // to execute and reach the creation for the BVH - in short,
-// it was unreliable. Here, it's reliable). Returns created or not
+// it was unreliable. Here, it's reliable). Returns created or not.
+// Only the first render of a scene actually builds anything; the scene
+// keeps its trees for the renders after it (see Scene::createBVH)
 bool RayTracer::createBVH() {
-	return scene->createBVH();
+	BVHBuildOptions options;
+	options.splitMethod = traceUI->bvhMedianSplitEnabled() ? BVHBuildOptions::SPLIT_MEDIAN : BVHBuildOptions::SPLIT_SAH;
+	options.binCount = traceUI->getBVHBins();
+	options.maxLeafSize = traceUI->getBVHLeafSize();
+	options.nodeWidth = traceUI->getBVHNodeWidth();
+	options.buildThreads = traceUI->getThreads();
+
+	return scene->createBVH(options);
+}
+
+void RayTracer::printBVHStats( std::ostream& out ) const
+{
+	const BVHBuildStats* stats = sceneLoaded() ? scene->bvhStats() : 0;
+	if (stats == 0)
+		return;
+
+	// A 4-wide tree has no leaf nodes: its leaves are slots in its nodes
+	bool wide = traceUI->getBVHNodeWidth() == 4;
+
+	out << "BVH objects:                " << stats->primitiveCount << std::endl;
+	out << (wide ? "BVH nodes (leaf slots):     " : "BVH nodes (leaves):         ")
+		<< stats->nodeCount << " (" << stats->leafCount << ")" << std::endl;
+	out << "BVH depth:                  " << stats->maxDepth << std::endl;
+	out << "BVH SAH cost:               " << stats->sahCost << std::endl;
+	out << "BVH build time:             " << stats->buildTime << " seconds (" << stats->buildThreads << " threads)" << std::endl;
+	out << "BVH memory:                 " << stats->memoryBytes << " bytes" << std::endl;
+
+	// The trees stay with the scene from one render to the next, so the
+	// times above may be from an earlier render's build. (Not to be mixed
+	// up with the cache files below, which keep mesh trees between runs)
+	out << "BVH trees:                  " << (scene->bvhWasReused() ? "reused" : "built") << " ("
+		<< scene->bvhBuildCount() << " builds since the scene was loaded)" << std::endl;
+	out << "BVH memory, all trees:      " << scene->bvhBytes() << " bytes, held until the scene is unloaded" << std::endl;
+
+	if (const BVHCache* cache = scene->bvhCache()) {
+		out << "BVH cache files:            " << cache->loaded() << " loaded, " << cache->saved() << " built and saved, in "
+			<< cache->getDirectory() << std::endl;
+	}
+
+	// The builders' trees before they were packed, every BVH included
+	ArenaStats pool = Arena::total(Arena::BVH_NODES);
+	out << "BVH build node pool:        " << pool.allocations << " nodes in " << pool.chunks << " chunks ("
+		<< pool.reusedChunks << " reused, " << pool.bytesReserved << " bytes)" << std::endl;
+
+	int transforms[4];
+	scene->countTransforms(transforms);
+	out << "Object transforms:          " << transforms[TransformNode::IDENTITY] << " identity ("
+		<< scene->movedToWorldSpace() << " moved to world space), " << transforms[TransformNode::TRANSLATION] << " translation, "
+		<< transforms[TransformNode::UNIFORM_SCALE] << " uniform scale, " << transforms[TransformNode::AFFINE] << " affine" << std::endl;
+
+	// The per-trimesh trees below the objects, all added together
+	BVHBuildStats meshStats;
+	int meshes = scene->bottomLevelStats(meshStats);
+	if (meshes == 0)
+		return;
+
+	out << "Mesh BVHs (triangles):      " << meshes << " (" << meshStats.primitiveCount << ")" << std::endl;
+	out << (wide ? "Mesh BVH nodes (leaf slots): " : "Mesh BVH nodes (leaves):    ")
+		<< meshStats.nodeCount << " (" << meshStats.leafCount << ")" << std::endl;
+	out << "Mesh BVH depth:             " << meshStats.maxDepth << std::endl;
+	out << "Mesh BVH build time:        " << meshStats.buildTime << " seconds (" << meshStats.buildThreads << " threads at most)" << std::endl;
+	out << "Triangle test:              " << Trimesh::triangleKernel() << std::endl;
+
+	// What the triangles cost to keep around: their vertex and index
+	// arrays, then their trees
+	size_t geometryBytes = scene->geometryBytes();
+	double triangles = std::max(meshStats.primitiveCount, 1);
+	out << "Mesh storage:               " << geometryBytes << " bytes ("
+		<< geometryBytes / triangles << " per triangle)" << std::endl;
+	out << "Mesh BVH memory:            " << meshStats.memoryBytes << " bytes ("
+		<< meshStats.memoryBytes / triangles << " per triangle)" << std::endl;
 }
 
 void RayTracer::traceSetup( int w, int h, bool enableBVH, bool enableAntialiasing, bool enableGlossyReflection )
 {
-	if( buffer_width != w || buffer_height != h )
+	if( buffer_width != w || buffer_height != h || !buffer )
 	{
 		buffer_width = w;
 		buffer_height = h;
@@ -303,6 +472,8 @@ void RayTracer::traceSetup( int w, int h, bool enableBVH, bool enableAntialiasin
 
 	}
 	memset( buffer, 0, w*h*3 );
+	std::vector<float>().swap( accumulation );
+	std::vector<bool>().swap( blackPixels );
 	m_bBufferReady = true;
 
 	// Custom options
@@ -310,6 +481,17 @@ void RayTracer::traceSetup( int w, int h, bool enableBVH, bool enableAntialiasin
 	scene->enableBVHEnabled(enableBVH);
 	m_enableAntialiasing = enableAntialiasing;
 	m_enableGlossyReflection = enableGlossyReflection;
+
+	// Whatever the render threads kept for the last frame is done with
+	Arena::resetFrames();
+}
+
+void RayTracer::enableRayRecording( bool value )
+{
+	m_recordRays = value;
+
+	if( sceneLoaded() )
+		scene->setRayRecorder( m_recordRays ? &m_rayRecorder : 0 );
 }
 
 void RayTracer::tracePixel( int i, int j )
@@ -324,72 +506,139 @@ void RayTracer::tracePixel( int i, int j )
 
 	if (m_enableAntialiasing) {
 		int totalSamples = traceUI->getAntialiasingSamples();
-		
-		// Sample each of the four corners of the pixel for cases
-		// 0-4, and the center for case 5 (so do nothing for case 5).
-		// This helps to speed up the antialiasing process a bit, as
-		// if this pixel will "likely" just output a black color, then
-		// there's no need to check all given sample levels (8 to
-		// potentially 64). Helps a ton for scenes with a lot of empty space
-		for (int k = 0; k < 5; k++) {
-			double preSupersampleXValue = x;
-			double preSupersampleYValue = y;
-
-			switch (k) {
-				case 0:
-					preSupersampleXValue += -1;
-					preSupersampleYValue += -1;
-					break;
-				case 1:
-					preSupersampleXValue += -1;
-					preSupersampleYValue += 1;
-					break;
-				case 2:
-					preSupersampleXValue += 1;
-					preSupersampleYValue += -1;
-					break;
-				case 3:
-					preSupersampleXValue += 1;
-					preSupersampleYValue += 1;
-					break;
-				case 4:
-					break;
-			}
-			
-			col += trace(preSupersampleXValue, preSupersampleYValue);
-		}
-
-		col = col / 5;
 
 		// Check if this pixel is anything other than pure black
 		// If it is, execute the supersampling, otherwise continue
-		if (col[0] != 0 || col[1] != 0 || col[2] != 0) {
-			col = Vec3d(0,0,0); // Reinitialize to remove the color value from pre-supersampling
-
+		if (!preSampledBlack(i, j, totalSamples)) {
 			for (int k = 0; k < totalSamples; k++) {
-				// Generate a random number from -1 to 1 for both X and Y. I found
-				// that the engine needs to be initialized only once, otherwise
-				// it will generate a series of repeating "random" numbers. Make
-				// sure that this value is clamped within the width and height buffers
-				double randomXValue = (valueRange(randomNumberEngine) * 2 - 1) / buffer_width;
-				double randomYValue = (valueRange(randomNumberEngine) * 2 - 1) / buffer_height;
-
-				// Generate a sample value for this x and y coordinate
-				double randomXSampleValue = x + randomXValue;
-				double randomYSampleValue = y + randomYValue;
-
-				// Call the trace() function with these sample values and add the
-				// resulting color to the overall color
-				col += trace(randomXSampleValue, randomYSampleValue);
+				col += traceSample(i, j, k);
 			}
 
 			// Divide by the total number of samples to average out the overall color
 			col = col / totalSamples;
 		}
 	} else {
-		col = trace( x,y );
+		col = trace( x,y, Sampler(i, j, 0) );
 	}
 
+	setPixel( i, j, col );
+}
+
+// Whether pixel (i, j) comes out black with antialiasing, going by a
+// few rays around it before tracing all its samples
+bool RayTracer::preSampledBlack( int i, int j, int totalSamples )
+{
+	Vec3d col;
+	double x = double(i)/double(buffer_width);
+	double y = double(j)/double(buffer_height);
+
+	// Sample each of the four corners of the pixel for cases
+	// 0-4, and the center for case 5 (so do nothing for case 5).
+	// This helps to speed up the antialiasing process a bit, as
+	// if this pixel will "likely" just output a black color, then
+	// there's no need to check all given sample levels (8 to
+	// potentially 64). Helps a ton for scenes with a lot of empty space
+	for (int k = 0; k < 5; k++) {
+		double preSupersampleXValue = x;
+		double preSupersampleYValue = y;
+
+		switch (k) {
+			case 0:
+				preSupersampleXValue += -1;
+				preSupersampleYValue += -1;
+				break;
+			case 1:
+				preSupersampleXValue += -1;
+				preSupersampleYValue += 1;
+				break;
+			case 2:
+				preSupersampleXValue += 1;
+				preSupersampleYValue += -1;
+				break;
+			case 3:
+				preSupersampleXValue += 1;
+				preSupersampleYValue += 1;
+				break;
+			case 4:
+				break;
+		}
+		
+		// These come after the totalSamples jittered samples in the
+		// pixel's sample numbering
+		col += trace(preSupersampleXValue, preSupersampleYValue, Sampler(i, j, totalSamples + k));
+	}
+
+	col = col / 5;
+
+	return col[0] == 0 && col[1] == 0 && col[2] == 0;
+}
+
+Vec3d RayTracer::traceSample( int i, int j, int sample )
+{
+	double x = double(i)/double(buffer_width);
+	double y = double(j)/double(buffer_height);
+
+	// Generate a random number from -1 to 1 for both X and Y. Every
+	// sample of every pixel has its own stream, so this is the same
+	// no matter which thread traces the pixel or in which order. Make
+	// sure that this value is clamped within the width and height buffers
+	Sampler sampler(i, j, sample);
+	double randomXValue = (sampler.next() * 2 - 1) / buffer_width;
+	double randomYValue = (sampler.next() * 2 - 1) / buffer_height;
+
+	// Call the trace() function with the sample values for this x and y
+	// coordinate
+	return trace(x + randomXValue, y + randomYValue, sampler);
+}
+
+void RayTracer::tracePreviewPixel( int i, int j, int size )
+{
+	if( ! sceneLoaded() )
+		return;
+
+	Vec3d col = trace( double(i)/double(buffer_width), double(j)/double(buffer_height), Sampler(i, j, 0) );
+
+	for (int y = j; y < j + size && y < buffer_height; y++) {
+		for (int x = i; x < i + size && x < buffer_width; x++) {
+			setPixel( x, y, col );
+		}
+	}
+}
+
+void RayTracer::accumulateSample( int i, int j, int sample )
+{
+	if( ! sceneLoaded() )
+		return;
+
+	if (accumulation.empty()) {
+		accumulation.resize( bufferSize );
+		blackPixels.resize( buffer_width * buffer_height );
+	}
+
+	// The pixels tracePixel() leaves black stay black here too, so the
+	// image ends up the same as a render without passes
+	int pixel = i + j * buffer_width;
+	if (sample == 0) {
+		blackPixels[pixel] = preSampledBlack( i, j, traceUI->getAntialiasingSamples() );
+	}
+	if (blackPixels[pixel]) {
+		setPixel( i, j, Vec3d(0,0,0) );
+		return;
+	}
+
+	Vec3d col = traceSample( i, j, sample );
+
+	float *sum = &accumulation[ pixel * 3 ];
+	for (int c = 0; c < 3; c++) {
+		sum[c] = sample == 0 ? (float)col[c] : sum[c] + (float)col[c];
+		col[c] = sum[c] / (sample + 1);
+	}
+
+	setPixel( i, j, col );
+}
+
+void RayTracer::setPixel( int i, int j, const Vec3d& col )
+{
 	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
 
 	pixel[0] = (int)( 255.0 * col[0]);
@@ -397,3 +646,86 @@ void RayTracer::tracePixel( int i, int j )
 	pixel[2] = (int)( 255.0 * col[2]);
 }
 
+// Antialiasing traces a pixel's samples one at a time, and the debugging
+// view wants each pixel's rays recorded on their own
+bool RayTracer::packetTracingEnabled() const
+{
+	return traceUI->packetTracingEnabled() && !m_enableAntialiasing && !m_recordRays;
+}
+
+bool RayTracer::wavefrontEnabled() const
+{
+	return traceUI->wavefrontEnabled() && !m_recordRays;
+}
+
+// The camera rays through a block of pixels start at the same eye and
+// fan out only a little, so they are traced through the BVHs together,
+// and then so are their shadow rays towards each light. Everything
+// after that (reflection, refraction) goes ray by ray through shadeHit().
+// Each pixel comes out exactly as tracePixel() would have made it.
+void RayTracer::tracePacket( int i0, int j0, int i1, int j1 )
+{
+	if( ! sceneLoaded() )
+		return;
+
+	RayPacket packet( ray::VISIBILITY );
+	int n = 0;
+	for (int j = j0; j < j1; j++) {
+		for (int i = i0; i < i1; i++, n++) {
+			ray r( Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY );
+			scene->getCamera().rayThrough( double(i)/double(buffer_width), double(j)/double(buffer_height), r );
+			packet.set( n, r.getPosition(), r.getDirection() );
+		}
+	}
+	packet.prepare( packet.allRays() );
+
+	isect hits[RAY_PACKET_SIZE];
+	RayMask hitRays = scene->intersectPacket( packet, hits );
+
+	// A bit per light in blocked[k]; a scene with more lights than that
+	// leaves its shadow rays to shade(), one at a time
+	uint32_t blocked[RAY_PACKET_SIZE] = { 0 };
+	bool shadowsTraced = scene->endLights() - scene->beginLights() <= 32;
+
+	if (shadowsTraced && hitRays != 0) {
+		int l = 0;
+		for (vector<Light*>::const_iterator litr = scene->beginLights(); litr != scene->endLights(); ++litr, ++l) {
+			RayPacket shadows( ray::SHADOW );
+			double tMax[RAY_PACKET_SIZE];
+
+			for (int k = 0; k < packet.size; k++) {
+				tMax[k] = 0.0;
+				if (hitRays & (1u << k)) {
+					// The same point Material::shade() would send it from
+					Vec3d P = packet.getRay(k).at(hits[k].t);
+					ray shadowRay = (*litr)->shadowRay( offsetRayOrigin(P, hits[k].N, (*litr)->getDirection(P)), tMax[k] );
+					shadows.set( k, shadowRay.getPosition(), shadowRay.getDirection() );
+				}
+			}
+			shadows.size = packet.size;
+			shadows.prepare( hitRays );
+
+			RayMask blockedRays = scene->occludedPacket( shadows, hitRays, tMax );
+			for (int k = 0; k < packet.size; k++) {
+				if (blockedRays & (1u << k)) {
+					blocked[k] |= 1u << l;
+				}
+			}
+		}
+	}
+
+	int initialGlossyDepth = m_enableGlossyReflection ? 10 : 0;
+	n = 0;
+	for (int j = j0; j < j1; j++) {
+		for (int i = i0; i < i1; i++, n++) {
+			Vec3d col( 0.0, 0.0, 0.0 );
+			if (hitRays & (1u << n)) {
+				col = shadeHit( packet.getRay(n), hits[n], Vec3d(1.0,1.0,1.0), traceUI->getDepth(), initialGlossyDepth,
+					Sampler(i, j, 0), shadowsTraced ? &blocked[n] : 0 );
+			}
+			col.clamp();
+			setPixel( i, j, col );
+		}
+	}
+}
+
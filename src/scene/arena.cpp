@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <mutex>
+#include <stdlib.h>
+
+#include "arena.h"
+
+using namespace std;
+
+// The chunk cache, and the arenas signed in by kind. An arena that is
+// destroyed leaves its counts behind in retiredStats, so the totals still
+// include the render threads of frames that have finished.
+namespace
+{
+	std::mutex arenaLock;
+	std::vector<Arena*> liveArenas[Arena::KIND_COUNT];
+	ArenaStats retiredStats[Arena::KIND_COUNT];
+	void* cachedChunks = 0;		// a list of CHUNK_SIZE chunks, linked through their first word
+
+	struct ThreadFrameArena
+	{
+		ThreadFrameArena()
+			: arena( Arena::FRAME ) {}
+
+		Arena arena;
+	};
+}
+
+void ArenaStats::add( const ArenaStats& other )
+{
+	allocations += other.allocations;
+	bytesUsed += other.bytesUsed;
+	peakBytesUsed += other.peakBytesUsed;
+	chunks += other.chunks;
+	reusedChunks += other.reusedChunks;
+	bytesReserved += other.bytesReserved;
+	resets += other.resets;
+}
+
+Arena::Arena( Kind kind )
+	: kind( kind ), first( 0 ), current( 0 ), next( 0 ), end( 0 )
+{
+	std::lock_guard<std::mutex> guard(arenaLock);
+	liveArenas[kind].push_back(this);
+}
+
+Arena::~Arena()
+{
+	std::lock_guard<std::mutex> guard(arenaLock);
+
+	retiredStats[kind].add(stats);
+	liveArenas[kind].erase(std::find(liveArenas[kind].begin(), liveArenas[kind].end(), this));
+
+	// The standard sized chunks are kept for the next arena; only the
+	// odd oversized one for a single large block goes back to the heap
+	while (first) {
+		Chunk* chunk = first;
+		first = chunk->next;
+
+		if (chunk->size == CHUNK_SIZE) {
+			*(void**)chunk = cachedChunks;
+			cachedChunks = chunk;
+		} else {
+			free(chunk);
+		}
+	}
+}
+
+void* Arena::allocate( size_t bytes, size_t alignment )
+{
+	char* p = (char*)(((uintptr_t)next + alignment - 1) & ~(uintptr_t)(alignment - 1));
+
+	if (!current || p + bytes > end) {
+		p = nextChunk(bytes, alignment);
+	}
+
+	stats.allocations++;
+	stats.bytesUsed += p + bytes - next;
+	stats.peakBytesUsed = max(stats.peakBytesUsed, stats.bytesUsed);
+
+	next = p + bytes;
+	return p;
+}
+
+// Move on to the chunk after the current one, if it is big enough, or
+// else put a new one in after it. Returns where the block goes
+char* Arena::nextChunk( size_t bytes, size_t alignment )
+{
+	Chunk* chunk = current ? current->next : first;
+	size_t needed = bytes + alignment;
+
+	if (!chunk || chunk->size < needed) {
+		size_t size = max(needed, (size_t)CHUNK_SIZE);
+		Chunk* fresh = 0;
+
+		if (size == CHUNK_SIZE) {
+			std::lock_guard<std::mutex> guard(arenaLock);
+			if (cachedChunks) {
+				fresh = (Chunk*)cachedChunks;
+				cachedChunks = *(void**)cachedChunks;
+				stats.reusedChunks++;
+			}
+		}
+
+		if (!fresh) {
+			fresh = (Chunk*)malloc(sizeof(Chunk) + size);
+			if (!fresh) {
+				throw std::bad_alloc();
+			}
+		}
+
+		fresh->size = size;
+		fresh->next = chunk;
+		if (current) {
+			current->next = fresh;
+		} else {
+			first = fresh;
+		}
+		chunk = fresh;
+
+		stats.chunks++;
+		stats.bytesReserved += size;
+	}
+
+	// What's left at the end of the chunk we are leaving counts as used
+	stats.bytesUsed += end - next;
+
+	current = chunk;
+	next = (char*)(chunk + 1);
+	end = next + chunk->size;
+
+	return (char*)(((uintptr_t)next + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
+void Arena::reset()
+{
+	current = 0;
+	next = end = 0;
+	stats.bytesUsed = 0;
+	stats.resets++;
+}
+
+Arena& Arena::frame()
+{
+	static thread_local ThreadFrameArena local;
+	return local.arena;
+}
+
+void Arena::resetFrames()
+{
+	// Only the threads between frames are still signed in: the render
+	// threads exit at the end of each one
+	std::lock_guard<std::mutex> guard(arenaLock);
+
+	for (size_t i = 0; i < liveArenas[FRAME].size(); i++) {
+		liveArenas[FRAME][i]->reset();
+	}
+}
+
+ArenaStats Arena::total( Kind kind )
+{
+	std::lock_guard<std::mutex> guard(arenaLock);
+
+	ArenaStats sum = retiredStats[kind];
+	for (size_t i = 0; i < liveArenas[kind].size(); i++) {
+		sum.add(liveArenas[kind][i]->getStats());
+	}
+	return sum;
+}
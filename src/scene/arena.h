@@ -0,0 +1,127 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+// A bump allocator for things that are made in bulk and thrown away all
+// together: the BVH builder's nodes, and the queues a render thread fills
+// while tracing a frame. allocate() just moves a pointer along a chunk of
+// memory, and nothing is freed one at a time; reset() rewinds the arena to
+// the start so the same chunks are used over again. Chunks an arena no
+// longer needs go back to a cache shared by all threads rather than to
+// the heap, so after the first frame or two nothing here calls malloc().
+//
+// Every arena counts what it hands out. The arenas sign in by kind, so
+// total() can add up all the frame arenas, say, even those of render
+// threads that have since exited.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct ArenaStats
+{
+	ArenaStats()
+		: allocations( 0 ), bytesUsed( 0 ), peakBytesUsed( 0 ),
+		  chunks( 0 ), reusedChunks( 0 ), bytesReserved( 0 ), resets( 0 ) {}
+
+	uint64_t allocations;		// blocks handed out
+	uint64_t bytesUsed;			// by those blocks since the last reset, padding included
+	uint64_t peakBytesUsed;		// the most that was ever in use at once
+	uint64_t chunks;			// chunks held
+	uint64_t reusedChunks;		// of those, the ones that came from the cache, not the heap
+	uint64_t bytesReserved;		// in those chunks
+	uint64_t resets;
+
+	void add( const ArenaStats& other );
+};
+
+class Arena
+{
+public:
+	enum Kind
+	{
+		FRAME,			// per thread scratch for tracing one frame
+		BVH_NODES,		// the builder's tree, until it is packed
+		KIND_COUNT
+	};
+
+	static const size_t CHUNK_SIZE = 64 * 1024;
+
+	Arena( Kind kind );
+	~Arena();
+
+	void* allocate( size_t bytes, size_t alignment = alignof(max_align_t) );
+
+	// The arena never runs destructors, so only types that don't need
+	// them can be made in it
+	template <typename T, typename... Args>
+	T* create( Args&&... args )
+	{
+		static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+		return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+
+	// Forget everything allocated so far, keeping the chunks for reuse.
+	// Nothing allocated before may be used afterwards
+	void reset();
+
+	const ArenaStats& getStats() const { return stats; }
+
+	// This thread's arena for the frame being traced. It lasts until
+	// resetFrames(), which RayTracer::traceSetup() calls before each frame
+	static Arena& frame();
+	static void resetFrames();
+
+	// Every arena of one kind, live or since destroyed
+	static ArenaStats total( Kind kind );
+
+private:
+	struct Chunk
+	{
+		Chunk* next;
+		size_t size;	// of the memory following this header
+	};
+
+	char* nextChunk( size_t bytes, size_t alignment );
+
+	Kind kind;
+	Chunk* first;
+	Chunk* current;
+	char* next;			// the free space left in current
+	char* end;
+	ArenaStats stats;
+
+	// No copying, there would be two owners of the chunks
+	Arena( const Arena& );
+	Arena& operator =( const Arena& );
+};
+
+// Lets standard containers live in an arena. Freeing does nothing; the
+// memory comes back when the arena is reset
+template <typename T>
+struct ArenaAllocator
+{
+	typedef T value_type;
+
+	ArenaAllocator( Arena& arena ) : arena( &arena ) {}
+
+	template <typename U>
+	ArenaAllocator( const ArenaAllocator<U>& other ) : arena( other.arena ) {}
+
+	T* allocate( size_t n ) { return (T*)arena->allocate(n * sizeof(T), alignof(T)); }
+	void deallocate( T*, size_t ) {}
+
+	template <typename U>
+	bool operator ==( const ArenaAllocator<U>& other ) const { return arena == other.arena; }
+	template <typename U>
+	bool operator !=( const ArenaAllocator<U>& other ) const { return arena != other.arena; }
+
+	Arena* arena;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif // __ARENA_H__
@@ -0,0 +1,684 @@
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <thread>
+
+#include "bvh.h"
+#include "qbvh.h"
+
+using namespace std;
+
+// The SAH cost of stepping into a node relative to testing one object
+static const double TRAVERSAL_COST = 1.0;
+
+// Trees with fewer objects than this are built on one thread; starting
+// the others would take longer than the whole build
+static const int PARALLEL_BUILD_MIN = 4096;
+
+// Nodes with at least this many objects have their bounds and bins
+// worked out by all the build threads together
+static const int PARALLEL_BIN_MIN = 32768;
+
+// The top levels are split until there are about this many subtree
+// tasks per thread, so the threads that draw small ones can take more
+static const int TASKS_PER_THREAD = 4;
+
+bool BVH::orderedTraversal = true;
+
+// Every thread counts into its own BVHTraversalStats. They all sign in
+// here so total() can find them, and a thread that exits (the render
+// threads do after every frame) leaves its counts behind in retired.
+namespace
+{
+	std::mutex statsLock;
+	std::vector<BVHTraversalStats*> liveStats;
+	BVHTraversalStats retiredStats;
+
+	struct ThreadStats
+	{
+		ThreadStats()
+		{
+			std::lock_guard<std::mutex> guard(statsLock);
+			liveStats.push_back(&counts);
+		}
+
+		~ThreadStats()
+		{
+			std::lock_guard<std::mutex> guard(statsLock);
+			retiredStats.add(counts);
+			liveStats.erase(std::find(liveStats.begin(), liveStats.end(), &counts));
+		}
+
+		BVHTraversalStats counts;
+	};
+}
+
+void BVHTraversalStats::add( const BVHTraversalStats& other )
+{
+	rays += other.rays;
+	nodesVisited += other.nodesVisited;
+	objectsTested += other.objectsTested;
+	occlusionRays += other.occlusionRays;
+	occlusionNodesVisited += other.occlusionNodesVisited;
+	occlusionObjectsTested += other.occlusionObjectsTested;
+	packets += other.packets;
+	packetRays += other.packetRays;
+	packetNodesVisited += other.packetNodesVisited;
+	packetObjectsTested += other.packetObjectsTested;
+}
+
+BVHTraversalStats& BVHTraversalStats::local()
+{
+	static thread_local ThreadStats stats;
+	return stats.counts;
+}
+
+BVHTraversalStats BVHTraversalStats::total()
+{
+	std::lock_guard<std::mutex> guard(statsLock);
+
+	BVHTraversalStats sum = retiredStats;
+	for (size_t i = 0; i < liveStats.size(); i++) {
+		sum.add(*liveStats[i]);
+	}
+	return sum;
+}
+
+void BVHTraversalStats::reset()
+{
+	std::lock_guard<std::mutex> guard(statsLock);
+
+	retiredStats = BVHTraversalStats();
+	for (size_t i = 0; i < liveStats.size(); i++) {
+		*liveStats[i] = BVHTraversalStats();
+	}
+}
+
+// Orders objects by their centroid along one axis
+struct CentroidLess
+{
+	int axis;
+
+	CentroidLess( int axis ) : axis( axis ) {}
+
+	template <typename U>
+	bool operator()( const U& left, const U& right ) const
+	{
+		return left.centroid[axis] < right.centroid[axis];
+	}
+};
+
+// Is an object's centroid in one of the buckets left of the chosen split?
+struct CentroidBelowBin
+{
+	int axis, binCount, splitBin;
+	double axisMin, axisScale;
+
+	template <typename U>
+	bool operator()( const U& object ) const
+	{
+		int bin = (int)((object.centroid[axis] - axisMin) * axisScale);
+		return min(bin, binCount - 1) <= splitBin;
+	}
+};
+
+static int longestAxis( const BoundingBox& box )
+{
+	Vec3d extent = box.max - box.min;
+
+	if (extent[0] >= extent[1] && extent[0] >= extent[2]) {
+		return 0;
+	} else if (extent[1] >= extent[2]) {
+		return 1;
+	}
+	return 2;
+}
+
+BVHBuilder::~BVHBuilder()
+{
+	for (size_t i = 0; i < contexts.size(); i++) {
+		delete contexts[i];
+	}
+}
+
+BVHNode* BVHBuilder::build( const std::vector<BoundingBox>& bounds, std::vector<int>& order, BVHBuildStats& stats )
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	this->stats = &stats;
+	stats = BVHBuildStats();
+	stats.primitiveCount = bounds.size();
+
+	objects.resize(bounds.size());
+	for (size_t i = 0; i < bounds.size(); i++) {
+		objects[i].bounds = bounds[i];
+		objects[i].centroid = (bounds[i].min + bounds[i].max) / 2.0;
+		objects[i].index = i;
+	}
+
+	threadCount = options.buildThreads > 0 ? options.buildThreads : max((int)thread::hardware_concurrency(), 1);
+	if (objects.size() < PARALLEL_BUILD_MIN) {
+		threadCount = 1;
+	}
+
+	// The last tree built is done with
+	int binCount = max(options.binCount, 2);
+	while (contexts.size() < (size_t)threadCount) {
+		contexts.push_back(new BuildContext());
+	}
+	for (size_t t = 0; t < contexts.size(); t++) {
+		BuildContext& ctx = *contexts[t];
+		ctx.nodes.reset();
+		ctx.binObjects.resize(3 * binCount);
+		ctx.binBounds.resize(3 * binCount);
+		ctx.rightCost.resize(binCount);
+		ctx.nodeCount = ctx.leafCount = ctx.maxDepth = 0;
+	}
+
+	BVHNode* root = 0;
+	if (!objects.empty()) {
+		if (threadCount > 1) {
+			subtreeSize = max((int)objects.size() / (threadCount * TASKS_PER_THREAD), 1);
+			contexts[0]->topLevel = true;
+			root = buildRange(0, objects.size(), 1, *contexts[0]);
+			contexts[0]->topLevel = false;
+			buildSubtrees();
+		} else {
+			root = buildRange(0, objects.size(), 1, *contexts[0]);
+		}
+		computeCost(root, root->boundingBox.area());
+	}
+
+	for (size_t t = 0; t < contexts.size(); t++) {
+		stats.nodeCount += contexts[t]->nodeCount;
+		stats.leafCount += contexts[t]->leafCount;
+		stats.maxDepth = max(stats.maxDepth, contexts[t]->maxDepth);
+	}
+	stats.buildThreads = threadCount;
+
+	order.resize(objects.size());
+	for (size_t i = 0; i < objects.size(); i++) {
+		order[i] = objects[i].index;
+	}
+	objects.clear();
+
+	stats.buildTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	return root;
+}
+
+BVHNode* BVHBuilder::buildRange( int begin, int end, int depth, BuildContext& ctx )
+{
+	BVHNode* node = ctx.nodes.create<BVHNode>();
+	ctx.nodeCount++;
+	ctx.maxDepth = max(ctx.maxDepth, depth);
+
+	// Go through the given objects and merge their individual bounding box
+	// dimensions together until we end up with our one bounding box that
+	// encompasses all the objects that are given
+	computeBounds(begin, end, ctx);
+	node->boundingBox = ctx.bounds;
+	BoundingBox centroidBounds = ctx.centroidBounds;
+
+	int count = end - begin;
+	int mid = -1;
+
+	// Past BVH_SPLIT_DEPTH everything left goes in one leaf, which in
+	// practice only a pathological scene will ever reach
+	if (count > 1 && depth < BVH_SPLIT_DEPTH) {
+		if (options.splitMethod == BVHBuildOptions::SPLIT_SAH) {
+			mid = partitionSAH(begin, end, node->boundingBox, centroidBounds, node->splitAxis, ctx);
+		} else if (count > options.maxLeafSize) {
+			mid = partitionMedian(begin, end, node->boundingBox, node->splitAxis);
+		}
+	}
+
+	// More than a leaf can count: halve them as they are, without sorting,
+	// until the pieces fit
+	if (mid < 0 && count > BVH_MAX_LEAF_OBJECTS) {
+		mid = begin + count / 2;
+	}
+
+	if (mid < 0) {
+		node->leafNode = true;
+		node->firstObject = begin;
+		node->objectCount = count;
+		ctx.leafCount++;
+	} else {
+		// Recursively create the left and right nodes for the two halves
+		node->leafNode = false;
+		buildChild(begin, mid, depth + 1, ctx, node->leftNode);
+		buildChild(mid, end, depth + 1, ctx, node->rightNode);
+	}
+
+	return node;
+}
+
+// Build the child now, or, making the top levels, leave it to a worker
+// once it is small enough
+void BVHBuilder::buildChild( int begin, int end, int depth, BuildContext& ctx, BVHNode*& slot )
+{
+	if (ctx.topLevel && end - begin <= subtreeSize) {
+		SubtreeTask task = { begin, end, depth, &slot };
+		tasks.push_back(task);
+	} else {
+		slot = buildRange(begin, end, depth, ctx);
+	}
+}
+
+// Orders subtree tasks biggest first
+struct LargerTask
+{
+	template <typename Task>
+	bool operator()( const Task& left, const Task& right ) const
+	{
+		return left.end - left.begin > right.end - right.begin;
+	}
+};
+
+// The tasks cover separate ranges of objects, so the threads partition
+// their own parts of the array without getting in each other's way
+void BVHBuilder::buildSubtrees()
+{
+	// The big ones first, so no thread starts one just as the rest finish
+	sort(tasks.begin(), tasks.end(), LargerTask());
+
+	nextTask = 0;
+	runThreads(&BVHBuilder::subtreeWorker);
+	tasks.clear();
+}
+
+void BVHBuilder::subtreeWorker( int thread )
+{
+	BuildContext& ctx = *contexts[thread];
+
+	for (int k = nextTask++; k < (int)tasks.size(); k = nextTask++) {
+		const SubtreeTask& task = tasks[k];
+		*task.slot = buildRange(task.begin, task.end, task.depth, ctx);
+	}
+}
+
+void BVHBuilder::runThreads( void (BVHBuilder::*work)( int ) )
+{
+	vector<thread> workers;
+	for (int t = 1; t < threadCount; t++) {
+		workers.push_back(thread(work, this, t));
+	}
+
+	(this->*work)(0);
+
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+}
+
+// Whether all the threads should go over a node's objects together:
+// only at the top of a parallel build, and only for big nodes
+bool BVHBuilder::parallelNode( int count, const BuildContext& ctx ) const
+{
+	return ctx.topLevel && count >= PARALLEL_BIN_MIN;
+}
+
+// The part of the slice of objects being shared out that is thread's
+void BVHBuilder::sliceRange( int thread, int& begin, int& end ) const
+{
+	int64_t size = sliceEnd - sliceBegin;
+	begin = sliceBegin + (int)(size * thread / threadCount);
+	end = sliceBegin + (int)(size * (thread + 1) / threadCount);
+}
+
+// The boxes around the objects and their centroids go in ctx.bounds and
+// ctx.centroidBounds. Merging boxes is exact, so sharing the work out
+// doesn't change them
+void BVHBuilder::computeBounds( int begin, int end, BuildContext& ctx )
+{
+	if (parallelNode(end - begin, ctx)) {
+		sliceBegin = begin;
+		sliceEnd = end;
+		runThreads(&BVHBuilder::boundsSlice);
+
+		for (int t = 1; t < threadCount; t++) {
+			ctx.bounds.merge(contexts[t]->bounds);
+			ctx.centroidBounds.merge(contexts[t]->centroidBounds);
+		}
+		return;
+	}
+
+	ctx.bounds = BoundingBox();
+	ctx.centroidBounds = BoundingBox();
+	for (int i = begin; i < end; i++) {
+		ctx.bounds.merge(objects[i].bounds);
+		ctx.centroidBounds.merge(objects[i].centroid);
+	}
+}
+
+void BVHBuilder::boundsSlice( int thread )
+{
+	BuildContext& ctx = *contexts[thread];
+	int begin, end;
+	sliceRange(thread, begin, end);
+
+	ctx.bounds = BoundingBox();
+	ctx.centroidBounds = BoundingBox();
+	for (int i = begin; i < end; i++) {
+		ctx.bounds.merge(objects[i].bounds);
+		ctx.centroidBounds.merge(objects[i].centroid);
+	}
+}
+
+// Counts the objects into ctx's bins along all three axes, and grows
+// each bin's box around them. Axes the centroids have no extent along
+// are left empty
+void BVHBuilder::binCentroids( int begin, int end, const BoundingBox& centroidBounds, BuildContext& ctx )
+{
+	int binCount = max(options.binCount, 2);
+
+	if (parallelNode(end - begin, ctx)) {
+		sliceBegin = begin;
+		sliceEnd = end;
+		sliceCentroidBounds = centroidBounds;
+		runThreads(&BVHBuilder::binSlice);
+
+		for (int t = 1; t < threadCount; t++) {
+			for (int b = 0; b < 3 * binCount; b++) {
+				ctx.binObjects[b] += contexts[t]->binObjects[b];
+				ctx.binBounds[b].merge(contexts[t]->binBounds[b]);
+			}
+		}
+		return;
+	}
+
+	for (int b = 0; b < 3 * binCount; b++) {
+		ctx.binObjects[b] = 0;
+		ctx.binBounds[b] = BoundingBox();
+	}
+
+	double axisMin[3], axisScale[3];
+	bool binned[3];
+	for (int axis = 0; axis < 3; axis++) {
+		double extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		binned[axis] = extent > 0.0;
+		axisMin[axis] = centroidBounds.min[axis];
+		axisScale[axis] = binned[axis] ? binCount / extent : 0.0;
+	}
+
+	for (int i = begin; i < end; i++) {
+		for (int axis = 0; axis < 3; axis++) {
+			if (binned[axis]) {
+				int bin = axis * binCount + min((int)((objects[i].centroid[axis] - axisMin[axis]) * axisScale[axis]), binCount - 1);
+				ctx.binObjects[bin]++;
+				ctx.binBounds[bin].merge(objects[i].bounds);
+			}
+		}
+	}
+}
+
+void BVHBuilder::binSlice( int thread )
+{
+	int begin, end;
+	sliceRange(thread, begin, end);
+
+	// Its own slice only: the thread's context isn't marked as the top
+	// level, so this doesn't share it out again
+	BuildContext& ctx = *contexts[thread];
+	bool topLevel = ctx.topLevel;
+	ctx.topLevel = false;
+	binCentroids(begin, end, sliceCentroidBounds, ctx);
+	ctx.topLevel = topLevel;
+}
+
+// Returns where the range was split, or -1 if it should be a leaf
+int BVHBuilder::partitionSAH( int begin, int end, const BoundingBox& nodeBounds, const BoundingBox& centroidBounds, int& axis, BuildContext& ctx )
+{
+	int count = end - begin;
+	int binCount = max(options.binCount, 2);
+	double nodeArea = nodeBounds.area();
+
+	binCentroids(begin, end, centroidBounds, ctx);
+
+	double bestCost = 1.0e308;
+	int bestAxis = -1;
+	int bestBin = -1;
+
+	for (axis = 0; axis < 3; axis++) {
+		// All the centroids share a plane; no bin boundary separates them
+		if (centroidBounds.max[axis] - centroidBounds.min[axis] <= 0.0) {
+			continue;
+		}
+
+		const int* binObjects = &ctx.binObjects[axis * binCount];
+		const BoundingBox* binBounds = &ctx.binBounds[axis * binCount];
+		double* rightCost = &ctx.rightCost[0];
+
+		// Sweep from the right, remembering the cost of everything right of
+		// each boundary, then from the left to price each boundary in full
+		BoundingBox box;
+		int n = 0;
+		for (int b = binCount - 1; b > 0; b--) {
+			box.merge(binBounds[b]);
+			n += binObjects[b];
+			rightCost[b] = n > 0 ? n * box.area() : 0.0;
+		}
+
+		box = BoundingBox();
+		n = 0;
+		for (int b = 0; b < binCount - 1; b++) {
+			box.merge(binBounds[b]);
+			n += binObjects[b];
+
+			if (n == 0 || n == count) {
+				continue;
+			}
+
+			double cost = TRAVERSAL_COST + (n * box.area() + rightCost[b + 1]) / nodeArea;
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	// Testing every object in a leaf costs one unit each
+	if (count <= options.maxLeafSize && count <= bestCost) {
+		return -1;
+	}
+
+	if (bestAxis < 0) {
+		// No usable boundary (the centroids all coincide); fall back to
+		// halving the list so the leaves still respect maxLeafSize
+		return count > options.maxLeafSize ? partitionMedian(begin, end, nodeBounds, axis) : -1;
+	}
+
+	axis = bestAxis;
+
+	CentroidBelowBin below;
+	below.axis = bestAxis;
+	below.binCount = binCount;
+	below.splitBin = bestBin;
+	below.axisMin = centroidBounds.min[bestAxis];
+	below.axisScale = binCount / (centroidBounds.max[bestAxis] - centroidBounds.min[bestAxis]);
+
+	return partition(objects.begin() + begin, objects.begin() + end, below) - objects.begin();
+}
+
+int BVHBuilder::partitionMedian( int begin, int end, const BoundingBox& nodeBounds, int& axis )
+{
+	// Split along the longest axis for this bounding box, with the half of the
+	// objects whose centroids come first on that axis on the left
+	int medianIndex = begin + (end - begin) / 2;
+
+	axis = longestAxis(nodeBounds);
+	nth_element(objects.begin() + begin, objects.begin() + medianIndex, objects.begin() + end,
+		CentroidLess(axis));
+
+	return medianIndex;
+}
+
+// The SAH cost of the whole tree: a ray that hits the root visits each
+// node with probability (node area / root area)
+void BVHBuilder::computeCost( const BVHNode* node, double rootArea )
+{
+	double probability = rootArea > 0.0 ? node->boundingBox.area() / rootArea : 1.0;
+
+	if (node->leafNode) {
+		stats->sahCost += probability * node->objectCount;
+	} else {
+		stats->sahCost += probability * TRAVERSAL_COST;
+		computeCost(node->leftNode, rootArea);
+		computeCost(node->rightNode, rootArea);
+	}
+}
+
+// Nearest float at or below / at or above the double
+static float roundDown( double d )
+{
+	float f = (float)d;
+	return f > d ? nextafterf(f, -HUGE_VALF) : f;
+}
+
+static float roundUp( double d )
+{
+	float f = (float)d;
+	return f < d ? nextafterf(f, HUGE_VALF) : f;
+}
+
+void BVHBuilder::flatten( const BVHNode* root, std::vector<LinearBVHNode>& nodes )
+{
+	nodes.clear();
+	if (root) {
+		flattenNode(root, nodes);
+	}
+}
+
+// Appends node and everything below it, returning where node went
+int BVHBuilder::flattenNode( const BVHNode* node, std::vector<LinearBVHNode>& nodes )
+{
+	int index = nodes.size();
+	nodes.push_back(LinearBVHNode());
+
+	// Pad by RAY_EPSILON like BoundingBox::intersects does. A ray that just
+	// grazes an object's face or edge can otherwise land a rounding error
+	// outside the box the object reports and get culled, even though the
+	// object's own test (in its local space) counts it as a hit.
+	LinearBVHNode flat;
+	for (int k = 0; k < 3; k++) {
+		flat.boundsMin[k] = roundDown(node->boundingBox.min[k] - RAY_EPSILON);
+		flat.boundsMax[k] = roundUp(node->boundingBox.max[k] + RAY_EPSILON);
+	}
+	flat.axis = node->splitAxis;
+	flat.pad = 0;
+
+	if (node->leafNode) {
+		assert(node->objectCount <= BVH_MAX_LEAF_OBJECTS);
+		flat.firstObject = node->firstObject;
+		flat.objectCount = node->objectCount;
+	} else {
+		// The first child always lands at index + 1
+		flattenNode(node->leftNode, nodes);
+		flat.secondChild = flattenNode(node->rightNode, nodes);
+		flat.objectCount = 0;
+	}
+
+	nodes[index] = flat;
+	return index;
+}
+
+void BVHBuilder::collapse( const BVHNode* root, std::vector<QBVHNode>& nodes, BVHBuildStats& stats )
+{
+	nodes.clear();
+	stats.nodeCount = 0;
+	stats.leafCount = 0;
+	stats.maxDepth = 0;
+
+	if (root == 0) {
+		return;
+	}
+
+	// A tree that is a single leaf still needs a node to hold it
+	if (root->leafNode) {
+		BVHNode top;
+		top.leafNode = false;
+		top.leftNode = const_cast<BVHNode*>(root);
+		collapseNode(&top, nodes, 1, stats);
+		top.leftNode = 0;
+		return;
+	}
+
+	collapseNode(root, nodes, 1, stats);
+}
+
+// Pulls node's children and grandchildren up into (at most) four slots,
+// always opening the biggest inner node next since that is the one rays
+// are likeliest to hit, then packs them the same way flattenNode() does
+int BVHBuilder::collapseNode( const BVHNode* node, std::vector<QBVHNode>& nodes, int depth, BVHBuildStats& stats )
+{
+	const BVHNode* children[4];
+	int childCount = 0;
+
+	children[childCount++] = node->leftNode;
+	if (node->rightNode) {
+		children[childCount++] = node->rightNode;
+	}
+
+	while (childCount < 4) {
+		int open = -1;
+		for (int c = 0; c < childCount; c++) {
+			if (!children[c]->leafNode &&
+				(open < 0 || children[c]->boundingBox.area() > children[open]->boundingBox.area())) {
+				open = c;
+			}
+		}
+		if (open < 0) {
+			break;
+		}
+
+		const BVHNode* opened = children[open];
+		children[open] = opened->leftNode;
+		children[childCount++] = opened->rightNode;
+	}
+
+	int index = nodes.size();
+	nodes.push_back(QBVHNode());
+	stats.nodeCount++;
+	stats.maxDepth = max(stats.maxDepth, depth);
+
+	QBVHNode wide;
+	wide.axis = node->splitAxis;
+	for (int p = 0; p < 7; p++) {
+		wide.pad[p] = 0;
+	}
+
+	for (int c = 0; c < 4; c++) {
+		if (c >= childCount) {
+			for (int k = 0; k < 3; k++) {
+				wide.boundsMin[k][c] = HUGE_VALF;
+				wide.boundsMax[k][c] = -HUGE_VALF;
+			}
+			wide.child[c] = -1;
+			wide.count[c] = 0;
+			continue;
+		}
+
+		// Padded and rounded outwards as in flattenNode()
+		const BVHNode* child = children[c];
+		for (int k = 0; k < 3; k++) {
+			wide.boundsMin[k][c] = roundDown(child->boundingBox.min[k] - RAY_EPSILON);
+			wide.boundsMax[k][c] = roundUp(child->boundingBox.max[k] + RAY_EPSILON);
+		}
+
+		if (child->leafNode) {
+			assert(child->objectCount <= BVH_MAX_LEAF_OBJECTS);
+			wide.child[c] = child->firstObject;
+			wide.count[c] = child->objectCount;
+			stats.leafCount++;
+		} else {
+			wide.child[c] = collapseNode(child, nodes, depth + 1, stats);
+			wide.count[c] = 0;
+		}
+	}
+
+	nodes[index] = wide;
+	return index;
+}
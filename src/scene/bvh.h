@@ -0,0 +1,804 @@
+//
+// bvh.h
+//
+// Bounding volume hierarchy construction and traversal.
+//
+
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <stdint.h>
+#include <cmath>
+#include <limits>
+
+#include "scene.h"
+#include "arena.h"
+#include "bvhcache.h"
+#include "flatarray.h"
+
+struct QBVHNode;
+
+// One node of the tree. Interior nodes have two children; leaves instead
+// hold a run of objectCount objects starting at firstObject in the
+// tree's object list. Every node's box encloses everything below it.
+// The nodes live in the builder's arenas and go away along with it.
+struct BVHNode
+{
+	BVHNode()
+		: leftNode( 0 ), rightNode( 0 ), leafNode( true ), splitAxis( 0 ), firstObject( 0 ), objectCount( 0 ) {}
+
+	BoundingBox boundingBox;
+	BVHNode *leftNode;
+	BVHNode *rightNode;
+	bool leafNode;
+	int splitAxis;
+	int firstObject;
+	int objectCount;
+};
+
+// The BVHNode tree is only used while building. Afterwards it is packed
+// depth first into one array of these, two to a cache line: an interior
+// node's first child sits right after it and its second child is at
+// secondChild. The float bounds are padded and rounded outwards so they
+// still enclose the double precision boxes they came from.
+struct LinearBVHNode
+{
+	float boundsMin[3];
+	float boundsMax[3];
+	union
+	{
+		int32_t firstObject;	// leaf
+		int32_t secondChild;	// interior node
+	};
+	uint16_t objectCount;		// 0 for an interior node
+	uint8_t axis;				// the axis the node was split on
+	uint8_t pad;
+};
+
+static_assert( sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes" );
+
+// How much work the BVH traversals did, to compare builders and traversal
+// orders by something steadier than render time. Each thread counts into
+// its own copy, fetched once per ray with local(); total() sums them up
+// and should only be read while no render is running.
+struct BVHTraversalStats
+{
+	BVHTraversalStats()
+		: rays( 0 ), nodesVisited( 0 ), objectsTested( 0 ),
+		  occlusionRays( 0 ), occlusionNodesVisited( 0 ), occlusionObjectsTested( 0 ),
+		  packets( 0 ), packetRays( 0 ), packetNodesVisited( 0 ), packetObjectsTested( 0 ) {}
+
+	// closest hit queries (intersect), their ray-box and ray-object tests
+	uint64_t rays;
+	uint64_t nodesVisited;
+	uint64_t objectsTested;
+
+	// the same for any hit queries (occluded)
+	uint64_t occlusionRays;
+	uint64_t occlusionNodesVisited;
+	uint64_t occlusionObjectsTested;
+
+	// packets of either kind: a node or object counts once per packet,
+	// however many of its rays it was tested against
+	uint64_t packets;
+	uint64_t packetRays;
+	uint64_t packetNodesVisited;
+	uint64_t packetObjectsTested;
+
+	void add( const BVHTraversalStats& other );
+
+	static BVHTraversalStats& local();
+	static BVHTraversalStats total();
+	static void reset();
+};
+
+// A leaf counts its objects in 16 bits (see LinearBVHNode and QBVHNode)
+const int BVH_MAX_LEAF_OBJECTS = 65535;
+
+// The builder stops looking for splits at this depth. Whatever is left
+// there goes in one leaf, unless that's more than a leaf can count; then
+// it's halved by count until the pieces fit, which for an int's worth of
+// objects takes another 16 levels at most
+const int BVH_SPLIT_DEPTH = 64;
+
+// The BVH intersect() only keeps a fixed stack of this many nodes, so the
+// builder never makes a tree deeper than this
+const int BVH_MAX_DEPTH = BVH_SPLIT_DEPTH + 16;
+
+// A ray prepared for testing against LinearBVHNodes: the reciprocal of
+// the direction is worked out once rather than at every box
+struct BVHRay
+{
+	BVHRay() {}
+
+	BVHRay( const ray& r )
+	{
+		set(r.getPosition(), r.getDirection());
+	}
+
+	void set( const Vec3d& p, const Vec3d& d )
+	{
+		for (int k = 0; k < 3; k++) {
+			origin[k] = (Real)p[k];
+			invDir[k] = (Real)1.0 / (Real)d[k];
+			dirIsNeg[k] = invDir[k] < 0.0;
+		}
+	}
+
+	// Kay/Kajiya slab test like BoundingBox::intersect, but a box that
+	// starts beyond tLimit (the closest hit found so far) counts as a miss.
+	// A zero direction component makes an infinite reciprocal, and the
+	// NaN from a ray lying in a slab's plane fails every comparison, so it
+	// is treated as inside that slab.
+	bool hits( const LinearBVHNode& node, double tLimit, Real& tNear ) const
+	{
+		return hitsBox(node.boundsMin, node.boundsMax, tLimit, tNear);
+	}
+
+	bool hitsBox( const float boundsMin[3], const float boundsMax[3], double tLimit, Real& tNear ) const
+	{
+		tNear = -std::numeric_limits<Real>::max();
+		Real tFar = std::numeric_limits<Real>::max();
+
+		for (int k = 0; k < 3; k++) {
+			Real t1 = (boundsMin[k] - origin[k]) * invDir[k];
+			Real t2 = (boundsMax[k] - origin[k]) * invDir[k];
+
+			if (dirIsNeg[k]) {
+				Real ttemp = t1;
+				t1 = t2;
+				t2 = ttemp;
+			}
+
+			if (t1 > tNear)
+				tNear = t1;
+			if (t2 < tFar)
+				tFar = t2;
+		}
+
+		return tNear <= tFar && tFar >= RAY_EPSILON && tNear <= tLimit;
+	}
+
+	Real origin[3];
+	Real invDir[3];
+	bool dirIsNeg[3];
+};
+
+// Enough for a 4x4 block of camera rays
+const int RAY_PACKET_SIZE = 16;
+
+// Which rays of a packet a query is about: bit k is ray k
+typedef uint32_t RayMask;
+
+inline int popCount( RayMask mask )
+{
+	int count = 0;
+	for (; mask; mask &= mask - 1) {
+		count++;
+	}
+	return count;
+}
+
+// Up to RAY_PACKET_SIZE rays of one type (the camera rays for a block of
+// pixels, or the shadow rays from their hits to one light). Walking the
+// BVH once for all of them fetches each node once instead of once per
+// ray. Queries take a RayMask of the rays they are about, so rays that
+// missed or are already done drop out.
+//
+// prepare() also bounds the packet for interval arithmetic culling: if
+// every ray's direction has the same sign on each axis, a box can be
+// tested against the ranges of origins and reciprocal directions in one
+// go, and when even the nearest possible entry is past the farthest
+// possible exit no ray in the packet can hit it. Packets whose rays
+// point every which way (after a bounce, say) skip that test and just
+// test their rays one at a time.
+struct RayPacket
+{
+	RayPacket( ray::RayType type = ray::VISIBILITY )
+		: size( 0 ), type( type ), coherent( false ) {}
+
+	void set( int k, const Vec3d& p, const Vec3d& d )
+	{
+		position[k] = p;
+		direction[k] = d;
+		bvhRays[k].set(p, d);
+		if (k >= size) {
+			size = k + 1;
+		}
+	}
+
+	ray getRay( int k ) const { return ray(position[k], direction[k], type); }
+
+	RayMask allRays() const { return size >= 32 ? ~0u : (1u << size) - 1; }
+
+	// Works out the bounds for the culling test over the rays in mask
+	void prepare( RayMask mask )
+	{
+		coherent = mask != 0;
+		bool first = true;
+
+		for (int k = 0; k < size && coherent; k++) {
+			if (!(mask & (1u << k))) {
+				continue;
+			}
+
+			const BVHRay& r = bvhRays[k];
+			for (int a = 0; a < 3; a++) {
+				if (first) {
+					dirIsNeg[a] = r.dirIsNeg[a];
+					originMin[a] = originMax[a] = r.origin[a];
+					invDirMin[a] = invDirMax[a] = r.invDir[a];
+				} else {
+					originMin[a] = std::min(originMin[a], r.origin[a]);
+					originMax[a] = std::max(originMax[a], r.origin[a]);
+					invDirMin[a] = std::min(invDirMin[a], r.invDir[a]);
+					invDirMax[a] = std::max(invDirMax[a], r.invDir[a]);
+				}
+
+				// Mixed signs, or an axis some ray runs parallel to
+				if (r.dirIsNeg[a] != dirIsNeg[a] || std::isinf(r.invDir[a])) {
+					coherent = false;
+				}
+			}
+			first = false;
+		}
+	}
+
+	// Does any ray in mask hit the box before its tLimit[k]? This is all
+	// an inner node needs to know, and in a coherent packet the first ray
+	// tested usually answers it
+	bool anyHits( const float boundsMin[3], const float boundsMax[3], RayMask mask, const double* tLimit ) const
+	{
+		if (coherent && missesFrustum(boundsMin, boundsMax, mask, tLimit)) {
+			return false;
+		}
+
+		Real tNear;
+		for (int k = 0; k < size; k++) {
+			if ((mask & (1u << k)) && bvhRays[k].hitsBox(boundsMin, boundsMax, tLimit[k], tNear)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Exactly which rays in mask hit the box before their tLimit[k], for
+	// a leaf, so its objects are only tested against those
+	RayMask hitMask( const float boundsMin[3], const float boundsMax[3], RayMask mask, const double* tLimit ) const
+	{
+		if (coherent && missesFrustum(boundsMin, boundsMax, mask, tLimit)) {
+			return 0;
+		}
+
+		RayMask hit = 0;
+		Real tNear;
+		for (int k = 0; k < size; k++) {
+			if ((mask & (1u << k)) && bvhRays[k].hitsBox(boundsMin, boundsMax, tLimit[k], tNear)) {
+				hit |= 1u << k;
+			}
+		}
+		return hit;
+	}
+
+	// Interval arithmetic version of BVHRay::hits() for the whole packet
+	bool missesFrustum( const float boundsMin[3], const float boundsMax[3], RayMask mask, const double* tLimit ) const
+	{
+		double limit = -1.0e308;
+		for (int k = 0; k < size; k++) {
+			if (mask & (1u << k)) {
+				limit = std::max(limit, tLimit[k]);
+			}
+		}
+
+		Real tNear = -std::numeric_limits<Real>::max();
+		Real tFar = std::numeric_limits<Real>::max();
+
+		for (int a = 0; a < 3; a++) {
+			Real nearPlane = dirIsNeg[a] ? boundsMax[a] : boundsMin[a];
+			Real farPlane = dirIsNeg[a] ? boundsMin[a] : boundsMax[a];
+
+			// Lowest entry and highest exit over every origin and direction
+			// in the packet's ranges
+			tNear = std::max(tNear, lowest(nearPlane - originMax[a], nearPlane - originMin[a], a));
+			tFar = std::min(tFar, highest(farPlane - originMax[a], farPlane - originMin[a], a));
+		}
+
+		return tNear > tFar || tFar < RAY_EPSILON || tNear > limit;
+	}
+
+	int size;
+	ray::RayType type;
+	Vec3d position[RAY_PACKET_SIZE];
+	Vec3d direction[RAY_PACKET_SIZE];
+	BVHRay bvhRays[RAY_PACKET_SIZE];
+
+	// the culling bounds, only meaningful when coherent
+	bool coherent;
+	bool dirIsNeg[3];
+	Real originMin[3], originMax[3];
+	Real invDirMin[3], invDirMax[3];
+
+private:
+	// The ends of [lo, hi] * [invDirMin, invDirMax] on axis a
+	Real lowest( Real lo, Real hi, int a ) const
+	{
+		return std::min(std::min(lo * invDirMin[a], lo * invDirMax[a]), std::min(hi * invDirMin[a], hi * invDirMax[a]));
+	}
+
+	Real highest( Real lo, Real hi, int a ) const
+	{
+		return std::max(std::max(lo * invDirMin[a], lo * invDirMax[a]), std::max(hi * invDirMin[a], hi * invDirMax[a]));
+	}
+};
+
+// Builds the node hierarchy from nothing but the bounding box of every
+// object, so the same builder serves the scene's objects and a
+// trimesh's faces.
+//
+// SPLIT_SAH bins the object centroids into binCount buckets along each
+// axis and picks the bucket boundary with the lowest surface area
+// heuristic cost, making a leaf instead when that is cheaper (and it
+// fits in maxLeafSize). SPLIT_MEDIAN is the original builder: sort on
+// the longest axis and cut the list in half.
+//
+// Both work in place on one array of object references, so no level of
+// the build allocates anything but its node.
+//
+// With more than one build thread, a big enough tree is built in two
+// phases. The calling thread makes the top few levels, handing the
+// centroid binning of the largest nodes out to all the threads, until
+// the ranges left are small enough to be subtrees of their own. Those
+// are then built by all the threads at once, each with its own nodes
+// and bins. Every split is decided just as the serial build decides it,
+// so the tree comes out the same however many threads build it.
+class BVHBuilder
+{
+public:
+	BVHBuilder( const BVHBuildOptions& options )
+		: options( options ), stats( 0 )
+	{
+		// A LinearBVHNode can only count this many objects
+		this->options.maxLeafSize = std::min(std::max(options.maxLeafSize, 1), BVH_MAX_LEAF_OBJECTS);
+	}
+
+	~BVHBuilder();
+
+	// On return order[k] is the index (into bounds) of the object in slot
+	// k of the leaves' object ranges, and stats describes the tree. The
+	// tree belongs to the builder, and lasts until it builds another or
+	// is destroyed
+	BVHNode* build( const std::vector<BoundingBox>& bounds, std::vector<int>& order, BVHBuildStats& stats );
+
+	// Packs the tree into nodes, depth first
+	static void flatten( const BVHNode* root, std::vector<LinearBVHNode>& nodes );
+
+	// Packs the tree into four wide nodes instead (see qbvh.h), updating
+	// the node count and depth in stats to the collapsed tree's
+	static void collapse( const BVHNode* root, std::vector<QBVHNode>& nodes, BVHBuildStats& stats );
+
+private:
+	struct BuildObject
+	{
+		BoundingBox bounds;
+		Vec3d centroid;
+		int index;
+	};
+
+	// What one build thread works with
+	struct BuildContext
+	{
+		BuildContext()
+			: nodes( Arena::BVH_NODES ), topLevel( false ) {}
+
+		Arena nodes;
+
+		// partitionSAH()'s bins, all three axes', kept here so each node
+		// doesn't allocate its own
+		std::vector<int> binObjects;
+		std::vector<BoundingBox> binBounds;
+		std::vector<double> rightCost;
+
+		// The partial bounds of the slice of a node this thread went over
+		BoundingBox bounds;
+		BoundingBox centroidBounds;
+
+		int nodeCount, leafCount, maxDepth;
+
+		// Whether this is the calling thread making the top levels, which
+		// leaves the smaller ranges for subtree tasks
+		bool topLevel;
+	};
+
+	// A range left for a worker to build, and where to put its root
+	struct SubtreeTask
+	{
+		int begin, end, depth;
+		BVHNode** slot;
+	};
+
+	BVHNode* buildRange( int begin, int end, int depth, BuildContext& ctx );
+	void buildChild( int begin, int end, int depth, BuildContext& ctx, BVHNode*& slot );
+	void buildSubtrees();
+	void subtreeWorker( int thread );
+	void computeBounds( int begin, int end, BuildContext& ctx );
+	void boundsSlice( int thread );
+	void binCentroids( int begin, int end, const BoundingBox& centroidBounds, BuildContext& ctx );
+	void binSlice( int thread );
+	int partitionSAH( int begin, int end, const BoundingBox& nodeBounds, const BoundingBox& centroidBounds, int& axis, BuildContext& ctx );
+	int partitionMedian( int begin, int end, const BoundingBox& nodeBounds, int& axis );
+	void computeCost( const BVHNode* node, double rootArea );
+	static int flattenNode( const BVHNode* node, std::vector<LinearBVHNode>& nodes );
+	static int collapseNode( const BVHNode* node, std::vector<QBVHNode>& nodes, int depth, BVHBuildStats& stats );
+
+	// Run work(thread) on each of the build threads, the calling thread
+	// being thread 0, and wait for them all
+	void runThreads( void (BVHBuilder::*work)( int ) );
+
+	bool parallelNode( int count, const BuildContext& ctx ) const;
+	void sliceRange( int thread, int& begin, int& end ) const;
+
+	BVHBuildOptions options;
+	BVHBuildStats* stats;
+	std::vector<BuildObject> objects;
+
+	int threadCount;
+	int subtreeSize;			// the most objects a range can have to be a subtree task
+	std::vector<BuildContext*> contexts;	// one per build thread
+	std::vector<SubtreeTask> tasks;
+	std::atomic<int> nextTask;
+
+	// The node whose objects the threads are going over together
+	int sliceBegin, sliceEnd;
+	BoundingBox sliceCentroidBounds;
+};
+
+// The scene's objects, as the top level tree sees them: tested in world
+// space through Geometry::intersect(). Any other list of things a BVHTree
+// can hold looks the same, with the k'th thing's box and ray tests; see
+// TrimeshTriangles in trimesh.h.
+struct GeometryList
+{
+	GeometryList( const std::vector<Geometry*>& objects )
+		: objects( objects ) {}
+
+	int size() const { return objects.size(); }
+	BoundingBox bounds( int k ) const { return objects[k]->getBoundingBox(); }
+	bool intersect( int k, const ray& r, isect& i ) const { return objects[k]->intersect(r, i); }
+	bool occluded( int k, const ray& r, double tMax ) const { return objects[k]->occluded(r, tMax); }
+
+	uint32_t intersectPacket( int k, const RayPacket& packet, RayMask mask, isect* hits ) const
+	{
+		return objects[k]->intersectPacket(packet, mask, hits);
+	}
+
+	uint32_t occludedPacket( int k, const RayPacket& packet, RayMask mask, const double* tMax ) const
+	{
+		return objects[k]->occludedPacket(packet, mask, tMax);
+	}
+
+	std::vector<Geometry*> objects;
+};
+
+// Using this as a template class so that the BVH can work with
+// generic data types, and I found this very helpful to deal with both
+// the scene's Geometry and a trimesh's triangles. The tree doesn't
+// store the things themselves, only their indices into Primitives, in
+// the order its leaves refer to them; four bytes each is what lets a
+// mesh's triangles live in plain index arrays rather than as objects.
+template <typename Primitives>
+class BVHTree : public BVH {
+public:
+	BVHTree(const Primitives& givenPrimitives, const BVHBuildOptions& options = BVHBuildOptions())
+		: primitives(givenPrimitives), file(0) {
+		std::vector<BoundingBox> bounds(primitives.size());
+		std::vector<int> order;
+
+		for (size_t i = 0; i < bounds.size(); i++) {
+			bounds[i] = primitives.bounds(i);
+		}
+
+		BVHBuilder builder(options);
+		BVHNode* root = builder.build(bounds, order, stats);
+
+		std::vector<LinearBVHNode> flattened;
+		BVHBuilder::flatten(root, flattened);
+		nodes.adopt(flattened);
+
+		// Lay the indices out in the order the leaves refer to them
+		std::vector<uint32_t> leafOrder(order.begin(), order.end());
+		items.adopt(leafOrder);
+
+		stats.memoryBytes = nodes.size() * sizeof(LinearBVHNode) + items.size() * sizeof(uint32_t);
+	}
+
+	// A tree out of the BVH cache, taking over its file
+	BVHTree(const Primitives& givenPrimitives, CachedBVH& cached)
+		: primitives(givenPrimitives), file(cached.file) {
+		nodes.view((const LinearBVHNode*)cached.nodes, cached.nodeCount);
+		items.view(cached.items, cached.itemCount);
+		stats = cached.stats;
+		cached.file = 0;
+	}
+
+	~BVHTree() {
+		delete file;
+	}
+
+	int nodeWidth() const { return 2; }
+
+	const void* nodeData(size_t& count, size_t& nodeSize) const {
+		count = nodes.size();
+		nodeSize = sizeof(LinearBVHNode);
+		return nodes.data();
+	}
+
+	const uint32_t* objectOrder(size_t& count) const {
+		count = items.size();
+		return items.data();
+	}
+
+	bool intersect(const ray& r, isect& i) {
+		// Initialize the t value to an enormous double
+		i.t = 1e300;
+
+		// initialize the i object to null, we'll check for this when the loop ends
+		i.obj = nullptr;
+
+		if (nodes.empty()) {
+			return false;
+		}
+
+		BVHRay bvhRay(r);
+		Real tNear;
+
+		bool ordered = orderedTraversal;
+		int nodesVisited = 0;
+		int objectsTested = 0;
+
+		// Nodes still to visit. The tree is never deeper than BVH_MAX_DEPTH
+		// and each level pushes at most one node, so this can't overflow
+		int stack[BVH_MAX_DEPTH];
+		int stackSize = 0;
+		int current = 0;
+
+		while (true) {
+			const LinearBVHNode& node = nodes[current];
+			nodesVisited++;
+
+			// Skip any node that misses the ray, or that only starts beyond
+			// the closest intersection we already have
+			if (bvhRay.hits(node, ordered ? i.t : 1.0e308, tNear)) {
+				if (node.objectCount > 0) {
+					objectsTested += node.objectCount;
+
+					// Check for an intersection with each of this leaf node's objects
+					for (int k = 0; k < node.objectCount; k++) {
+						isect newIntersectionPoint;
+
+						if (primitives.intersect(items[node.firstObject + k], r, newIntersectionPoint)) {
+							// Update i if and only if the newIntersectionPoint's t value is less than
+							// what is currently stored as the closest in i.t
+							if (newIntersectionPoint.t < i.t) {
+								i = newIntersectionPoint;
+							}
+						}
+					}
+				} else {
+					// Go into the child on the side the ray comes from first and
+					// save the other for later; by the time we get back to it
+					// i.t has often shrunk enough to skip it entirely
+					if (ordered && bvhRay.dirIsNeg[node.axis]) {
+						stack[stackSize++] = current + 1;
+						current = node.secondChild;
+					} else {
+						stack[stackSize++] = node.secondChild;
+						current = current + 1;
+					}
+					continue;
+				}
+			}
+
+			if (stackSize == 0) {
+				break;
+			}
+			current = stack[--stackSize];
+		}
+
+		BVHTraversalStats& counters = BVHTraversalStats::local();
+		counters.rays++;
+		counters.nodesVisited += nodesVisited;
+		counters.objectsTested += objectsTested;
+
+		// If obj is not null, that means we hit a leaf node (i.e. an actual object),
+		// then we return true, otherwise we haven't and return false
+		return i.obj != nullptr;
+	}
+
+	bool occluded(const ray& r, double tMax) {
+		if (nodes.empty()) {
+			return false;
+		}
+
+		BVHRay bvhRay(r);
+		Real tNear;
+
+		bool hit = false;
+		int nodesVisited = 0;
+		int objectsTested = 0;
+
+		// Same walk as intersect(), but the first hit ends it. Going front
+		// to back doesn't pay here: a shadow ray starts on a surface, so the
+		// near side is mostly the object it left, and on data/a1scenes it
+		// visited more nodes than just taking the children in order
+		int stack[BVH_MAX_DEPTH];
+		int stackSize = 0;
+		int current = 0;
+
+		while (!hit) {
+			const LinearBVHNode& node = nodes[current];
+			nodesVisited++;
+
+			if (bvhRay.hits(node, tMax, tNear)) {
+				if (node.objectCount > 0) {
+					for (int k = 0; k < node.objectCount && !hit; k++) {
+						objectsTested++;
+						hit = primitives.occluded(items[node.firstObject + k], r, tMax);
+					}
+				} else {
+					stack[stackSize++] = node.secondChild;
+					current = current + 1;
+					continue;
+				}
+			}
+
+			if (stackSize == 0) {
+				break;
+			}
+			current = stack[--stackSize];
+		}
+
+		BVHTraversalStats& counters = BVHTraversalStats::local();
+		counters.occlusionRays++;
+		counters.occlusionNodesVisited += nodesVisited;
+		counters.occlusionObjectsTested += objectsTested;
+
+		return hit;
+	}
+
+	// The packet walk goes down every node any of the packet's rays hits
+	// (Wald's coherent ray tracing), and the objects in a leaf are then
+	// tested against just the rays that hit the leaf's box. With ordering
+	// on, the child on the side the packet comes from goes first, and a
+	// node is skipped once every ray has a closer hit than its box.
+	uint32_t intersectPacket(const RayPacket& packet, RayMask mask, isect* hits) {
+		if (nodes.empty() || mask == 0) {
+			return 0;
+		}
+
+		bool ordered = orderedTraversal;
+		int nodesVisited = 0;
+		int objectsTested = 0;
+		RayMask found = 0;
+
+		double tLimit[RAY_PACKET_SIZE];
+		for (int k = 0; k < packet.size; k++) {
+			tLimit[k] = ordered ? hits[k].t : 1.0e308;
+		}
+
+		// The side the first ray comes from stands in for the packet's
+		int first = 0;
+		while (!(mask & (1u << first))) {
+			first++;
+		}
+		const bool* dirIsNeg = packet.bvhRays[first].dirIsNeg;
+
+		int stack[BVH_MAX_DEPTH];
+		int stackSize = 0;
+		int current = 0;
+
+		while (true) {
+			const LinearBVHNode& node = nodes[current];
+			nodesVisited++;
+
+			if (node.objectCount > 0) {
+				RayMask active = packet.hitMask(node.boundsMin, node.boundsMax, mask, tLimit);
+
+				if (active != 0) {
+					objectsTested += node.objectCount;
+
+					for (int k = 0; k < node.objectCount; k++) {
+						RayMask hit = primitives.intersectPacket(items[node.firstObject + k], packet, active, hits);
+						found |= hit;
+
+						if (ordered) {
+							for (int r = 0; r < packet.size; r++) {
+								if (hit & (1u << r)) {
+									tLimit[r] = hits[r].t;
+								}
+							}
+						}
+					}
+				}
+			} else if (packet.anyHits(node.boundsMin, node.boundsMax, mask, tLimit)) {
+				if (ordered && dirIsNeg[node.axis]) {
+					stack[stackSize++] = current + 1;
+					current = node.secondChild;
+				} else {
+					stack[stackSize++] = node.secondChild;
+					current = current + 1;
+				}
+				continue;
+			}
+
+			if (stackSize == 0) {
+				break;
+			}
+			current = stack[--stackSize];
+		}
+
+		BVHTraversalStats& counters = BVHTraversalStats::local();
+		counters.packets++;
+		counters.packetRays += popCount(mask);
+		counters.packetNodesVisited += nodesVisited;
+		counters.packetObjectsTested += objectsTested;
+
+		return found;
+	}
+
+	// A ray drops out of the packet as soon as something blocks it
+	uint32_t occludedPacket(const RayPacket& packet, RayMask mask, const double* tMax) {
+		if (nodes.empty() || mask == 0) {
+			return 0;
+		}
+
+		int nodesVisited = 0;
+		int objectsTested = 0;
+		RayMask blocked = 0;
+
+		int stack[BVH_MAX_DEPTH];
+		int stackSize = 0;
+		int current = 0;
+
+		while (blocked != mask) {
+			const LinearBVHNode& node = nodes[current];
+			nodesVisited++;
+
+			if (node.objectCount > 0) {
+				RayMask active = packet.hitMask(node.boundsMin, node.boundsMax, mask & ~blocked, tMax);
+
+				for (int k = 0; k < node.objectCount && (active & ~blocked); k++) {
+					objectsTested++;
+					blocked |= primitives.occludedPacket(items[node.firstObject + k], packet, active & ~blocked, tMax);
+				}
+			} else if (packet.anyHits(node.boundsMin, node.boundsMax, mask & ~blocked, tMax)) {
+				stack[stackSize++] = node.secondChild;
+				current = current + 1;
+				continue;
+			}
+
+			if (stackSize == 0) {
+				break;
+			}
+			current = stack[--stackSize];
+		}
+
+		BVHTraversalStats& counters = BVHTraversalStats::local();
+		counters.packets++;
+		counters.packetRays += popCount(mask);
+		counters.packetNodesVisited += nodesVisited;
+		counters.packetObjectsTested += objectsTested;
+
+		return blocked;
+	}
+
+private:
+	Primitives primitives;
+	FlatArray<LinearBVHNode> nodes;
+	FlatArray<uint32_t> items;
+	MappedFile* file;	// the cache file the arrays are in, if they are
+};
+
+#endif // __BVH_H__
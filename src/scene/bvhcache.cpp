@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <string.h>
+#include <sstream>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#include <direct.h>
+#include <process.h>
+#endif
+
+#include "bvhcache.h"
+#include "bvh.h"
+#include "qbvh.h"
+
+using namespace std;
+
+// Bump this whenever the file layout or what a key covers changes
+static const uint32_t FORMAT_VERSION = 2;
+static const char MAGIC[8] = { 'R', 'T', 'B', 'V', 'H', 'C', 0, 0 };
+
+// Everything in the file that isn't nodes or object indices. 64 bytes,
+// so the nodes after it start on a cache line of the mapping
+struct BVHCacheHeader
+{
+	char magic[8];
+	uint64_t key;
+	uint32_t nodeWidth;
+	uint32_t nodeSize;			// sizeof the node struct, in case it changes
+	uint64_t nodeCount;
+	uint64_t itemCount;
+
+	// The statistics from when it was built
+	int32_t primitiveCount;
+	int32_t statsNodeCount;
+	int32_t leafCount;
+	int32_t maxDepth;
+	double sahCost;
+};
+
+static_assert( sizeof(BVHCacheHeader) == 64, "BVHCacheHeader should be 64 bytes" );
+
+BVHCache::BVHCache( const std::string& directory )
+	: directory( directory ), hits( 0 ), misses( 0 ), stores( 0 )
+{
+}
+
+// FNV-1a, a word at a time where it can
+uint64_t BVHCache::hash( const void* data, size_t bytes, uint64_t key )
+{
+	static const uint64_t PRIME = 1099511628211ULL;
+	const unsigned char* p = (const unsigned char*)data;
+
+	for (; bytes >= 8; bytes -= 8, p += 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		key = (key ^ word) * PRIME;
+	}
+	for (; bytes > 0; bytes--, p++) {
+		key = (key ^ *p) * PRIME;
+	}
+	return key;
+}
+
+uint64_t BVHCache::hashOptions( const BVHBuildOptions& options, uint64_t key )
+{
+	// The thread count is left out: it builds the same tree
+	int32_t values[] = {
+		(int32_t)FORMAT_VERSION,
+		(int32_t)options.splitMethod,
+		options.binCount,
+		options.maxLeafSize,
+		options.nodeWidth,
+		(int32_t)sizeof(LinearBVHNode),
+		(int32_t)sizeof(QBVHNode)
+	};
+	return hash(values, sizeof(values), key);
+}
+
+std::string BVHCache::fileName( uint64_t key ) const
+{
+	char name[32];
+	sprintf(name, "%016llx.bvh", (unsigned long long)key);
+	return directory + "/" + name;
+}
+
+// Every index in the nodes has to point inside the file's own arrays, and
+// every interior node's children have to come after it, so a damaged file
+// can't send a traversal off into the weeds. The tree can't be any deeper
+// than the builder makes them either (the root is at depth 1), or it would
+// overflow the traversals' fixed stacks. Children coming after their
+// parents means a node's depth is settled by the time the loop gets to it
+static bool validNodes( const LinearBVHNode* nodes, size_t nodeCount, size_t itemCount )
+{
+	vector<int> depth(nodeCount, 0);
+	depth[0] = 1;
+
+	for (size_t k = 0; k < nodeCount; k++) {
+		const LinearBVHNode& node = nodes[k];
+
+		if (depth[k] > BVH_MAX_DEPTH) {
+			return false;
+		}
+		if (node.objectCount > 0) {
+			if (node.firstObject < 0 || node.firstObject + (size_t)node.objectCount > itemCount) {
+				return false;
+			}
+		} else if (node.secondChild <= (int64_t)k || node.secondChild >= (int64_t)nodeCount) {
+			return false;
+		} else {
+			depth[k + 1] = max(depth[k + 1], depth[k] + 1);
+			depth[node.secondChild] = max(depth[node.secondChild], depth[k] + 1);
+		}
+	}
+	return true;
+}
+
+static bool validNodes( const QBVHNode* nodes, size_t nodeCount, size_t itemCount )
+{
+	vector<int> depth(nodeCount, 0);
+	depth[0] = 1;
+
+	for (size_t k = 0; k < nodeCount; k++) {
+		if (depth[k] > BVH_MAX_DEPTH) {
+			return false;
+		}
+		for (int c = 0; c < 4; c++) {
+			int32_t child = nodes[k].child[c];
+			int count = nodes[k].count[c];
+
+			if (child < 0) {
+				continue;
+			}
+			if (count > 0 ? child + (size_t)count > itemCount : child <= (int64_t)k || child >= (int64_t)nodeCount) {
+				return false;
+			}
+			if (count == 0) {
+				depth[child] = max(depth[child], depth[k] + 1);
+			}
+		}
+	}
+	return true;
+}
+
+bool BVHCache::load( uint64_t key, int nodeWidth, int primitiveCount, CachedBVH& cached )
+{
+	MappedFile* file = new MappedFile();
+
+	if (!file->open(fileName(key)) || file->size() < sizeof(BVHCacheHeader)) {
+		delete file;
+		misses++;
+		return false;
+	}
+
+	const BVHCacheHeader* header = (const BVHCacheHeader*)file->data();
+	size_t nodeSize = nodeWidth == 4 ? sizeof(QBVHNode) : sizeof(LinearBVHNode);
+
+	bool valid = memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+		header->key == key &&
+		header->nodeWidth == (uint32_t)nodeWidth &&
+		header->nodeSize == nodeSize &&
+		header->itemCount == (uint64_t)primitiveCount &&
+		header->nodeCount > 0 &&
+		header->nodeCount <= file->size() / nodeSize &&
+		file->size() == sizeof(BVHCacheHeader) + header->nodeCount * nodeSize + header->itemCount * sizeof(uint32_t);
+
+	const char* nodes = file->data() + sizeof(BVHCacheHeader);
+	const uint32_t* items = (const uint32_t*)(nodes + (valid ? header->nodeCount * nodeSize : 0));
+
+	if (valid) {
+		for (size_t i = 0; i < header->itemCount; i++) {
+			if (items[i] >= (uint32_t)primitiveCount) {
+				valid = false;
+				break;
+			}
+		}
+	}
+
+	if (valid) {
+		valid = nodeWidth == 4 ?
+			validNodes((const QBVHNode*)nodes, header->nodeCount, header->itemCount) :
+			validNodes((const LinearBVHNode*)nodes, header->nodeCount, header->itemCount);
+	}
+
+	if (!valid) {
+		delete file;
+		misses++;
+		return false;
+	}
+
+	cached.file = file;
+	cached.nodes = nodes;
+	cached.nodeCount = header->nodeCount;
+	cached.items = items;
+	cached.itemCount = header->itemCount;
+
+	cached.stats = BVHBuildStats();
+	cached.stats.primitiveCount = header->primitiveCount;
+	cached.stats.nodeCount = header->statsNodeCount;
+	cached.stats.leafCount = header->leafCount;
+	cached.stats.maxDepth = header->maxDepth;
+	cached.stats.sahCost = header->sahCost;
+	cached.stats.memoryBytes = header->nodeCount * nodeSize + header->itemCount * sizeof(uint32_t);
+
+	hits++;
+	return true;
+}
+
+void BVHCache::store( uint64_t key, const BVH& tree )
+{
+	size_t nodeCount, nodeSize, itemCount;
+	const void* nodes = tree.nodeData(nodeCount, nodeSize);
+	const uint32_t* items = tree.objectOrder(itemCount);
+
+	if (nodeCount == 0) {
+		return;
+	}
+
+	const BVHBuildStats& stats = tree.buildStats();
+
+	BVHCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.key = key;
+	header.nodeWidth = tree.nodeWidth();
+	header.nodeSize = nodeSize;
+	header.nodeCount = nodeCount;
+	header.itemCount = itemCount;
+	header.primitiveCount = stats.primitiveCount;
+	header.statsNodeCount = stats.nodeCount;
+	header.leafCount = stats.leafCount;
+	header.maxDepth = stats.maxDepth;
+	header.sahCost = stats.sahCost;
+
+#ifndef _WIN32
+	mkdir(directory.c_str(), 0777);
+	int pid = getpid();
+#else
+	_mkdir(directory.c_str());
+	int pid = _getpid();
+#endif
+
+	// Written under a name of its own and then renamed into place, so
+	// another run looking for it never maps half a file
+	std::string name = fileName(key);
+	std::ostringstream temporary;
+	temporary << name << "." << pid << ".tmp";
+
+	FILE* f = fopen(temporary.str().c_str(), "wb");
+	if (!f) {
+		return;
+	}
+
+	bool written = fwrite(&header, sizeof(header), 1, f) == 1 &&
+		fwrite(nodes, nodeSize, nodeCount, f) == nodeCount &&
+		fwrite(items, sizeof(uint32_t), itemCount, f) == itemCount;
+	written = fclose(f) == 0 && written;
+
+	if (!written || rename(temporary.str().c_str(), name.c_str()) != 0) {
+		remove(temporary.str().c_str());
+		return;
+	}
+
+	stores++;
+}
@@ -0,0 +1,73 @@
+//
+// bvhcache.h
+//
+// Mesh BVHs saved to disk, so the next run on the same geometry maps the
+// finished tree in instead of building it again.
+//
+
+#ifndef __BVHCACHE_H__
+#define __BVHCACHE_H__
+
+#include <stdint.h>
+#include <string>
+
+#include "scene.h"
+#include "../fileio/mappedfile.h"
+
+// A tree read back from a cache file. The nodes and the object order
+// point into the mapped file, which the tree made from them takes over.
+struct CachedBVH
+{
+	CachedBVH()
+		: file( 0 ), nodes( 0 ), nodeCount( 0 ), items( 0 ), itemCount( 0 ) {}
+
+	MappedFile* file;
+	const void* nodes;
+	size_t nodeCount;
+	const uint32_t* items;
+	size_t itemCount;
+	BVHBuildStats stats;
+};
+
+// One file per tree in a directory, named after the tree's key: a hash of
+// everything the tree depends on, the geometry and the build options and
+// the layout of the nodes. A file is the flattened nodes and the object
+// order exactly as they sit in memory, behind a 64 byte header, so
+// loading it is mapping it and checking that it holds together.
+class BVHCache
+{
+public:
+	BVHCache( const std::string& directory );
+
+	const std::string& getDirectory() const { return directory; }
+
+	// Keys. Hash the geometry in as many pieces as it comes in, then the
+	// options; anything that would build a different tree has to change
+	// the key
+	static uint64_t hash( const void* data, size_t bytes, uint64_t key = EMPTY_KEY );
+	static uint64_t hashOptions( const BVHBuildOptions& options, uint64_t key );
+	static const uint64_t EMPTY_KEY = 14695981039346656037ULL;
+
+	// The tree saved under key, if there is one that fits a tree of
+	// nodeWidth over primitiveCount objects
+	bool load( uint64_t key, int nodeWidth, int primitiveCount, CachedBVH& cached );
+
+	// Save a tree that was just built. Not finding a way to write the
+	// file only means the next run builds it again
+	void store( uint64_t key, const BVH& tree );
+
+	// Trees smaller than this build faster than their files load
+	static const int MIN_OBJECTS = 1024;
+
+	int loaded() const { return hits; }
+	int built() const { return misses; }
+	int saved() const { return stores; }
+
+private:
+	std::string fileName( uint64_t key ) const;
+
+	std::string directory;
+	int hits, misses, stores;
+};
+
+#endif // __BVHCACHE_H__
@@ -0,0 +1,99 @@
+//
+// flatarray.h
+//
+// A flat array that is either owned or a view of memory kept elsewhere.
+//
+
+#ifndef __FLATARRAY_H__
+#define __FLATARRAY_H__
+
+#include <vector>
+#include <assert.h>
+#include <stddef.h>
+
+// The arrays the BVH trees and the trimeshes are read from: their own, as
+// built or parsed, or ones in a file mapped into memory (a BVH cache file,
+// an .rmesh). Either way the readers only see a pointer and a count, and
+// nothing is copied out of a mapping element by element.
+//
+// Only an owned array can be changed (through writable(), push_back(),
+// resize() or reserve()). Changing a view would quietly throw the mapped
+// data away, so those refuse to, and leave the view as it is.
+template <typename T>
+class FlatArray
+{
+public:
+	FlatArray()
+		: items( 0 ), count( 0 ), viewing( false ) {}
+
+	// Take over what the builder made
+	void adopt( std::vector<T>& built )
+	{
+		owned.swap(built);
+		update();
+	}
+
+	// Read from memory someone else keeps
+	void view( const T* data, size_t n )
+	{
+		std::vector<T>().swap(owned);
+		items = data;
+		count = n;
+		viewing = true;
+	}
+
+	void push_back( const T& item )
+	{
+		assert(!viewing);
+		if (viewing) {
+			return;
+		}
+		owned.push_back(item);
+		update();
+	}
+
+	void resize( size_t n )
+	{
+		assert(!viewing);
+		if (viewing) {
+			return;
+		}
+		owned.resize(n);
+		update();
+	}
+
+	void reserve( size_t n )
+	{
+		assert(!viewing);
+		if (viewing) {
+			return;
+		}
+		owned.reserve(n);
+		update();
+	}
+
+	T* writable() { return owned.empty() ? 0 : &owned[0]; }
+
+	const T& operator[]( size_t k ) const { return items[k]; }
+	const T* data() const { return items; }
+	const T* begin() const { return items; }
+	const T* end() const { return items + count; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	bool isView() const { return viewing; }
+
+private:
+	void update()
+	{
+		viewing = false;
+		items = owned.empty() ? 0 : &owned[0];
+		count = owned.size();
+	}
+
+	const T* items;
+	size_t count;
+	bool viewing;
+	std::vector<T> owned;
+};
+
+#endif // __FLATARRAY_H__
@@ -12,20 +12,22 @@ double DirectionalLight::distanceAttenuation( const Vec3d& P ) const
 }
 
 
-Vec3d DirectionalLight::shadowAttenuation( const Vec3d& P ) const
+ray DirectionalLight::shadowRay( const Vec3d& P, double& tMax ) const
 {
-	// Create a ray of type shadow and cast it from the point towards this light
-	Vec3d vectorToTheLight = getDirection(P);
-	ray rayFromIntersectionPointToLight(P, vectorToTheLight, ray::SHADOW);
-	isect i;
+	// Create a ray of type shadow and cast it from the point towards this light.
+	// The light is infinitely far away, so any hit counts
+	tMax = 1.0e308;
+	return ray(P, getDirection(P), ray::SHADOW);
+}
 
-	// If there is an intersection, return a non-pure black color, otherwise return the default light color
-	if (scene->intersect(rayFromIntersectionPointToLight, i)) {
-		return Vec3d(0.2, 0.2, 0.2);
-	}
+Vec3d DirectionalLight::shadowAttenuation( const Vec3d& P ) const
+{
+	// If there is anything in the way at all, return a non-pure black color, otherwise
+	// return the default light color
+	double tMax;
+	ray rayFromIntersectionPointToLight = shadowRay(P, tMax);
 
-	// No intersection, return the default light color
-  return color;
+	return shadowColor(scene->occluded(rayFromIntersectionPointToLight, tMax));
 }
 
 Vec3d DirectionalLight::getColor( const Vec3d& P ) const
@@ -70,7 +72,7 @@ Vec3d PointLight::getDirection( const Vec3d& P ) const
 }
 
 
-Vec3d PointLight::shadowAttenuation(const Vec3d& P) const
+ray PointLight::shadowRay( const Vec3d& P, double& tMax ) const
 {
 	Vec3d originalIntersectionPoint = P; // Renaming to help clarify for the calculations
 
@@ -82,23 +84,23 @@ Vec3d PointLight::shadowAttenuation(const Vec3d& P) const
 	// The getDirection() function normalizes it for us
 	Vec3d vectorToTheLight = getDirection(originalIntersectionPoint);
 	ray rayFromIntersectionPointToLight(originalIntersectionPoint, vectorToTheLight, ray::SHADOW);
-	isect i;
-
-	if (scene->intersect(rayFromIntersectionPointToLight, i)) {
-		// It isn't enough to just check that an intersection occurs
-		// Since this light has a position, we need to check that the
-		// intersection occurs before "hitting" the light
-		Vec3d someIntersectionPoint = rayFromIntersectionPointToLight.at(i.t);
-		double distanceBetweenIntersectionPoints = (originalIntersectionPoint - someIntersectionPoint).length();
-		double distanceBetweenOriginalIntersectionPointAndLightPosition = (position - originalIntersectionPoint).length();
-
-		// If there is an intersection and it's before reaching the light, return a non-pure black color
-		// Otherwise we drop out of the if-statements and return the default light color
-		if (distanceBetweenIntersectionPoints < distanceBetweenOriginalIntersectionPointAndLightPosition) {
-			return Vec3d(0.2, 0.2, 0.2);
-		}
-	}
 
-	// No intersection, return the default light color
-  return color;
+	// It isn't enough to just check that an intersection occurs
+	// Since this light has a position, we need to check that the
+	// intersection occurs before "hitting" the light. The ray direction
+	// is normalized, so t along it is the distance from the point
+	double distanceBetweenOriginalIntersectionPointAndLightPosition = (position - originalIntersectionPoint).length();
+
+	tMax = distanceBetweenOriginalIntersectionPointAndLightPosition;
+	return rayFromIntersectionPointToLight;
+}
+
+Vec3d PointLight::shadowAttenuation(const Vec3d& P) const
+{
+	// If there is an intersection and it's before reaching the light, return a non-pure black color
+	// Otherwise we drop out and return the default light color
+	double tMax;
+	ray rayFromIntersectionPointToLight = shadowRay(P, tMax);
+
+	return shadowColor(scene->occluded(rayFromIntersectionPointToLight, tMax));
 }
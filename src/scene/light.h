@@ -18,6 +18,17 @@ public:
 	virtual Vec3d getColor( const Vec3d& P ) const = 0;
 	virtual Vec3d getDirection( const Vec3d& P ) const = 0;
 
+	// The shadow ray from P towards the light, and how far along it
+	// something has to be to be in the way. shadowAttenuation() traces it;
+	// the packet tracer traces a whole packet of them at once and then
+	// asks shadowColor() what the answer means
+	virtual ray shadowRay( const Vec3d& P, double& tMax ) const = 0;
+	Vec3d shadowColor( bool blocked ) const
+	{
+		// Anything in the way gives a non-pure black color
+		return blocked ? Vec3d(0.2, 0.2, 0.2) : color;
+	}
+
 protected:
 	Light( Scene *scene, const Vec3d& col )
 		: SceneElement( scene ), color( col ) {}
@@ -39,6 +50,7 @@ public:
 	virtual double distanceAttenuation( const Vec3d& P ) const;
 	virtual Vec3d getColor( const Vec3d& P ) const;
 	virtual Vec3d getDirection( const Vec3d& P ) const;
+	virtual ray shadowRay( const Vec3d& P, double& tMax ) const;
 
 protected:
 	Vec3d 		orientation;
@@ -65,6 +77,7 @@ public:
 	virtual double distanceAttenuation( const Vec3d& P ) const;
 	virtual Vec3d getColor( const Vec3d& P ) const;
 	virtual Vec3d getDirection( const Vec3d& P ) const;
+	virtual ray shadowRay( const Vec3d& P, double& tMax ) const;
 
 	void setAttenuationConstants( float a, float b, float c )
 	{
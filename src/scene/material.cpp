@@ -10,7 +10,7 @@ extern bool debugMode;
 
 // Apply the Phong model to this point on the surface of the object, returning
 // the color of that point.
-Vec3d Material::shade( Scene *scene, const ray& r, const isect& i ) const
+Vec3d Material::shade( Scene *scene, const ray& r, const isect& i, const uint32_t* blockedLights ) const
 {
 	if( debugMode )
 		std::cout << "Debugging the Phong code (or lack thereof...)" << std::endl;
@@ -41,12 +41,15 @@ Vec3d Material::shade( Scene *scene, const ray& r, const isect& i ) const
     Vec3d theNormalVector = i.N;
     Vec3d rayIntersectionPoint = r.at(i.t);
 
-    for (vector<Light*>::const_iterator litr = scene->beginLights(); litr != scene->endLights(); litr++) {
+    int lightIndex = 0;
+    for (vector<Light*>::const_iterator litr = scene->beginLights(); litr != scene->endLights(); litr++, lightIndex++) {
         Light* currentLight = *litr;
         Vec3d vectorToTheLight = currentLight->getDirection(rayIntersectionPoint);
 
         // Calculate the shadow color and distance attenuation at this pixel
-        Vec3d shadowColor = currentLight->shadowAttenuation(rayIntersectionPoint);
+        Vec3d shadowColor = blockedLights
+            ? currentLight->shadowColor((*blockedLights >> lightIndex) & 1)
+            : currentLight->shadowAttenuation(offsetRayOrigin(rayIntersectionPoint, theNormalVector, vectorToTheLight));
         double distAttenuation = currentLight->distanceAttenuation(rayIntersectionPoint);
 
         // Calculate the Phong components
@@ -10,6 +10,7 @@
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
 #include <string>
+#include <stdint.h>
 
 class Scene;
 class ray;
@@ -173,7 +174,10 @@ public:
         : _ke( e ), _ka( a ), _ks( s ), _kd( d ), _kr( r ), _kt( t ), 
           _shininess( Vec3d(sh,sh,sh) ), _index( Vec3d(in,in,in) ) {}
 
-	virtual Vec3d shade( Scene *scene, const ray& r, const isect& i ) const;
+	// blockedLights, when given, says which lights' shadow rays have already
+	// been found blocked (bit l for the l'th light), so shade() needn't
+	// trace them itself
+	virtual Vec3d shade( Scene *scene, const ray& r, const isect& i, const uint32_t* blockedLights = 0 ) const;
 
   virtual double dotProduct(const Vec3d v1, const Vec3d v2) const {
     return v1[0] * v2[0] + v1[1] * v2[1] + v1[2] * v2[2];
@@ -0,0 +1,537 @@
+//
+// qbvh.h
+//
+// A four wide BVH: the binary tree collapsed so every node holds up to
+// four children, whose boxes are all tested against a ray at once.
+//
+
+#ifndef __QBVH_H__
+#define __QBVH_H__
+
+#include <vector>
+#include <chrono>
+#include <stdint.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define QBVH_SSE
+#endif
+
+#include "bvh.h"
+
+// The children's boxes are stored one axis at a time, the four children
+// side by side (boundsMin[axis][child]), so one 4-wide slab test covers
+// all of them. A child is either another QBVHNode (count 0, child is its
+// index) or a leaf's run of count objects starting at child in the
+// tree's object list, exactly as the binary tree's leaves had them.
+// Unused slots have child -1 and an inside-out box no ray can hit.
+struct QBVHNode
+{
+	float boundsMin[3][4];
+	float boundsMax[3][4];
+	int32_t child[4];
+	uint16_t count[4];
+	uint8_t axis;				// the axis the first split under this node was on
+	uint8_t pad[7];
+};
+
+static_assert( sizeof(QBVHNode) == 128, "QBVHNode should be two cache lines" );
+
+// Like BVHRay, but in floats, and with the origin and reciprocal
+// direction repeated across the four lanes
+struct QBVHRay
+{
+	QBVHRay( const ray& r )
+	{
+		Vec3d p = r.getPosition();
+		Vec3d d = r.getDirection();
+
+		for (int k = 0; k < 3; k++) {
+			origin[k] = (float)p[k];
+			invDir[k] = (float)(1.0 / d[k]);
+			dirIsNeg[k] = invDir[k] < 0.0f;
+		}
+	}
+
+	// Slab tests all four children of node, returning a bit per child
+	// that the ray hits before tLimit, and where it enters each of them.
+	// NaNs are ignored the same way BVHRay::hits() ignores them: max and
+	// min are written so a NaN in the first operand leaves the second.
+	int hits( const QBVHNode& node, float tLimit, float tNear[4] ) const
+	{
+#ifdef QBVH_SSE
+		__m128 nearT = _mm_set1_ps(-1.0e30f);
+		__m128 farT = _mm_set1_ps(1.0e30f);
+
+		for (int k = 0; k < 3; k++) {
+			__m128 o = _mm_set1_ps(origin[k]);
+			__m128 inv = _mm_set1_ps(invDir[k]);
+			const float* nearPlane = dirIsNeg[k] ? node.boundsMax[k] : node.boundsMin[k];
+			const float* farPlane = dirIsNeg[k] ? node.boundsMin[k] : node.boundsMax[k];
+
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearPlane), o), inv);
+			__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farPlane), o), inv);
+			nearT = _mm_max_ps(t1, nearT);
+			farT = _mm_min_ps(t2, farT);
+		}
+
+		_mm_storeu_ps(tNear, nearT);
+
+		__m128 hit = _mm_and_ps(_mm_cmple_ps(nearT, farT),
+			_mm_and_ps(_mm_cmpge_ps(farT, _mm_set1_ps((float)RAY_EPSILON)),
+				_mm_cmple_ps(nearT, _mm_set1_ps(tLimit))));
+		return _mm_movemask_ps(hit);
+#else
+		float tFar[4];
+		for (int c = 0; c < 4; c++) {
+			tNear[c] = -1.0e30f;
+			tFar[c] = 1.0e30f;
+		}
+
+		for (int k = 0; k < 3; k++) {
+			const float* nearPlane = dirIsNeg[k] ? node.boundsMax[k] : node.boundsMin[k];
+			const float* farPlane = dirIsNeg[k] ? node.boundsMin[k] : node.boundsMax[k];
+
+			for (int c = 0; c < 4; c++) {
+				float t1 = (nearPlane[c] - origin[k]) * invDir[k];
+				float t2 = (farPlane[c] - origin[k]) * invDir[k];
+				if (t1 > tNear[c])
+					tNear[c] = t1;
+				if (t2 < tFar[c])
+					tFar[c] = t2;
+			}
+		}
+
+		int mask = 0;
+		for (int c = 0; c < 4; c++) {
+			if (tNear[c] <= tFar[c] && tFar[c] >= (float)RAY_EPSILON && tNear[c] <= tLimit)
+				mask |= 1 << c;
+		}
+		return mask;
+#endif
+	}
+
+	float origin[3];
+	float invDir[3];
+	bool dirIsNeg[3];
+};
+
+// The same tree as BVHTree<Primitives>, built by the same BVHBuilder, but
+// collapsed to four wide nodes before it's used. Half the levels means
+// half the stack traffic, and the four box tests at each node are one
+// SIMD test (SSE; plain loops on other processors).
+template <typename Primitives>
+class QBVHTree : public BVH {
+public:
+	QBVHTree(const Primitives& givenPrimitives, const BVHBuildOptions& options = BVHBuildOptions())
+		: primitives(givenPrimitives), file(0) {
+		std::vector<BoundingBox> bounds(primitives.size());
+		std::vector<int> order;
+
+		for (size_t i = 0; i < bounds.size(); i++) {
+			bounds[i] = primitives.bounds(i);
+		}
+
+		BVHBuilder builder(options);
+		BVHNode* root = builder.build(bounds, order, stats);
+
+		std::vector<QBVHNode> collapsed;
+		BVHBuilder::collapse(root, collapsed, stats);
+		nodes.adopt(collapsed);
+
+		std::vector<uint32_t> leafOrder(order.begin(), order.end());
+		items.adopt(leafOrder);
+
+		stats.memoryBytes = nodes.size() * sizeof(QBVHNode) + items.size() * sizeof(uint32_t);
+	}
+
+	// A tree out of the BVH cache, taking over its file
+	QBVHTree(const Primitives& givenPrimitives, CachedBVH& cached)
+		: primitives(givenPrimitives), file(cached.file) {
+		nodes.view((const QBVHNode*)cached.nodes, cached.nodeCount);
+		items.view(cached.items, cached.itemCount);
+		stats = cached.stats;
+		cached.file = 0;
+	}
+
+	~QBVHTree() {
+		delete file;
+	}
+
+	int nodeWidth() const { return 4; }
+
+	const void* nodeData(size_t& count, size_t& nodeSize) const {
+		count = nodes.size();
+		nodeSize = sizeof(QBVHNode);
+		return nodes.data();
+	}
+
+	const uint32_t* objectOrder(size_t& count) const {
+		count = items.size();
+		return items.data();
+	}
+
+	bool intersect(const ray& r, isect& i) {
+		i.t = 1e300;
+		i.obj = nullptr;
+
+		if (nodes.empty()) {
+			return false;
+		}
+
+		QBVHRay qbvhRay(r);
+		float tNear[4];
+
+		bool ordered = orderedTraversal;
+		int nodesVisited = 0;
+		int objectsTested = 0;
+
+		// Each node visited pushes at most four entries and pops one, and
+		// the collapsed tree is no deeper than the binary one
+		int stack[4 * BVH_MAX_DEPTH];
+		float stackNear[4 * BVH_MAX_DEPTH];
+		int stackSize = 0;
+
+		stack[stackSize] = 0;
+		stackNear[stackSize++] = -1.0e30f;
+
+		while (stackSize > 0) {
+			stackSize--;
+
+			// Skip a node the closest hit has moved in front of since it was pushed
+			if (ordered && stackNear[stackSize] > i.t) {
+				continue;
+			}
+
+			const QBVHNode& node = nodes[stack[stackSize]];
+			nodesVisited++;
+
+			int mask = qbvhRay.hits(node, ordered ? (float)std::min(i.t, 1.0e30) : 1.0e30f, tNear);
+			if (mask == 0) {
+				continue;
+			}
+
+			// The children the ray hits, nearest first when ordered
+			int hitChildren[4];
+			int hitCount = 0;
+			for (int c = 0; c < 4; c++) {
+				if ((mask & (1 << c)) && node.child[c] >= 0) {
+					int n = hitCount++;
+					if (ordered) {
+						for (; n > 0 && tNear[hitChildren[n - 1]] > tNear[c]; n--) {
+							hitChildren[n] = hitChildren[n - 1];
+						}
+					}
+					hitChildren[n] = c;
+				}
+			}
+
+			// Leaves get tested straight away, nearest first, so i.t shrinks
+			// as early as it can
+			for (int h = 0; h < hitCount; h++) {
+				int c = hitChildren[h];
+				if (node.count[c] == 0 || (ordered && tNear[c] > i.t)) {
+					continue;
+				}
+
+				objectsTested += node.count[c];
+				for (int k = 0; k < node.count[c]; k++) {
+					isect newIntersectionPoint;
+
+					if (primitives.intersect(items[node.child[c] + k], r, newIntersectionPoint)) {
+						if (newIntersectionPoint.t < i.t) {
+							i = newIntersectionPoint;
+						}
+					}
+				}
+			}
+
+			// Then the inner nodes go on the stack farthest first, so the
+			// nearest comes off next
+			for (int h = hitCount - 1; h >= 0; h--) {
+				int c = hitChildren[h];
+				if (node.count[c] == 0) {
+					stack[stackSize] = node.child[c];
+					stackNear[stackSize++] = tNear[c];
+				}
+			}
+		}
+
+		BVHTraversalStats& counters = BVHTraversalStats::local();
+		counters.rays++;
+		counters.nodesVisited += nodesVisited;
+		counters.objectsTested += objectsTested;
+
+		return i.obj != nullptr;
+	}
+
+	bool occluded(const ray& r, double tMax) {
+		if (nodes.empty()) {
+			return false;
+		}
+
+		QBVHRay qbvhRay(r);
+		float tNear[4];
+		float tLimit = (float)std::min(tMax, 1.0e30);
+
+		bool hit = false;
+		int nodesVisited = 0;
+		int objectsTested = 0;
+
+		int stack[4 * BVH_MAX_DEPTH];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while (!hit && stackSize > 0) {
+			const QBVHNode& node = nodes[stack[--stackSize]];
+			nodesVisited++;
+
+			int mask = qbvhRay.hits(node, tLimit, tNear);
+
+			for (int c = 0; c < 4 && !hit; c++) {
+				if (!(mask & (1 << c)) || node.child[c] < 0) {
+					continue;
+				}
+
+				if (node.count[c] == 0) {
+					stack[stackSize++] = node.child[c];
+				} else {
+					for (int k = 0; k < node.count[c] && !hit; k++) {
+						objectsTested++;
+						hit = primitives.occluded(items[node.child[c] + k], r, tMax);
+					}
+				}
+			}
+		}
+
+		BVHTraversalStats& counters = BVHTraversalStats::local();
+		counters.occlusionRays++;
+		counters.occlusionNodesVisited += nodesVisited;
+		counters.occlusionObjectsTested += objectsTested;
+
+		return hit;
+	}
+
+	// The packet walks work like BVHTree's. The packet's first ray gets
+	// the SIMD test against all four children; a child it misses only
+	// goes on if the packet's culling test and then one of the other rays
+	// says so.
+	uint32_t intersectPacket(const RayPacket& packet, RayMask mask, isect* hits) {
+		if (nodes.empty() || mask == 0) {
+			return 0;
+		}
+
+		bool ordered = orderedTraversal;
+		int nodesVisited = 0;
+		int objectsTested = 0;
+		RayMask found = 0;
+
+		double tLimit[RAY_PACKET_SIZE];
+		for (int k = 0; k < packet.size; k++) {
+			tLimit[k] = ordered ? hits[k].t : 1.0e308;
+		}
+
+		int first = 0;
+		while (!(mask & (1u << first))) {
+			first++;
+		}
+		QBVHRay lead(packet.getRay(first));
+		RayMask others = mask & ~(1u << first);
+		float tNear[4];
+
+		int stack[4 * BVH_MAX_DEPTH];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while (stackSize > 0) {
+			const QBVHNode& node = nodes[stack[--stackSize]];
+			nodesVisited++;
+
+			int leadHits = lead.hits(node, (float)std::min(tLimit[first], 1.0e30), tNear);
+
+			// The children some ray hits, ordered by where the first ray
+			// enters them (the ones it misses go last)
+			int hitChildren[4];
+			RayMask childMask[4];
+			float childNear[4];
+			int hitCount = 0;
+
+			for (int c = 0; c < 4; c++) {
+				if (node.child[c] < 0) {
+					continue;
+				}
+
+				RayMask m;
+				if (node.count[c] > 0) {
+					float boundsMin[3], boundsMax[3];
+					childBounds(node, c, boundsMin, boundsMax);
+					m = packet.hitMask(boundsMin, boundsMax, mask, tLimit);
+				} else if (leadHits & (1 << c)) {
+					m = mask;
+				} else {
+					float boundsMin[3], boundsMax[3];
+					childBounds(node, c, boundsMin, boundsMax);
+					m = packet.anyHits(boundsMin, boundsMax, others, tLimit) ? mask : 0;
+				}
+
+				if (m == 0) {
+					continue;
+				}
+
+				float near = (leadHits & (1 << c)) ? tNear[c] : 1.0e30f;
+				int n = hitCount++;
+				if (ordered) {
+					for (; n > 0 && childNear[n - 1] > near; n--) {
+						hitChildren[n] = hitChildren[n - 1];
+						childMask[n] = childMask[n - 1];
+						childNear[n] = childNear[n - 1];
+					}
+				}
+				hitChildren[n] = c;
+				childMask[n] = m;
+				childNear[n] = near;
+			}
+
+			for (int h = 0; h < hitCount; h++) {
+				int c = hitChildren[h];
+				if (node.count[c] == 0) {
+					continue;
+				}
+
+				objectsTested += node.count[c];
+				for (int k = 0; k < node.count[c]; k++) {
+					RayMask hit = primitives.intersectPacket(items[node.child[c] + k], packet, childMask[h], hits);
+					found |= hit;
+
+					if (ordered) {
+						for (int r = 0; r < packet.size; r++) {
+							if (hit & (1u << r)) {
+								tLimit[r] = hits[r].t;
+							}
+						}
+					}
+				}
+			}
+
+			for (int h = hitCount - 1; h >= 0; h--) {
+				int c = hitChildren[h];
+				if (node.count[c] == 0) {
+					stack[stackSize++] = node.child[c];
+				}
+			}
+		}
+
+		BVHTraversalStats& counters = BVHTraversalStats::local();
+		counters.packets++;
+		counters.packetRays += popCount(mask);
+		counters.packetNodesVisited += nodesVisited;
+		counters.packetObjectsTested += objectsTested;
+
+		return found;
+	}
+
+	uint32_t occludedPacket(const RayPacket& packet, RayMask mask, const double* tMax) {
+		if (nodes.empty() || mask == 0) {
+			return 0;
+		}
+
+		int nodesVisited = 0;
+		int objectsTested = 0;
+		RayMask blocked = 0;
+
+		int stack[4 * BVH_MAX_DEPTH];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while (blocked != mask && stackSize > 0) {
+			const QBVHNode& node = nodes[stack[--stackSize]];
+			nodesVisited++;
+
+			for (int c = 0; c < 4 && blocked != mask; c++) {
+				if (node.child[c] < 0) {
+					continue;
+				}
+
+				float boundsMin[3], boundsMax[3];
+				childBounds(node, c, boundsMin, boundsMax);
+
+				if (node.count[c] == 0) {
+					if (packet.anyHits(boundsMin, boundsMax, mask & ~blocked, tMax)) {
+						stack[stackSize++] = node.child[c];
+					}
+					continue;
+				}
+
+				RayMask active = packet.hitMask(boundsMin, boundsMax, mask & ~blocked, tMax);
+				for (int k = 0; k < node.count[c] && (active & ~blocked); k++) {
+					objectsTested++;
+					blocked |= primitives.occludedPacket(items[node.child[c] + k], packet, active & ~blocked, tMax);
+				}
+			}
+		}
+
+		BVHTraversalStats& counters = BVHTraversalStats::local();
+		counters.packets++;
+		counters.packetRays += popCount(mask);
+		counters.packetNodesVisited += nodesVisited;
+		counters.packetObjectsTested += objectsTested;
+
+		return blocked;
+	}
+
+private:
+	static void childBounds(const QBVHNode& node, int c, float boundsMin[3], float boundsMax[3]) {
+		for (int k = 0; k < 3; k++) {
+			boundsMin[k] = node.boundsMin[k][c];
+			boundsMax[k] = node.boundsMax[k][c];
+		}
+	}
+
+	Primitives primitives;
+	FlatArray<QBVHNode> nodes;
+	FlatArray<uint32_t> items;
+	MappedFile* file;	// the cache file the arrays are in, if they are
+};
+
+// Builds the tree the options ask for over primitives
+template <typename Primitives>
+BVH* createBVHTree(const Primitives& primitives, const BVHBuildOptions& options)
+{
+	if (options.nodeWidth == 4) {
+		return new QBVHTree<Primitives>(primitives, options);
+	}
+	return new BVHTree<Primitives>(primitives, options);
+}
+
+// The same, but looking in the cache first for a tree saved under key,
+// and saving the tree there if it has to be built. A null cache just
+// builds it
+template <typename Primitives>
+BVH* createBVHTree(const Primitives& primitives, const BVHBuildOptions& options, BVHCache* cache, uint64_t key)
+{
+	if (cache == 0 || primitives.size() < BVHCache::MIN_OBJECTS) {
+		return createBVHTree(primitives, options);
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	CachedBVH cached;
+	if (cache->load(key, options.nodeWidth == 4 ? 4 : 2, primitives.size(), cached)) {
+		BVH* tree;
+		if (options.nodeWidth == 4) {
+			tree = new QBVHTree<Primitives>(primitives, cached);
+		} else {
+			tree = new BVHTree<Primitives>(primitives, cached);
+		}
+
+		// The time it took to load stands in for the build time
+		tree->setBuildTime(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+		return tree;
+	}
+
+	BVH* tree = createBVHTree(primitives, options);
+	cache->store(key, *tree);
+	return tree;
+}
+
+#endif // __QBVH_H__
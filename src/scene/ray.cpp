@@ -2,8 +2,12 @@
 #include "material.h"
 #include "scene.h"
 
+// Only the object's own material for now. Anything that varies the
+// material over an object (like a trimesh's per-vertex materials) would
+// work it out here from the primitive and uvCoordinates, rather than
+// storing a copy in every hit record the traversal makes
 const Material &
 isect::getMaterial() const
 {
-    return material ? *material : obj->getMaterial();
+    return obj->getMaterial();
 }
@@ -53,79 +53,62 @@ protected:
 	RayType t; 
 };
 
-// The description of an intersection point.
+// The description of an intersection point. It's a plain value that
+// the intersection code copies freely, every time it finds a closer hit,
+// so it holds nothing that needs allocating or freeing: just what was
+// hit and where. The material isn't looked up until the point is shaded,
+// from the object (and the primitive, for anything made of several).
 
 class isect
 {
 public:
     isect()
-        : obj( NULL ), t( 0.0 ), N(), material(0) {}
+        : obj( NULL ), t( 0.0 ), N(), primitive( -1 ) {}
 
-    ~isect()
-    {
-        delete material;
-    }
-    
     void setObject( const SceneObject *o ) { obj = o; }
     void setT( double tt ) { t = tt; }
     void setN( const Vec3d& n ) { N = n; }
-    void setMaterial( const Material& m ) 
-      { if(material) *material = m; else material = new Material(m); }
     void setUVCoordinates( const Vec2d& coords )
       { uvCoordinates = coords; }
- 
-    isect( const isect& other )
-    {
-        obj = other.obj;
-        t = other.t;
-        N = other.N;
-        uvCoordinates = other.uvCoordinates;
-        if( other.material )
-          material = new Material( *other.material );
-        else
-          material = 0;
-
-    }
-   
-    isect& operator =( const isect& other )
-    {
-        if( this != &other )
-        {
-            obj = other.obj;
-            t = other.t;
-            N = other.N;
-            uvCoordinates = other.uvCoordinates;
-//            material = other.material ? new Material( *(other.material) ) : 0;
-			if( other.material )
-            {
-                if( material )
-                    *material = *other.material;
-                else
-                    material = new Material(*other.material );
-            }
-            else
-            {
-                delete material;
-                material = 0;
-            }
-        }
-        return *this;
-    }
+    void setPrimitive( int p ) { primitive = p; }
 
 public:
     const SceneObject 	*obj;
     double t;
     Vec3d N;
-    Vec2d uvCoordinates;
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+    Vec2d uvCoordinates;        // texture coordinates, or the barycentric
+                                // weights of the first two vertices of a
+                                // triangle
+    int primitive;              // which triangle of a mesh, -1 otherwise
 
+    // The material at the hit point, evaluated on demand when shading
     const Material &getMaterial() const;
-    // Other info here.
 };
 
 const double RAY_EPSILON = 0.00001;
 const double NORMAL_EPSILON = 0.00001;
 
+// How far, relative to the size of its coordinates, a ray leaving a surface
+// starts off it (see offsetRayOrigin())
+const double SURFACE_OFFSET = 0.000001;
+
+// Where a ray leaving the surface at P, with normal N, in direction d
+// starts: moved off the surface, to d's side of it. A hit point is only
+// as exact as its coordinates are big (and the vertices are floats, as is
+// the whole triangle test in a SINGLE_PRECISION build), so at a few hundred
+// units a fixed epsilon isn't enough and the ray finds the very surface it
+// left: shadow acne. The move grows with the coordinates to stay ahead of it
+inline Vec3d offsetRayOrigin( const Vec3d& P, const Vec3d& N, const Vec3d& d )
+{
+	double size = 1.0;
+	for (int k = 0; k < 3; k++) {
+		if (fabs(P[k]) > size) {
+			size = fabs(P[k]);
+		}
+	}
+
+	double offset = SURFACE_OFFSET * size;
+	return N * d < 0 ? P - offset * N : P + offset * N;
+}
+
 #endif // __RAY_H__
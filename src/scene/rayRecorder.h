@@ -0,0 +1,76 @@
+//
+// rayRecorder.h
+//
+// Captures the rays traced for one pixel so the debugging view can draw them.
+//
+
+#ifndef __RAYRECORDER_H__
+#define __RAYRECORDER_H__
+
+#include <vector>
+
+#include "ray.h"
+
+// Define NO_RAY_RECORDING to compile ray recording out of the renderer
+// entirely; record() then does nothing and the debugging view stays empty.
+
+// One intersection query: the ray, and how far along it the hit was
+// (or the 1000 unit stand-in Scene::intersect uses for a miss). This is
+// deliberately not an isect, which would drag along a Material copy.
+struct RayRecord
+{
+	RayRecord()
+		: type( ray::VISIBILITY ), t( 0.0 ), hit( false ) {}
+
+	Vec3d position;
+	Vec3d direction;
+	ray::RayType type;
+	double t;
+	Vec3d N;
+	bool hit;
+};
+
+// A fixed size ring buffer of RayRecords. Recording is opt-in: the ray
+// tracer only hands a recorder to the Scene while the debugging display
+// is up, so ordinary renders never pay for it. Once full, the oldest rays
+// are overwritten, so a pixel with a huge glossy ray tree can't grow it
+// without bound.
+class RayRecorder
+{
+public:
+	explicit RayRecorder( int capacity = 4096 )
+		: records( capacity ), head( 0 ), count( 0 ) {}
+
+	void record( const ray& r, const isect& i, bool hit )
+	{
+#ifndef NO_RAY_RECORDING
+		RayRecord& rec = records[(head + count) % records.size()];
+		rec.position = r.getPosition();
+		rec.direction = r.getDirection();
+		rec.type = r.type();
+		rec.t = i.t;
+		rec.N = i.N;
+		rec.hit = hit;
+
+		if ((size_t)count < records.size()) {
+			count++;
+		} else {
+			head = (head + 1) % records.size();
+		}
+#endif
+	}
+
+	void clear() { head = 0; count = 0; }
+
+	// Records in the order they were made, oldest first
+	int size() const { return count; }
+	int capacity() const { return records.size(); }
+	const RayRecord& operator[]( int n ) const { return records[(head + n) % records.size()]; }
+
+private:
+	std::vector<RayRecord> records;
+	int head;		// index of the oldest record
+	int count;
+};
+
+#endif // __RAYRECORDER_H__
@@ -0,0 +1,72 @@
+//
+// sampler.h
+//
+// Counter-based random number streams for antialiasing and glossy sampling.
+//
+
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <stdint.h>
+
+// A Sampler hands out uniform random numbers in [0, 1) that are a pure
+// function of where they are used: the pixel, the sample index within the
+// pixel and the path of bounces that led to the current ray. There is no
+// generator state shared between pixels, so a pixel traced on any thread,
+// in any order (or on another machine) draws exactly the same numbers and
+// the image comes out bit-identical.
+//
+// Each stream is a 64 bit key plus a counter; next() hashes the two
+// together. Child streams for secondary rays are made with split(), which
+// hashes the child's index into the parent key.
+class Sampler
+{
+public:
+	Sampler( int pixelX, int pixelY, int sampleIndex )
+		: key( 0 ), counter( 0 )
+	{
+		key = mix( key ^ (uint32_t)pixelX );
+		key = mix( key ^ ((uint64_t)(uint32_t)pixelY << 32) );
+		key = mix( key ^ (uint32_t)sampleIndex );
+	}
+
+	// An empty stream, to be assigned a real one before it is drawn from
+	Sampler()
+		: key( 0 ), counter( 0 ) {}
+
+	// The stream for the index'th ray spawned at this bounce. Splitting
+	// does not consume any numbers from this stream.
+	Sampler split( int index ) const
+	{
+		return Sampler( mix( key + GOLDEN_GAMMA * ((uint64_t)(uint32_t)index + 1) ) );
+	}
+
+	// The next uniform double in [0, 1)
+	double next()
+	{
+		uint64_t bits = mix( key + GOLDEN_GAMMA * ++counter );
+
+		// Keep the top 53 bits, the precision of a double's mantissa
+		return (bits >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+private:
+	explicit Sampler( uint64_t key )
+		: key( key ), counter( 0 ) {}
+
+	// The SplitMix64 finalizer: a bijection on 64 bit values in which
+	// every input bit affects every output bit
+	static uint64_t mix( uint64_t z )
+	{
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	static const uint64_t GOLDEN_GAMMA = 0x9e3779b97f4a7c15ULL;
+
+	uint64_t key;
+	uint64_t counter;
+};
+
+#endif // __SAMPLER_H__
@@ -1,6 +1,8 @@
 #include <cmath>
 
 #include "scene.h"
+#include "bvh.h"
+#include "qbvh.h"
 #include "light.h"
 
 using namespace std;
@@ -76,14 +78,35 @@ bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 	return true; // it made it past all 3 axes.
 }
 
+void BoundingBox::merge(const BoundingBox& target)
+{
+	min = minimum(min, target.min);
+	max = maximum(max, target.max);
+}
+
+void BoundingBox::merge(const Vec3d& point)
+{
+	min = minimum(min, point);
+	max = maximum(max, point);
+}
+
+double BoundingBox::area() const
+{
+	Vec3d extent = max - min;
+
+	// An empty box has negative extents
+	if (extent[0] < 0 || extent[1] < 0 || extent[2] < 0)
+		return 0.0;
+
+	return 2.0 * (extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0]);
+}
+
 
 bool Geometry::intersect(const ray&r, isect&i) const
 {
     // Transform the ray into the object's local coordinate space
-    Vec3d pos = transform->globalToLocalCoords(r.getPosition());
-    Vec3d dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
-    double length = dir.length();
-    dir /= length;
+    Vec3d pos, dir;
+    double length = transform->globalToLocalRay(r.getPosition(), r.getDirection(), pos, dir);
 
     ray localRay( pos, dir, r.type() );
 
@@ -99,6 +122,109 @@ bool Geometry::intersect(const ray&r, isect&i) const
     
 }
 
+bool Geometry::occluded(const ray&r, double tMax) const
+{
+    // Transform the ray into the object's local coordinate space, as intersect() does
+    Vec3d pos, dir;
+    double length = transform->globalToLocalRay(r.getPosition(), r.getDirection(), pos, dir);
+
+    ray localRay( pos, dir, r.type() );
+
+    // Distances along the local ray are stretched by the same length
+    return occludedLocal(localRay, tMax * length);
+}
+
+bool Geometry::occludedLocal( const ray& r, double tMax ) const
+{
+	isect i;
+	return intersectLocal(r, i) && i.t < tMax;
+}
+
+// Moves the packet's rays in mask into local space, as intersect() does,
+// keeping how much each one's direction was stretched
+static void toLocalPacket( TransformNode* transform, const RayPacket& packet, uint32_t mask,
+	RayPacket& localPacket, double* length )
+{
+    for (int k = 0; k < packet.size; k++) {
+        if (!(mask & (1u << k))) {
+            continue;
+        }
+
+        Vec3d pos, dir;
+        length[k] = transform->globalToLocalRay(packet.position[k], packet.direction[k], pos, dir);
+
+        localPacket.set(k, pos, dir);
+    }
+    localPacket.prepare(mask);
+}
+
+uint32_t Geometry::intersectPacket( const RayPacket& packet, uint32_t mask, isect* hits ) const
+{
+    RayPacket localPacket(packet.type);
+    double length[RAY_PACKET_SIZE];
+    toLocalPacket(transform, packet, mask, localPacket, length);
+
+    // Only hits closer than the ones already found are wanted
+    isect localHits[RAY_PACKET_SIZE];
+    for (int k = 0; k < packet.size; k++) {
+        localHits[k].t = (mask & (1u << k)) ? hits[k].t * length[k] : 0.0;
+    }
+
+    uint32_t found = intersectLocalPacket(localPacket, mask, localHits);
+
+    for (int k = 0; k < packet.size; k++) {
+        if (found & (1u << k)) {
+            localHits[k].N = transform->localToGlobalCoordsNormal(localHits[k].N);
+            localHits[k].t /= length[k];
+            hits[k] = localHits[k];
+        }
+    }
+
+    return found;
+}
+
+uint32_t Geometry::occludedPacket( const RayPacket& packet, uint32_t mask, const double* tMax ) const
+{
+    RayPacket localPacket(packet.type);
+    double length[RAY_PACKET_SIZE];
+    toLocalPacket(transform, packet, mask, localPacket, length);
+
+    double localMax[RAY_PACKET_SIZE];
+    for (int k = 0; k < packet.size; k++) {
+        localMax[k] = (mask & (1u << k)) ? tMax[k] * length[k] : 0.0;
+    }
+
+    return occludedLocalPacket(localPacket, mask, localMax);
+}
+
+uint32_t Geometry::intersectLocalPacket( const RayPacket& packet, uint32_t mask, isect* hits ) const
+{
+    uint32_t found = 0;
+
+    for (int k = 0; k < packet.size; k++) {
+        isect cur;
+        if ((mask & (1u << k)) && intersectLocal(packet.getRay(k), cur) && cur.t < hits[k].t) {
+            hits[k] = cur;
+            found |= 1u << k;
+        }
+    }
+
+    return found;
+}
+
+uint32_t Geometry::occludedLocalPacket( const RayPacket& packet, uint32_t mask, const double* tMax ) const
+{
+    uint32_t blocked = 0;
+
+    for (int k = 0; k < packet.size; k++) {
+        if ((mask & (1u << k)) && occludedLocal(packet.getRay(k), tMax[k])) {
+            blocked |= 1u << k;
+        }
+    }
+
+    return blocked;
+}
+
 bool Geometry::hasBoundingBoxCapability() const
 {
 	// by default, primitives do not have to specify a bounding box.
@@ -132,7 +258,8 @@ Scene::~Scene()
 		delete (*t).second;
 	}
 
-
+	delete bvh;
+	delete bvhFileCache;
 }
 
 // Get any intersection with an object.  Return information about the 
@@ -167,32 +294,194 @@ bool Scene::intersect( const ray& r, isect& i ) const
 		i.setT(1000.0);
 
 	// if debugging,
-	intersectCache.push_back( std::make_pair(r,i) );
+	if (recorder) {
+		recorder->record( r, i, have_one );
+	}
 
 	return have_one;
 }
 
-bool Scene::createBVH() {
-	bool hasAtLeastOneObject = false;
+bool Scene::occluded( const ray& r, double tMax ) const
+{
+	typedef vector<Geometry*>::const_iterator iter;
 
-	// Iterate over the objects in the scene and create
-	// a BVH node for each one
-	for (int i = 0; i < objects.size(); i++) {
-		objects[i]->createBVH();
+	// The debugging view wants to see where shadow rays stopped, so while
+	// rays are being recorded take the long way round through intersect()
+	if (recorder) {
+		isect i;
+		return intersect(r, i) && i.t < tMax;
+	}
 
-		if (!hasAtLeastOneObject) {
-			hasAtLeastOneObject = true;
+	if (enableBVH && bvh != nullptr) {
+		return bvh->occluded(r, tMax);
+	}
+
+	for( iter j = objects.begin(); j != objects.end(); ++j ) {
+		if( (*j)->occluded( r, tMax ) ) {
+			return true;
 		}
 	}
 
-	if (hasAtLeastOneObject) {
-		// Set the parent node
-		bvh = new BVHNode<Geometry>(objects);
+	return false;
+}
+
+uint32_t Scene::intersectPacket( const RayPacket& packet, isect* hits ) const
+{
+	uint32_t mask = packet.allRays();
+	uint32_t found = 0;
+
+	for (int k = 0; k < packet.size; k++) {
+		hits[k].t = 1e300;
+		hits[k].obj = nullptr;
+	}
+
+	if (enableBVH && bvh != nullptr) {
+		found = bvh->intersectPacket(packet, mask, hits);
 	} else {
-		bvh = nullptr;
+		for (size_t j = 0; j < objects.size(); j++) {
+			found |= objects[j]->intersectPacket(packet, mask, hits);
+		}
+	}
+
+	for (int k = 0; k < packet.size; k++) {
+		if (!(found & (1u << k))) {
+			hits[k].setT(1000.0);
+		}
+	}
+
+	return found;
+}
+
+uint32_t Scene::occludedPacket( const RayPacket& packet, uint32_t mask, const double* tMax ) const
+{
+	if (enableBVH && bvh != nullptr) {
+		return bvh->occludedPacket(packet, mask, tMax);
+	}
+
+	uint32_t blocked = 0;
+	for (size_t j = 0; j < objects.size() && blocked != mask; j++) {
+		blocked |= objects[j]->occludedPacket(packet, mask & ~blocked, tMax);
+	}
+	return blocked;
+}
+
+bool Scene::createBVH( const BVHBuildOptions& options ) {
+	if (bvh && bvhCurrent && options.buildsSameTreeAs(bvhOptions)) {
+		bvhReused = true;
+		return true;
+	}
+
+	bvhOptions = options;
+	bvhReused = false;
+	bvhBuilds++;
+
+	// Iterate over the objects in the scene and let each one that
+	// has its own BVH (the trimeshes) build it
+	for (int i = 0; i < objects.size(); i++) {
+		objects[i]->createBVH(options);
+	}
+
+	return rebuildTopLevelBVH();
+}
+
+bool Scene::rebuildTopLevelBVH() {
+	delete bvh;
+	bvh = nullptr;
+
+	if (objects.empty()) {
+		return false;
 	}
 
-	return hasAtLeastOneObject;
+	// The objects' world space boxes come from their transforms, which
+	// may have changed since they were added
+	sceneBounds = BoundingBox();
+	for (size_t i = 0; i < objects.size(); i++) {
+		objects[i]->ComputeBoundingBox();
+		if (objects[i]->hasBoundingBoxCapability()) {
+			sceneBounds.merge(objects[i]->getBoundingBox());
+		}
+	}
+
+	// Set the parent node
+	bvh = createBVHTree(GeometryList(objects), bvhOptions);
+	bvhCurrent = true;
+	return true;
+}
+
+void Scene::setBVHCache( BVHCache* cache ) {
+	delete bvhFileCache;
+	bvhFileCache = cache;
+}
+
+size_t Scene::bvhBytes() const {
+	BVHBuildStats meshStats;
+	bottomLevelStats(meshStats);
+	return (bvh ? bvh->buildStats().memoryBytes : 0) + meshStats.memoryBytes;
+}
+
+int Scene::moveToWorldSpace() {
+	int moved = 0;
+
+	sceneBounds = BoundingBox();
+	for (size_t i = 0; i < objects.size(); i++) {
+		if (objects[i]->moveToWorldSpace(&transformRoot)) {
+			objects[i]->ComputeBoundingBox();
+			moved++;
+		}
+		if (objects[i]->hasBoundingBoxCapability()) {
+			sceneBounds.merge(objects[i]->getBoundingBox());
+		}
+	}
+
+	worldSpaceObjects += moved;
+	if (moved > 0) {
+		invalidateBVH();
+	}
+	return moved;
+}
+
+void Scene::countTransforms( int counts[4] ) const {
+	for (int k = 0; k < 4; k++) {
+		counts[k] = 0;
+	}
+	for (size_t i = 0; i < objects.size(); i++) {
+		counts[objects[i]->getTransform()->kind()]++;
+	}
+}
+
+// Adds up the bottom level trees, returning how many there are.
+// Instances share their mesh's tree, so it's only counted once
+int Scene::bottomLevelStats( BVHBuildStats& total ) const {
+	int count = 0;
+	total = BVHBuildStats();
+
+	for (size_t i = 0; i < objects.size(); i++) {
+		const BVH* blas = objects[i]->bottomLevelBVH();
+		if (blas == 0) {
+			continue;
+		}
+
+		const BVHBuildStats& stats = blas->buildStats();
+		total.primitiveCount += stats.primitiveCount;
+		total.nodeCount += stats.nodeCount;
+		total.leafCount += stats.leafCount;
+		total.maxDepth = std::max(total.maxDepth, stats.maxDepth);
+		total.sahCost += stats.sahCost;
+		total.buildTime += stats.buildTime;
+		total.buildThreads = std::max(total.buildThreads, stats.buildThreads);
+		total.memoryBytes += stats.memoryBytes;
+		count++;
+	}
+
+	return count;
+}
+
+size_t Scene::geometryBytes() const {
+	size_t bytes = 0;
+	for (size_t i = 0; i < objects.size(); i++) {
+		bytes += objects[i]->geometryBytes();
+	}
+	return bytes;
 }
 
 TextureMap* Scene::getTexture( string name )
@@ -19,13 +19,15 @@
 #include "ray.h"
 #include "material.h"
 #include "camera.h"
+#include "rayRecorder.h"
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
 
-#include <stack>
-
 class Light;
 class Scene;
+class BVH;
+class BVHCache;
+struct RayPacket;
 
 
 class SceneElement
@@ -48,6 +50,11 @@ protected:
 class BoundingBox
 {
 public:
+	// A new box is empty (min is above max) until something is merged
+	// into it, rather than a point at the origin that merging can't shrink
+	BoundingBox()
+		: min( 1.0e308, 1.0e308, 1.0e308 ), max( -1.0e308, -1.0e308, -1.0e308 ) {}
+
 	Vec3d min;
 	Vec3d max;
 
@@ -63,6 +70,57 @@ public:
 	// closest to the origin in tMin and the "t" value of the far intersection
 	// in tMax and return true, else return false.
 	bool intersect(const ray& r, double& tMin, double& tMax) const;
+
+	// Grow the box so that it also encloses the target
+	void merge(const BoundingBox& target);
+	void merge(const Vec3d& point);
+
+	// Surface area of the box, for the SAH BVH builder
+	double area() const;
+};
+
+// Tuning knobs for BVH construction, see bvh.h
+struct BVHBuildOptions
+{
+	enum SplitMethod
+	{
+		SPLIT_MEDIAN,		// split at the median centroid along the longest axis
+		SPLIT_SAH			// binned surface area heuristic
+	};
+
+	BVHBuildOptions()
+		: splitMethod( SPLIT_SAH ), binCount( 16 ), maxLeafSize( 4 ), nodeWidth( 4 ), buildThreads( 0 ) {}
+
+	SplitMethod splitMethod;
+	int binCount;			// candidate split planes per axis for SPLIT_SAH
+	int maxLeafSize;		// never put more objects than this in one leaf
+	int nodeWidth;			// children per node: 2, or 4 for the collapsed QBVH
+	int buildThreads;		// threads to build each tree with, 0 for one per hardware thread
+
+	// Would these options build the same tree as other? The thread count
+	// doesn't change the tree, only how long it takes
+	bool buildsSameTreeAs( const BVHBuildOptions& other ) const
+	{
+		return splitMethod == other.splitMethod && binCount == other.binCount &&
+			maxLeafSize == other.maxLeafSize && nodeWidth == other.nodeWidth;
+	}
+};
+
+// What the builder produced, so different builders can be compared
+struct BVHBuildStats
+{
+	BVHBuildStats()
+		: primitiveCount( 0 ), nodeCount( 0 ), leafCount( 0 ), maxDepth( 0 ),
+		  sahCost( 0.0 ), buildTime( 0.0 ), buildThreads( 1 ), memoryBytes( 0 ) {}
+
+	int primitiveCount;
+	int nodeCount;			// interior nodes and leaves; a 4-wide tree's leaves live in its nodes' slots
+	int leafCount;			// leaves, or the slots holding them in a 4-wide tree
+	int maxDepth;
+	double sahCost;			// expected cost of a ray through the tree, in units of one intersection test
+	double buildTime;		// in seconds
+	int buildThreads;		// that built it
+	size_t memoryBytes;		// the flattened nodes and the object index list
 };
 
 class TransformNode
@@ -74,11 +132,27 @@ protected:
 	Mat4d    inverse;
 	Mat3d    normi;
 
+	// what classify() made of xform, for the fast paths below
+	int      xformKind;
+	Vec3d    translation;
+	double   inverseScale;
+
     // information about parent & children
     TransformNode *parent;
     std::vector<TransformNode*> children;
     
 public:
+	// The kinds of transform the ray and normal transforms below have a
+	// shortcut for. Most objects sit right under the root or are only
+	// moved or resized, and those don't need the matrices at all
+	enum Kind
+	{
+		IDENTITY,
+		TRANSLATION,
+		UNIFORM_SCALE,		// a positive scale on every axis, and a translation
+		AFFINE
+	};
+
    	typedef std::vector<TransformNode*>::iterator          child_iter;
 	typedef std::vector<TransformNode*>::const_iterator    child_citer;
 
@@ -111,14 +185,52 @@ public:
         return xform * v;
     }
 
-    Vec3d localToGlobalCoordsNormal(const Vec3d &v)
+    Vec3d localToGlobalCoordsNormal(const Vec3d &v) const
     {
-        Vec3d ret = normi * v;
+        // Moving and resizing evenly don't turn normals
+        Vec3d ret = xformKind == AFFINE ? normi * v : v;
 		ret.normalize();
 		return ret;
     }
 
+    // Take the world space ray from p along d into local space, with the
+    // direction normalized when it has to be. Returns how many local units
+    // one world unit along the ray comes to, which is what distances are
+    // converted with
+    double globalToLocalRay(const Vec3d &p, const Vec3d &d, Vec3d &pos, Vec3d &dir) const
+    {
+        switch (xformKind) {
+        case IDENTITY:
+            pos = p;
+            dir = d;
+            return 1.0;
+
+        case TRANSLATION:
+            pos = p - translation;
+            dir = d;
+            return 1.0;
+
+        case UNIFORM_SCALE:
+            // The direction only gets shorter or longer, so it is left as is
+            // and the distances are scaled instead
+            pos = (p - translation) * inverseScale;
+            dir = d;
+            return inverseScale;
+
+        default: {
+            // Through the inverse go the start and a point one unit along
+            pos = inverse * p;
+            dir = inverse * (p + d) - pos;
+            double length = dir.length();
+            dir /= length;
+            return length;
+        }
+        }
+    }
+
 	const Mat4d& transform() const		{ return xform; }
+	Kind kind() const					{ return (Kind)xformKind; }
+	const Mat3d& normalTransform() const	{ return normi; }
 
 protected:
     // protected so that users can't directly construct one of these...
@@ -135,6 +247,30 @@ protected:
         
         inverse = this->xform.inverse();
         normi = this->xform.upper33().inverse().transpose();
+        classify();
+    }
+
+private:
+    void classify()
+    {
+        const Mat4d& m = xform;
+        translation = Vec3d(m[0][3], m[1][3], m[2][3]);
+        inverseScale = 1.0;
+
+        bool diagonal = m[0][1] == 0.0 && m[0][2] == 0.0 && m[1][0] == 0.0 &&
+            m[1][2] == 0.0 && m[2][0] == 0.0 && m[2][1] == 0.0;
+        bool even = m[0][0] == m[1][1] && m[1][1] == m[2][2];
+        bool projective = m[3][0] != 0.0 || m[3][1] != 0.0 || m[3][2] != 0.0 || m[3][3] != 1.0;
+        bool moved = translation[0] != 0.0 || translation[1] != 0.0 || translation[2] != 0.0;
+
+        if (projective || !diagonal || !even || m[0][0] <= 0.0) {
+            xformKind = AFFINE;
+        } else if (m[0][0] != 1.0) {
+            xformKind = UNIFORM_SCALE;
+            inverseScale = 1.0 / m[0][0];
+        } else {
+            xformKind = moved ? TRANSLATION : IDENTITY;
+        }
     }
 };
 
@@ -154,12 +290,34 @@ class Geometry
 public:
     // intersections performed in the global coordinate space.
     bool intersect(const ray&r, isect&i) const;
+
+    // does the ray hit this object anywhere closer than tMax? Like intersect(),
+    // but for shadow rays, which don't care where the hit is or what it looks like
+    bool occluded(const ray&r, double tMax) const;
+
+    // The same for the rays of a packet (see bvh.h) whose bits are
+    // set in mask. hits[k] is only replaced by a hit closer than the one it
+    // holds, and the rays that got one are returned. occludedPacket()
+    // returns the rays blocked before their own tMax[k]
+    uint32_t intersectPacket(const RayPacket& packet, uint32_t mask, isect* hits) const;
+    uint32_t occludedPacket(const RayPacket& packet, uint32_t mask, const double* tMax) const;
     
 protected:
     // intersections performed in the object's local coordinate space
     // do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal( const ray& r, isect& i ) const = 0;
 
+    // the local space half of occluded(), with tMax in local units. The default
+    // just runs intersectLocal(); objects that can skip the normal and uv
+    // work for a shadow ray should override it
+	virtual bool occludedLocal( const ray& r, double tMax ) const;
+
+    // the local space halves of the packet queries. By default they test
+    // one ray at a time; objects with a BVH of their own walk it once for
+    // the whole packet
+	virtual uint32_t intersectLocalPacket( const RayPacket& packet, uint32_t mask, isect* hits ) const;
+	virtual uint32_t occludedLocalPacket( const RayPacket& packet, uint32_t mask, const double* tMax ) const;
+
 public:
 	virtual double dotProduct(const Vec3d v1, const Vec3d v2) const {
 		return v1[0] * v2[0] + v1[1] * v2[1] + v1[2] * v2[2];
@@ -169,7 +327,15 @@ public:
 		return Vec3d(v1[1] * v2[2] - v1[2] * v2[1], v1[2] * v2[0] - v1[0] * v2[2], v1[0] * v2[1] - v1[1] * v2[0]);
     }
 
-	virtual void createBVH() {}
+	// Objects made of many primitives (trimeshes) build their own bottom
+	// level BVH here, in their local space; the Scene's top level tree then
+	// only has to find the object
+	virtual void createBVH( const BVHBuildOptions& options ) {}
+	virtual const BVH* bottomLevelBVH() const { return 0; }
+
+	// Bytes of vertex and index data the object keeps for its primitives,
+	// not counting anything it shares with another object
+	virtual size_t geometryBytes() const { return 0; }
 
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
@@ -179,6 +345,12 @@ public:
         // and use those to find a new bounding box.
 
         BoundingBox localBounds = ComputeLocalBoundingBox();
+
+        // Nothing to transform; an empty box would only turn into infinities
+        if (localBounds.min[0] > localBounds.max[0]) {
+            bounds = localBounds;
+            return;
+        }
         
         Vec3d min = localBounds.min;
 		Vec3d max = localBounds.max;
@@ -214,11 +386,17 @@ public:
 		bounds.min = Vec3d(newMin);
     }
 
-    // default method for ComputeLocalBoundingBox returns a bogus bounding box;
+    // default method for ComputeLocalBoundingBox returns an empty bounding box;
     // this should be overridden if hasBoundingBoxCapability() is true.
     virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
 
     void setTransform(TransformNode *transform) { this->transform = transform; };
+    const TransformNode* getTransform() const { return transform; }
+
+	// Objects whose primitives can be put straight into world space do it
+	// here and move under the world (identity) transform, so rays no longer
+	// have to be taken into their local space. Returns whether it did
+	virtual bool moveToWorldSpace( TransformNode* world ) { return false; }
     
 	Geometry( Scene *scene ) 
 		: SceneElement( scene ) {}
@@ -271,197 +449,38 @@ protected:
 	Material* material;
 };
 
-// Using this as a template class so that the BVH can work with
-// generic data types, and I found this very helpful to deal with both
-// the Geometry and Trimesh/TrimeshFace classes. Though the latter is a
-// sub-sub-sub class of Geometry, I found this more easy to use.
-// Setup took a bit of time, but I found working with the BVH to be
-// much simpler as a result
+// The interface the Scene uses for its acceleration structure. The
+// actual tree lives in bvh.h.
 class BVH {
 public:
 	virtual bool intersect(const ray& r, isect& i) = 0;
-	virtual ~BVH() {}
-};
-
-template <typename T>
-class BVHNode : public BVH {
-public:
-	BoundingBox boundingBox;
-	Geometry *nodeObject;
-	BVHNode *leftNode;
-	BVHNode *rightNode;
-	bool leafNode;
-
-	BVHNode(std::vector<T*> &givenGeometryObjects) {
-		// Create an initial bounding box for this new object that's centered at the
-		// origin and has a size of 0, and assume this node to be a child node
-		boundingBox = BoundingBox();
-		boundingBox.min = Vec3d(0,0,0);
-		boundingBox.max = Vec3d(0,0,0);
-		leafNode = true;
-
-		// Go through the given objects and merge their individual bounding box
-		// dimensions together until we end up with our one bounding box that
-		// encompasses all the objects that are given
-		for (int i = 0; i < givenGeometryObjects.size(); i++) {
-			BoundingBox currentBoundingBox = givenGeometryObjects[i]->getBoundingBox();
-
-			for (int i = 0; i < 3; i++) {
-				if (currentBoundingBox.max[i] > boundingBox.max[i]) {
-					boundingBox.max[i] = currentBoundingBox.max[i];
-				}
-				if (currentBoundingBox.min[i] < boundingBox.min[i]) {
-					boundingBox.min[i] = currentBoundingBox.min[i];
-				}
-			}
-		}
-
-		// If we end up with 0 or 1 given objects, this is a leaf node. Store
-		// the object (if there is one) and we're done
-		if (givenGeometryObjects.size() <= 1) {
-			nodeObject = givenGeometryObjects.size() == 0 ? nullptr : givenGeometryObjects[0];
-		} else {
-			leafNode = false;
-
-			std::vector<T*> leftNodeObjects;
-			std::vector<T*> rightNodeObjects;
-
-			// Split along the longest axis for this bounding box
-			double distanceX = boundingBox.max[0] - boundingBox.min[0];
-			double distanceY = boundingBox.max[1] - boundingBox.min[1];
-			double distanceZ = boundingBox.max[2] - boundingBox.min[2];
-			int axisToSplit;
-
-			if (distanceX >= distanceY && distanceX >= distanceZ) {
-				axisToSplit = 0;
-			} else if (distanceY >= distanceX && distanceY >= distanceZ) {
-				axisToSplit = 1;
-			} else {
-				axisToSplit = 2;
-			}
-
-			// Sort the list according to the axisToSplit, using custom operator() functions
-			if (axisToSplit == 0) {
-				std::sort(givenGeometryObjects.begin(), givenGeometryObjects.end(), SortByXAxis());
-			} else if (axisToSplit == 1) {
-				std::sort(givenGeometryObjects.begin(), givenGeometryObjects.end(), SortByYAxis());
-			} else {
-				std::sort(givenGeometryObjects.begin(), givenGeometryObjects.end(), SortByZAxis());
-			}
-
-			if (givenGeometryObjects.size() == 2) {
-				leftNodeObjects.push_back(givenGeometryObjects[0]);
-				rightNodeObjects.push_back(givenGeometryObjects[1]);
-			} else {
-				int medianIndex = givenGeometryObjects.size() / 2;
-
-				// Go through each of the given geometry objects and add them to the left and
-				// right node objects list, depending on which side of the median they're on
-				for (int i = 0; i < givenGeometryObjects.size(); i++) {
-					if (i < medianIndex) {
-						leftNodeObjects.push_back(givenGeometryObjects[i]);
-					} else {
-						rightNodeObjects.push_back(givenGeometryObjects[i]);
-					}
-				}
-			}
-
-			// Recursively create the left and right nodes for the given objects
-			leftNode = new BVHNode<T>(leftNodeObjects);
-			rightNode = new BVHNode<T>(rightNodeObjects);
-		}
-	}
-
-	struct SortByXAxis {
-		bool operator() (Geometry* const &left, Geometry* const &right) {
-			BoundingBox leftBB = left->getBoundingBox();
-			BoundingBox rightBB = right->getBoundingBox();
-
-			double middleLeft = (leftBB.min[0] + leftBB.max[0]) / 2.0;
-			double middleRight = (rightBB.min[0] + rightBB.max[0]) / 2.0;
-
-			return middleLeft < middleRight;
-		}
-	};
-
-	struct SortByYAxis {
-		bool operator() (Geometry* const &left, Geometry* const &right) {
-			BoundingBox leftBB = left->getBoundingBox();
-			BoundingBox rightBB = right->getBoundingBox();
 
-			double middleLeft = (leftBB.min[1] + leftBB.max[1]) / 2.0;
-			double middleRight = (rightBB.min[1] + rightBB.max[1]) / 2.0;
-
-			return middleLeft < middleRight;
-		}
-	};
+	// Any hit closer than tMax will do; see Scene::occluded
+	virtual bool occluded(const ray& r, double tMax) = 0;
 
-	struct SortByZAxis {
-		bool operator() (Geometry* const &left, Geometry* const &right) {
-			BoundingBox leftBB = left->getBoundingBox();
-			BoundingBox rightBB = right->getBoundingBox();
-
-			double middleLeft = (leftBB.min[2] + leftBB.max[2]) / 2.0;
-			double middleRight = (rightBB.min[2] + rightBB.max[2]) / 2.0;
-
-			return middleLeft < middleRight;
-		}
-	};
-
-	bool intersect(const ray& r, isect& i) {
-		// Initialize the t value to an enormous double
-		i.t = 1e300;
-		double tMin, tMax;
-		std::stack<BVHNode*> stack;
+	// Both for a packet of rays at once, with the same meaning as
+	// Geometry::intersectPacket and occludedPacket
+	virtual uint32_t intersectPacket(const RayPacket& packet, uint32_t mask, isect* hits) = 0;
+	virtual uint32_t occludedPacket(const RayPacket& packet, uint32_t mask, const double* tMax) = 0;
+	virtual ~BVH() {}
 
-		// initialize the i object to null, we'll check for this when the while loop ends
-		i.obj = nullptr;
+	const BVHBuildStats& buildStats() const { return stats; }
+	void setBuildTime(double seconds) { stats.buildTime = seconds; }
 
-		if (!boundingBox.intersect(r, tMin, tMax)) {
-			// No intersection with this bounding box, return false immediately
-			return false;
-		}
+	// The tree as it sits in memory, for the BVH cache: children per
+	// node, the flattened nodes, and the objects' indices in leaf order
+	virtual int nodeWidth() const = 0;
+	virtual const void* nodeData(size_t& count, size_t& nodeSize) const = 0;
+	virtual const uint32_t* objectOrder(size_t& count) const = 0;
 
-		BVHNode *currNode = this;
-		stack.push(currNode);
-		
-		while (!stack.empty()) {
-			// Get the next node off the stack and perform the checks with it
-			currNode = stack.top();
-			stack.pop();
-
-			if (currNode->leafNode) {
-				// Check for an intersection with this leaf node's object
-				isect newIntersectionPoint;
-
-				if (currNode->nodeObject->intersect(r, newIntersectionPoint)) {
-					// Update i if and only if the newIntersectionPoint's t value is less than
-					// what is currently stored as the closest in i.t
-					if (newIntersectionPoint.t < i.t) {
-						i = newIntersectionPoint;
-					}
-				}
-			} else {
-				// Check for intersection with the sibling nodes' bounding box
-				// and add to the stack if there is an intersection
-				bool hitLeftNode = currNode->leftNode->boundingBox.intersect(r, tMin, tMax);;
-				bool hitRightNode = currNode->rightNode->boundingBox.intersect(r, tMin, tMax);
-
-				if (hitRightNode) {
-					stack.push(currNode->rightNode);
-				}
-				if (hitLeftNode) {
-					stack.push(currNode->leftNode);
-				}
-			}
-		}
-
-		// If obj is not null, that means we hit a leaf node (i.e. an actual object),
-		// then we return true, otherwise we haven't and return false
-		return i.obj != nullptr;
-	}
+	// Normal renders walk the tree front to back and skip nodes beyond the
+	// closest hit so far. Switching this off gives the plain depth first
+	// walk that tests every node the ray passes through, for benchmarking.
+	// Only intersect() pays attention; occluded() always walks in order.
+	static bool orderedTraversal;
 
-	~BVHNode() {}
+protected:
+	BVHBuildStats stats;
 };
 
 class Scene
@@ -477,17 +496,58 @@ public:
 
 public:
 	Scene() 
-		: transformRoot(), objects(), lights()
+		: transformRoot(), objects(), lights(), bvh( 0 ), enableBVH( false ),
+		  bvhCurrent( false ), bvhReused( false ), bvhBuilds( 0 ), bvhFileCache( 0 ), worldSpaceObjects( 0 ), recorder( 0 )
 		{}
 	virtual ~Scene();
 
-	// BVH specifics
-	bool createBVH();
+	// BVH specifics. createBVH builds every object's bottom level tree and
+	// then the top level over the objects; rebuildTopLevelBVH only redoes
+	// the latter, which is all that's needed when objects have moved.
+	//
+	// The trees belong to the scene (the meshes' to the meshes in it) and
+	// last until it is destroyed, so createBVH only builds them the first
+	// time. After that it keeps them, unless the options would build a
+	// different tree or invalidateBVH says the geometry has changed
+	bool createBVH( const BVHBuildOptions& options = BVHBuildOptions() );
+	bool rebuildTopLevelBVH();
+	void invalidateBVH() { bvhCurrent = false; }
+
+	// Whether the last createBVH kept the trees it already had, and how
+	// many times they have been built for this scene
+	bool bvhWasReused() const { return bvhReused; }
+	int bvhBuildCount() const { return bvhBuilds; }
+
+	// What the top level and mesh trees take up altogether
+	size_t bvhBytes() const;
+
+	// Where the meshes save their trees for the next run to load (see
+	// bvhcache.h), if anywhere. The scene takes it over
+	void setBVHCache( BVHCache* cache );
+	BVHCache* bvhCache() const { return bvhFileCache; }
+
+	// Put every object that can be into world space (see
+	// Geometry::moveToWorldSpace), once the scene is loaded. Returns how
+	// many objects moved
+	int moveToWorldSpace();
+	int movedToWorldSpace() const { return worldSpaceObjects; }
+	// How many objects there are with each TransformNode::Kind
+	void countTransforms( int counts[4] ) const;
+	const BVHBuildStats* bvhStats() const { return bvh ? &bvh->buildStats() : 0; }
+	int bottomLevelStats( BVHBuildStats& total ) const;
+	size_t geometryBytes() const;
 	void enableBVHEnabled(bool value) { enableBVH = value; }
+	bool bvhEnabled() const { return enableBVH; }
+
+	// Debugging ray capture; pass 0 to stop recording
+	void setRayRecorder(RayRecorder* r) { recorder = r; }
 
 	void add( Geometry* obj )
 	{
+		invalidateBVH();
 		obj->ComputeBoundingBox();
+		if( obj->hasBoundingBoxCapability() )
+			sceneBounds.merge( obj->getBoundingBox() );
 		objects.push_back( obj );
 	}
 	void add( Light* light )
@@ -495,9 +555,24 @@ public:
 
 	bool intersect( const ray& r, isect& i ) const;
 
+	// Is there anything between the ray's origin and tMax along it? This is
+	// the query for shadow rays: it stops at the first object it finds
+	// rather than looking for the closest, and never works out normals,
+	// uvs or materials.
+	bool occluded( const ray& r, double tMax ) const;
+
+	// Closest hits for every ray in the packet (misses are left with
+	// t = 1000 like intersect() leaves them), and which rays hit anything
+	uint32_t intersectPacket( const RayPacket& packet, isect* hits ) const;
+	uint32_t occludedPacket( const RayPacket& packet, uint32_t mask, const double* tMax ) const;
+
 
 	std::vector<Light*>::const_iterator beginLights() const { return lights.begin(); }
 	std::vector<Light*>::const_iterator endLights() const { return lights.end(); }
+
+	// The objects, in the order they were added
+	cgiter beginObjects() const { return objects.begin(); }
+	cgiter endObjects() const { return objects.end(); }
         
 	const Camera& getCamera() const		{ return camera; }
 	Camera& getCamera()					{ return camera; }
@@ -527,6 +602,13 @@ private:
 	// BVH specifics
 	BVH* bvh;
 	bool enableBVH;
+	BVHBuildOptions bvhOptions;		// that bvh was built with
+	bool bvhCurrent;				// nothing has changed since it was built
+	bool bvhReused;
+	int bvhBuilds;
+	BVHCache* bvhFileCache;
+
+	int worldSpaceObjects;
 
 	// This is the total amount of ambient light in the scene
 	// (used as the I_a in the Phong shading model)
@@ -541,9 +623,10 @@ private:
 	BoundingBox sceneBounds;
 
 
-public:
-	// This is used for debugging purposes only.
-	mutable std::vector< std::pair<ray, isect> > intersectCache;
+	// This is used for debugging purposes only. When set, every call to
+	// intersect() is logged here; it is shared by every caller, so it
+	// must be unset while more than one thread is tracing rays.
+	RayRecorder* recorder;
 };
 
 #endif // __SCENE_H__
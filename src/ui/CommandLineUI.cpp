@@ -1,4 +1,6 @@
 #include <iostream>
+#include <fstream>
+#include <chrono>
 #include <time.h>
 #include <stdarg.h>
 
@@ -6,25 +8,62 @@
 
 #include "CommandLineUI.h"
 #include "../fileio/imageio.h"
+#include "../fileio/imagediff.h"
+#include "../fileio/meshimport.h"
 
 #include "../RayTracer.h"
+#include "../TileScheduler.h"
+#include "../parser/MeshConverter.h"
+#include "../AllocationStats.h"
+#include "../scene/bvh.h"
+#include "../scene/arena.h"
 #include "../getopt.h"
 
 using namespace std;
 
 // ***********************************************************
 
+static void printTraversalStats( const char* label, const BVHTraversalStats& stats )
+{
+	double rays = max<double>(stats.rays, 1);
+	double shadowRays = max<double>(stats.occlusionRays, 1);
+
+	std::cout << label << stats.rays << " rays: "
+		<< stats.nodesVisited / rays << " nodes/ray, " << stats.objectsTested / rays << " objects/ray" << std::endl;
+	std::cout << label << stats.occlusionRays << " shadow rays: "
+		<< stats.occlusionNodesVisited / shadowRays << " nodes/ray, " << stats.occlusionObjectsTested / shadowRays << " objects/ray" << std::endl;
+
+	if (stats.packets > 0) {
+		double packets = stats.packets;
+		std::cout << label << stats.packets << " packets of " << stats.packetRays / packets << " rays: "
+			<< stats.packetNodesVisited / packets << " nodes/packet, " << stats.packetObjectsTested / packets << " objects/packet" << std::endl;
+	}
+}
+
+// What went into reading the .obj and .ply meshes of the last scene loaded
+static void printMeshImportStats()
+{
+	MeshImportStats stats = MeshImportStats::total();
+	if (stats.files == 0)
+		return;
+
+	std::cout << "Mesh files:                 " << stats.files << " files, " << stats.bytes << " bytes, "
+		<< stats.vertices << " vertices, " << stats.triangles << " triangles in " << stats.seconds << " seconds ("
+		<< stats.bytes / max(stats.seconds, 1e-9) / 1e6 << " MB/s)" << std::endl;
+}
+
 
 // The command line UI simply parses out all the arguments off
 // the command line and stores them locally.
 CommandLineUI::CommandLineUI( int argc, char** argv )
-	: TraceUI()
+	: TraceUI(), m_printTraversalStats( false ), m_benchmarkTraversal( false ),
+	m_referenceName( 0 ), m_diffTolerance( 1 ), m_convertMeshes( false ), m_loadBenchmark( 0 )
 {
 	int i;
 
 	progName=argv[0];
 
-	while( (i = getopt( argc, argv, "r:w:bBaAh" )) != EOF )
+	while( (i = getopt( argc, argv, "r:w:t:T:bBmn:l:W:C:ML:pPfFskc:e:aAgGh" )) != EOF )
 	{
 		switch( i )
 		{
@@ -35,11 +74,75 @@ CommandLineUI::CommandLineUI( int argc, char** argv )
 			case 'w':
 				m_nSize = atoi( optarg );
 				break;
+			case 't':
+				m_nThreads = atoi( optarg );
+				break;
+			case 'T':
+				m_nTileSize = atoi( optarg );
+				break;
 			case 'b':
-				// TODO: Add code to ENABLE accelerated intersection testing!
+				m_enableBVH = true;
 				break;
 			case 'B':
-				// TODO: Add code to DISABLE accelerated intersection testing!
+				m_enableBVH = false;
+				break;
+			case 'm':
+				m_bvhMedianSplit = true;
+				break;
+			case 'n':
+				m_nBVHBins = atoi( optarg );
+				break;
+			case 'l':
+				m_nBVHLeafSize = atoi( optarg );
+				break;
+			case 'W':
+				m_nBVHNodeWidth = atoi( optarg ) == 4 ? 4 : 2;
+				break;
+			case 'C':
+				m_bvhCacheDir = optarg;
+				break;
+			case 'M':
+				m_convertMeshes = true;
+				break;
+			case 'L':
+				m_loadBenchmark = max( atoi( optarg ), 1 );
+				break;
+			case 'p':
+				m_packetTracing = true;
+				break;
+			case 'P':
+				m_packetTracing = false;
+				break;
+			case 'f':
+				m_wavefront = true;
+				break;
+			case 'F':
+				m_wavefront = false;
+				break;
+			case 's':
+				m_printTraversalStats = true;
+				break;
+			case 'k':
+				m_benchmarkTraversal = true;
+				m_printTraversalStats = true;
+				break;
+			case 'c':
+				m_referenceName = optarg;
+				break;
+			case 'e':
+				m_diffTolerance = atoi( optarg );
+				break;
+			case 'a':
+				m_enableAntialiasing = true;
+				break;
+			case 'A':
+				m_enableAntialiasing = false;
+				break;
+			case 'g':
+				m_enableGlossyReflection = true;
+				break;
+			case 'G':
+				m_enableGlossyReflection = false;
 				break;
 			case 'h':
 				usage();
@@ -54,36 +157,103 @@ CommandLineUI::CommandLineUI( int argc, char** argv )
 		}
 	}
 
-	if( optind >= argc-1 )
+	// Timing the load needs nothing to write to
+	if( optind >= argc - (m_loadBenchmark ? 0 : 1) )
 	{
 		std::cerr << "no input and/or output name." << std::endl;
 		exit(1);
 	}
 
 	rayName = argv[optind];
-	imgName = argv[optind+1];
+	imgName = m_loadBenchmark ? 0 : argv[optind+1];
 }
 
 int CommandLineUI::run()
 {
 	assert( raytracer != 0 );
+
+	if( m_convertMeshes )
+	{
+		string error;
+		if( !convertSceneMeshes( rayName, imgName, std::cout, error ) )
+		{
+			std::cerr << "Unable to convert the meshes of '" << rayName << "': " << error << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+	if( m_loadBenchmark )
+		return benchmarkLoad();
+
 	raytracer->loadScene( rayName );
 
 	if( raytracer->sceneLoaded() )
 	{
+		if( m_printTraversalStats )
+			printMeshImportStats();
+
 		int width = m_nSize;
 		int height = (int)(width / raytracer->aspectRatio() + 0.5);
 
 		raytracer->traceSetup( width, height, m_enableBVH, m_enableAntialiasing, m_enableGlossyReflection );
 
-		clock_t start, end;
-		start = clock();
+		// The tree is built up front either way, but only described with -s,
+		// like the traversal stats after the render
+		bool bvhCreated = m_enableBVH && raytracer->createBVH();
+		if( bvhCreated && m_printTraversalStats )
+			raytracer->printBVHStats( std::cout );
 
-		for( int j = 0; j < height; ++j )
-			for( int i = 0; i < width; ++i )
-				raytracer->tracePixel(i,j);
+		TileScheduler scheduler( raytracer, width, height, m_nTileSize, m_nThreads );
 
-		end=clock();
+		BVHTraversalStats plainStats;
+		double plainTime = 0.0;
+
+		if( m_benchmarkTraversal && m_enableBVH )
+		{
+			// The same image again with every node the ray passes through
+			// tested in a fixed order, to see how much the ordered walk saves
+			BVH::orderedTraversal = false;
+			BVHTraversalStats::reset();
+			plainTime = render( scheduler );
+			plainStats = BVHTraversalStats::total();
+			BVH::orderedTraversal = true;
+		}
+
+		BVHTraversalStats::reset();
+		AllocationStats::reset();
+		double t = render( scheduler );
+		AllocationStats allocations = AllocationStats::total();
+
+		if( m_printTraversalStats && m_enableBVH )
+		{
+			BVHTraversalStats stats = BVHTraversalStats::total();
+
+			if( m_benchmarkTraversal )
+			{
+				printTraversalStats( "BVH plain traversal:        ", plainStats );
+				std::cout << "BVH plain traversal time:   " << plainTime << " seconds" << std::endl;
+			}
+
+			printTraversalStats( "BVH traversal:              ", stats );
+
+			if( m_benchmarkTraversal && plainStats.nodesVisited > 0 )
+			{
+				std::cout << "BVH nodes visited:          " << 100.0 * stats.nodesVisited / plainStats.nodesVisited
+					<< "% of plain traversal" << std::endl;
+			}
+
+			// Counted over the whole render, workers and all, so the odd
+			// allocation setting up the threads shows up as a tiny fraction
+			double rays = max<double>(stats.rays + stats.occlusionRays + stats.packetRays, 1);
+			std::cout << "Heap allocations:           " << allocations.allocations << " during render ("
+				<< allocations.bytes << " bytes), " << allocations.allocations / rays << " per ray" << std::endl;
+
+			// Every render thread's scratch space, since traceSetup()
+			ArenaStats frame = Arena::total(Arena::FRAME);
+			std::cout << "Frame arenas:               " << frame.allocations << " allocations, " << frame.peakBytesUsed
+				<< " bytes used, " << frame.chunks << " chunks (" << frame.reusedChunks << " reused)" << std::endl;
+		}
 
 		// save image
 		unsigned char* buf;
@@ -93,8 +263,12 @@ int CommandLineUI::run()
 		if (buf)
 			save(imgName, buf, width, height, ".png", 95);
 
-		double t=(double)(end-start)/CLOCKS_PER_SEC;
-		std::cout << "total time = " << t << " seconds" << std::endl;
+		std::cout << "total time = " << t << " seconds (" << scheduler.getThreadCount() << " threads, "
+			<< scheduler.getTileCount() << " tiles)" << std::endl;
+
+		if( m_referenceName && buf && !compareToReference( buf, width, height ) )
+			return 1;
+
         return 0;
 	}
 	else
@@ -104,6 +278,86 @@ int CommandLineUI::run()
 	}
 }
 
+// Prints how far the render is from the -c reference image (made by a
+// double precision build, say, to check a SINGLE_PRECISION one against).
+// Returns false if they differ by more than the tolerance or can't be
+// compared at all, so a script can tell from the exit code
+bool CommandLineUI::compareToReference( const unsigned char* buf, int width, int height )
+{
+	unsigned char* reference = 0;
+	int refWidth = 0, refHeight = 0;
+
+	// CImg throws its own exceptions when it can't read the file
+	try {
+		reference = load( m_referenceName, refWidth, refHeight );
+	} catch( ... ) {
+		reference = 0;
+	}
+
+	if( reference == 0 || refWidth != width || refHeight != height ) {
+		std::cerr << "Unable to compare against '" << m_referenceName << "': ";
+		if( reference == 0 )
+			std::cerr << "couldn't read it" << std::endl;
+		else
+			std::cerr << "it is " << refWidth << "x" << refHeight << ", the render is " << width << "x" << height << std::endl;
+		delete [] reference;
+		return false;
+	}
+
+	ImageDiff diff = compareImages( buf, reference, width, height, m_diffTolerance );
+	delete [] reference;
+
+	std::cout << "Reference image:            " << m_referenceName << std::endl;
+	std::cout << "Pixels differing:           " << diff.differing << " of " << diff.pixels
+		<< " (" << 100.0 * diff.differing / std::max(diff.pixels, 1) << "%)" << std::endl;
+	std::cout << "Pixels over tolerance " << m_diffTolerance << ":    " << diff.overTolerance << std::endl;
+	std::cout << "Max channel difference:     " << diff.maxDifference << std::endl;
+	std::cout << "Mean channel difference:    " << diff.meanDifference << std::endl;
+	std::cout << "PSNR:                       " << diff.psnr << " dB" << std::endl;
+	std::cout << "Within tolerance:           " << (diff.withinTolerance() ? "yes" : "no") << std::endl;
+
+	return diff.withinTolerance();
+}
+
+// Loads the scene -L times over and reports how long a load takes, the
+// whole of it: reading and parsing the file, building the meshes and
+// putting them in world space
+int CommandLineUI::benchmarkLoad()
+{
+	ifstream file( rayName, ios::in | ios::binary | ios::ate );
+	double bytes = file ? (double)file.tellg() : 0.0;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for( int i = 0; i < m_loadBenchmark; i++ )
+	{
+		if( !raytracer->loadScene( rayName ) )
+		{
+			std::cerr << "Unable to load ray file '" << rayName << "'" << std::endl;
+			return 1;
+		}
+	}
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	double t = std::chrono::duration<double>(end-start).count() / m_loadBenchmark;
+	std::cout << "Scene load time:            " << t << " seconds (" << m_loadBenchmark << " loads of "
+		<< bytes << " bytes, " << bytes / t / 1e6 << " MB/s)" << std::endl;
+	printMeshImportStats();
+	return 0;
+}
+
+// Traces the whole image, returning how long it took in seconds
+double CommandLineUI::render( TileScheduler& scheduler )
+{
+	// clock() adds up the CPU time of every thread, so measure wall time instead
+	std::chrono::steady_clock::time_point start, end;
+	start = std::chrono::steady_clock::now();
+
+	scheduler.render();
+
+	end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double>(end-start).count();
+}
+
 void CommandLineUI::alert( const string& msg )
 {
 	std::cerr << msg << std::endl;
@@ -112,11 +366,32 @@ void CommandLineUI::alert( const string& msg )
 void CommandLineUI::usage()
 {
 	std::cerr << "usage: " << progName << " [options] [input.ray output.bmp]" << std::endl;
+	std::cerr << "       " << progName << " -M input.ray output.ray" << std::endl;
+	std::cerr << "       " << progName << " -L <#> input.ray" << std::endl;
 	std::cerr << "  -r <#>      set recursion level (default " << m_nDepth << ")" << std::endl; 
 	std::cerr << "  -w <#>      set output image width (default " << m_nSize << ")" << std::endl;
-	std::cerr << "  -b          (TODO) enable accelerated intersection testing (default)" << std::endl;
-	std::cerr << "  -B          (TODO) disable accelerated intersection testing" << std::endl;
-	std::cerr << "  -a          (TODO) enable antialiasing" << std::endl;
-	std::cerr << "  -A          (TODO) disable antialiasing (default)" << std::endl;
+	std::cerr << "  -t <#>      set number of render threads (default: one per hardware thread)" << std::endl;
+	std::cerr << "  -T <#>      set render tile size in pixels (default " << m_nTileSize << ")" << std::endl;
+	std::cerr << "  -b          enable accelerated intersection testing (default)" << std::endl;
+	std::cerr << "  -B          disable accelerated intersection testing" << std::endl;
+	std::cerr << "  -m          build the BVH with median splits instead of the SAH" << std::endl;
+	std::cerr << "  -n <#>      set SAH BVH bins per axis (default " << m_nBVHBins << ")" << std::endl;
+	std::cerr << "  -l <#>      set max objects per BVH leaf (default " << m_nBVHLeafSize << ")" << std::endl;
+	std::cerr << "  -W <#>      set children per BVH node, 2 or 4 (default " << m_nBVHNodeWidth << ")" << std::endl;
+	std::cerr << "  -C <dir>    keep mesh BVHs in dir, and load them from there instead of building them" << std::endl;
+	std::cerr << "  -L <#>      load the scene # times, report how long a load takes, and exit" << std::endl;
+	std::cerr << "  -M          write input.ray's trimeshes to .rmesh files, and output.ray to read them" << std::endl;
+	std::cerr << "  -p          trace camera and shadow rays in 4x4 packets (default)" << std::endl;
+	std::cerr << "  -P          trace every ray on its own" << std::endl;
+	std::cerr << "  -f          trace tiles in batches with the wavefront integrator" << std::endl;
+	std::cerr << "  -F          trace rays recursively (default)" << std::endl;
+	std::cerr << "  -s          print BVH build and traversal statistics" << std::endl;
+	std::cerr << "  -k          benchmark: trace the image with and without the ordered BVH walk and compare" << std::endl;
+	std::cerr << "  -c <image>  compare the render against a reference image and report the differences" << std::endl;
+	std::cerr << "  -e <#>      set the channel difference the comparison allows (default " << m_diffTolerance << ")" << std::endl;
+	std::cerr << "  -a          enable antialiasing" << std::endl;
+	std::cerr << "  -A          disable antialiasing (default)" << std::endl;
+	std::cerr << "  -g          enable glossy reflection" << std::endl;
+	std::cerr << "  -G          disable glossy reflection (default)" << std::endl;
 	std::cerr << "  -h          display this help message" << std::endl;
 }
@@ -9,6 +9,8 @@
 
 #include "TraceUI.h"
 
+class TileScheduler;
+
 
 class CommandLineUI 
 	: public TraceUI
@@ -21,6 +23,16 @@ public:
 
 private:
 	void		usage();
+	double		render( TileScheduler& scheduler );
+	int			benchmarkLoad();
+	bool		compareToReference( const unsigned char* buf, int width, int height );
+
+	bool	m_printTraversalStats;		// -s: print BVH node/object test counts after the render
+	bool	m_benchmarkTraversal;		// -k: trace the image with the plain BVH walk first, to compare
+	char*	m_referenceName;			// -c: image to compare the render against
+	int		m_diffTolerance;			// -e: channel difference allowed by the comparison
+	bool	m_convertMeshes;			// -M: convert the scene's trimeshes to .rmesh files instead of rendering
+	int		m_loadBenchmark;			// -L: times to load the scene for the load benchmark, 0 to render
 
 	char*	rayName;
 	char*	imgName;
@@ -15,6 +15,7 @@
 
 #include "GraphicalUI.h"
 #include "../RayTracer.h"
+#include "../ProgressiveRender.h"
 #include "dialog.h"
 
 
@@ -176,6 +177,10 @@ void GraphicalUI::cb_debuggingDisplayCheckButton(Fl_Widget* o, void* v)
 {
 	GraphicalUI* pUI=(GraphicalUI*)(o->user_data());
 	pUI->m_displayDebuggingInfo = (((Fl_Check_Button*)o)->value() == 1);
+
+	// Only pay for recording rays while someone is looking at them
+	pUI->raytracer->enableRayRecording( pUI->m_displayDebuggingInfo );
+
 	if( pUI->m_displayDebuggingInfo )
 		pUI->m_debuggingWindow->show();
 	else
@@ -206,10 +211,14 @@ void GraphicalUI::cb_enableGlossyReflectionCheckButton(Fl_Widget* o, void* v)
 	pUI->m_enableGlossyReflection = (((Fl_Check_Button*)o)->value() == 1);
 }
 
-void GraphicalUI::cb_render(Fl_Widget* o, void* v)
+void GraphicalUI::cb_progressiveCheckButton(Fl_Widget* o, void* v)
 {
-	char buffer[256];
+	GraphicalUI* pUI=(GraphicalUI*)(o->user_data());
+	pUI->m_progressive = (((Fl_Check_Button*)o)->value() == 1);
+}
 
+void GraphicalUI::cb_render(Fl_Widget* o, void* v)
+{
 	GraphicalUI* pUI=((GraphicalUI*)(o->user_data()));
 	
 	if (pUI->raytracer->sceneLoaded()) {
@@ -270,6 +279,7 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v)
 
 			if (bvhCreated) {
 				std::cout << "Complete" << std::endl;
+				pUI->raytracer->printBVHStats(std::cout);
 			} else {
 				std::cout << "Incomplete" << std::endl;
 			}
@@ -281,9 +291,8 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v)
 		std::cout.flush();
 
 		// start to render here	
-		clock_t prev, now, start, end;
+		clock_t start, end;
 		start = clock();
-		prev=clock();
 		
 		pUI->m_traceGlWindow->refresh();
 		Fl::check();
@@ -291,47 +300,10 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v)
 
 		doneTrace = false;
 		stopTrace = false;
-		for (int y=0; y<height; y++) {
-			for (int x=0; x<width; x++) {
-				if (stopTrace) break;
-				
-				// current time
-				now = clock();
-
-				// check event every 1/2 second
-				if (((double)(now-prev)/CLOCKS_PER_SEC)>0.5) {
-					prev=now;
-
-					if (Fl::ready()) {
-						// refresh
-						pUI->m_traceGlWindow->refresh();
-						// check event
-						Fl::check();
-
-						if (Fl::damage()) {
-							Fl::flush();
-						}
-					}
-				}
-
-				pUI->raytracer->tracePixel( x, y );
-				pUI->m_debuggingWindow->m_debuggingView->setDirty();
-			}
-			if (stopTrace) break;
-
-			// flush when finish a row
-			if (Fl::ready()) {
-				// refresh
-				pUI->m_traceGlWindow->refresh();
-
-				if (Fl::damage()) {
-					Fl::flush();
-				}
-			}
-			// update the window label
-			sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), old_label);
-			pUI->m_traceGlWindow->label(buffer);
-			
+		if (pUI->progressiveEnabled()) {
+			pUI->renderProgressive(width, height, enableAntialiasing, old_label);
+		} else {
+			pUI->renderScanlines(width, height, old_label);
 		}
 
 		end=clock();
@@ -349,6 +321,98 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v)
 	}
 }
 
+// Renders the image a pixel at a time, top to bottom, checking events every
+// 1/2 second and updating the label after each row, until it's done or the
+// stop button is pressed
+void GraphicalUI::renderScanlines(int width, int height, const char* label)
+{
+	char buffer[256];
+	clock_t prev = clock(), now;
+
+	for (int y=0; y<height; y++) {
+		for (int x=0; x<width; x++) {
+			if (stopTrace) break;
+
+			// current time
+			now = clock();
+
+			// check event every 1/2 second
+			if (((double)(now-prev)/CLOCKS_PER_SEC)>0.5) {
+				prev=now;
+
+				if (Fl::ready()) {
+					// refresh
+					m_traceGlWindow->refresh();
+					// check event
+					Fl::check();
+
+					if (Fl::damage()) {
+						Fl::flush();
+					}
+				}
+			}
+
+			raytracer->tracePixel( x, y );
+			m_debuggingWindow->m_debuggingView->setDirty();
+		}
+		if (stopTrace) break;
+
+		// flush when finish a row
+		if (Fl::ready()) {
+			// refresh
+			m_traceGlWindow->refresh();
+
+			if (Fl::damage()) {
+				Fl::flush();
+			}
+		}
+		// update the window label
+		sprintf(buffer, "(%d%%) %s", (int)((double)y / (double)height * 100.0), label);
+		m_traceGlWindow->label(buffer);
+	}
+}
+
+// Renders in passes (see ProgressiveRender), showing the image after each
+// one, until they're all done or the stop button is pressed
+void GraphicalUI::renderProgressive(int width, int height, bool enableAntialiasing, const char* label)
+{
+	char buffer[256];
+	clock_t prev = clock(), now;
+
+	ProgressiveRender progressive(raytracer, width, height, enableAntialiasing ? getAntialiasingSamples() : 0);
+
+	while (!stopTrace && progressive.traceRow()) {
+		m_debuggingWindow->m_debuggingView->setDirty();
+
+		// Show every finished pass, and check events every 1/2 second
+		// while one is under way
+		now = clock();
+		if (progressive.passFinished() || ((double)(now-prev)/CLOCKS_PER_SEC)>0.5) {
+			prev=now;
+
+			int pass = progressive.getPass();
+			if (pass < progressive.getPassCount()) {
+				sprintf(buffer, "(pass %d of %d, %d%%) %s", pass + 1, progressive.getPassCount(),
+					(int)(progressive.passProgress() * 100.0), label);
+				m_traceGlWindow->label(buffer);
+			}
+
+			if (Fl::ready()) {
+				// refresh
+				m_traceGlWindow->refresh();
+				// check event
+				Fl::check();
+
+				if (Fl::damage()) {
+					Fl::flush();
+				}
+			}
+		}
+	}
+
+	std::cout << "Passes rendered:            " << progressive.getPass() << " of " << progressive.getPassCount() << std::endl;
+}
+
 void GraphicalUI::cb_stop(Fl_Widget* o, void* v)
 {
 	stopTrace = true;
@@ -476,6 +540,12 @@ GraphicalUI::GraphicalUI() {
 		m_enableGlossyReflectionCheckButton->callback(cb_enableGlossyReflectionCheckButton);
 		m_enableGlossyReflectionCheckButton->value(m_enableGlossyReflection);
 
+		// set up progressive rendering checkbox
+		m_progressiveCheckButton = new Fl_Check_Button(0, 190, 180, 20, "Progressive Rendering");
+		m_progressiveCheckButton->user_data((void*)(this));
+		m_progressiveCheckButton->callback(cb_progressiveCheckButton);
+		m_progressiveCheckButton->value(m_progressive);
+
 		// set up "render" button
 		m_renderButton = new Fl_Button(240, 27, 70, 25, "&Render");
 		m_renderButton->user_data((void*)(this));
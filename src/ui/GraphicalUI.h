@@ -42,6 +42,7 @@ public:
 	Fl_Check_Button*	m_enableBVHCheckButton;
 	Fl_Check_Button*	m_enableAntialiasingCheckButton;
 	Fl_Check_Button*	m_enableGlossyReflectionCheckButton;
+	Fl_Check_Button*	m_progressiveCheckButton;
 
 	Fl_Button*			m_renderButton;
 	Fl_Button*			m_stopButton;
@@ -79,6 +80,10 @@ private:
 	static void cb_enableBVHCheckButton(Fl_Widget* o, void* v);
 	static void cb_enableAntialiasingCheckButton(Fl_Widget* o, void* v);
 	static void cb_enableGlossyReflectionCheckButton(Fl_Widget* o, void* v);
+	static void cb_progressiveCheckButton(Fl_Widget* o, void* v);
+
+	void renderScanlines(int width, int height, const char* label);
+	void renderProgressive(int width, int height, bool enableAntialiasing, const char* label);
 
 	static bool doneTrace;		// Flag that gets set when the trace is done
 	static bool stopTrace;		// Flag that gets set when the trace should be stopped
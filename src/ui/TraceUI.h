@@ -29,6 +29,15 @@ public:
 		m_enableAntialiasing( false ),
 		m_enableGlossyReflection( false ),
 		m_nAntialiasingSamples(16),
+		m_nThreads(0),
+		m_nTileSize(32),
+		m_bvhMedianSplit( false ),
+		m_nBVHBins(16),
+		m_nBVHLeafSize(4),
+		m_nBVHNodeWidth(4),
+		m_packetTracing( true ),
+		m_wavefront( false ),
+		m_progressive( false ),
 		raytracer( 0 )
 	{ }
 
@@ -48,6 +57,16 @@ public:
 	bool	enableAntialiasingEnabled() const { return m_enableAntialiasing; }
 	bool	enableGlossyReflectionEnabled() const { return m_enableGlossyReflection; }
 	int		getAntialiasingSamples() const { return m_nAntialiasingSamples; }
+	int		getThreads() const { return m_nThreads; }
+	int		getTileSize() const { return m_nTileSize; }
+	bool	bvhMedianSplitEnabled() const { return m_bvhMedianSplit; }
+	int		getBVHBins() const { return m_nBVHBins; }
+	int		getBVHLeafSize() const { return m_nBVHLeafSize; }
+	int		getBVHNodeWidth() const { return m_nBVHNodeWidth; }
+	bool	packetTracingEnabled() const { return m_packetTracing; }
+	bool	wavefrontEnabled() const { return m_wavefront; }
+	bool	progressiveEnabled() const { return m_progressive; }
+	const string& getBVHCacheDir() const { return m_bvhCacheDir; }
 
 protected:
 	RayTracer*	raytracer;
@@ -58,6 +77,16 @@ protected:
 	bool		m_enableAntialiasing;		// Flag to enable supersampling antialiasing
 	bool		m_enableGlossyReflection;		// Flag to enable glossy reflection for distribution raytracing
 	int			m_nAntialiasingSamples;				// Max samples for supersampling antialiasing
+	int			m_nThreads;				// Render threads for the tile scheduler (0 = one per hardware thread)
+	int			m_nTileSize;				// Width/height in pixels of the tiles handed to render threads
+	bool		m_bvhMedianSplit;		// Build the BVH with the old median split instead of the SAH
+	int			m_nBVHBins;				// Candidate split planes per axis for the SAH BVH builder
+	int			m_nBVHLeafSize;				// Max objects in a BVH leaf
+	int			m_nBVHNodeWidth;			// Children per BVH node, 2 or 4
+	bool		m_packetTracing;		// Trace camera and shadow rays in 4x4 packets
+	bool		m_wavefront;		// Trace tiles in batches with the wavefront integrator
+	bool		m_progressive;		// Render in the GUI in passes, coarse first, to stop when good enough
+	string		m_bvhCacheDir;		// Directory to keep mesh BVHs in between runs, empty for none
 
 	// Determines whether or not to show debugging information
 	// for individual rays.  Disabled by default for efficiency
@@ -456,12 +456,11 @@ void DebuggingView::drawRays()
 {
 	glDisable( GL_LIGHTING );
 	// Now draw all the rays
-	for( std::vector< std::pair<ray, isect> >::const_iterator rayItr = 
-		raytracer->getScene().intersectCache.begin();
-		rayItr != raytracer->getScene().intersectCache.end();
-		++rayItr )
+	const RayRecorder& recorder = raytracer->getRayRecorder();
+	for( int n = 0; n < recorder.size(); ++n )
 	{
-		switch( rayItr->first.type() )
+		const RayRecord& rec = recorder[n];
+		switch( rec.type )
 		{
 		case ray::VISIBILITY:
 			if( !m_showVisibilityRays ) continue;
@@ -483,9 +482,9 @@ void DebuggingView::drawRays()
 			glColor4f( 0.20f, 0.45f, 0.72f, 1.0f );
 			break;
 		}
-		Vec3d p = rayItr->first.getPosition();
-		Vec3d d = rayItr->first.getDirection();
-		Vec3d isectPoint = p + rayItr->second.t*d;
+		Vec3d p = rec.position;
+		Vec3d d = rec.direction;
+		Vec3d isectPoint = p + rec.t*d;
 
 		glEnable( GL_LINE_STIPPLE );
 		glLineStipple( 1, 0x3333 );
@@ -504,7 +503,7 @@ void DebuggingView::drawRays()
 				glBegin( GL_LINES );
 					glColor4f( 0.5f, 1.0f, 0.5f, 1.0f );
 					glVertex3d( 0.0, 0.0, 0.0 );
-					glVertex3dv( rayItr->second.N.getPointer() );
+					glVertex3dv( rec.N.getPointer() );
 				glEnd();
 			glPopMatrix();
 		}
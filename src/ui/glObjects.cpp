@@ -348,6 +348,12 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 		d = &displayListWithoutMaterials;
 	int& displayList = *d;
 
+	// An instance draws the geometry of the mesh it shares
+	const Vertices& vertices = mesh->vertices;
+	const Indices& indices = mesh->indices;
+	const Normals& normals = mesh->normals;
+	const Materials& materials = mesh->materials;
+
 	// We'll try to buy some time back by using display lists.
 	if( displayList == 0 )
 	{
@@ -355,43 +361,43 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 		glNewList( displayList, GL_COMPILE );
 
 		glBegin( GL_TRIANGLES );
-		for( Faces::const_iterator itr = faces.begin(); itr != faces.end(); ++itr )
+		for( size_t f = 0; f + 2 < indices.size(); f += 3 )
 		{
-			const int vert1 = (*(*itr))[0];
-			const int vert2 = (*(*itr))[1];
-			const int vert3 = (*(*itr))[2];
+			const int vert1 = indices[f];
+			const int vert2 = indices[f + 1];
+			const int vert3 = indices[f + 2];
 
 			if( normals.empty() )
 			{
-				const Vec3d& a = vertices[vert1];
-				const Vec3d& b = vertices[vert2];
-				const Vec3d& c = vertices[vert3];
+				const Vec3f& a = vertices[vert1];
+				const Vec3f& b = vertices[vert2];
+				const Vec3f& c = vertices[vert3];
 
-				Vec3d cv=(b - a) ^ (c - a);
+				Vec3f cv=(b - a) ^ (c - a);
 
 				// there exists some bad triangles such that two vertices coincide
 				// check this before normalize
 				if (!cv.iszero())
-					glNormal3dv( cv.getPointer() );
+					glNormal3fv( cv.getPointer() );
 			}
 
 			if( ! normals.empty() )
-				glNormal3dv( normals[vert1].getPointer() );
+				glNormal3fv( normals[vert1].getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert1], *itr );
-			glVertex3dv( vertices[vert1].getPointer() );
+				setGLMaterial( *materials[vert1], this );
+			glVertex3fv( vertices[vert1].getPointer() );
 
 			if( ! normals.empty() )
-				glNormal3dv( normals[vert2].getPointer() );
+				glNormal3fv( normals[vert2].getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert2], *itr );
-			glVertex3dv( vertices[vert2].getPointer() );
+				setGLMaterial( *materials[vert2], this );
+			glVertex3fv( vertices[vert2].getPointer() );
 
 			if( ! normals.empty() )
-				glNormal3dv( normals[vert3].getPointer() );
+				glNormal3fv( normals[vert3].getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert3], *itr );
-			glVertex3dv( vertices[vert3].getPointer() );
+				setGLMaterial( *materials[vert3], this );
+			glVertex3fv( vertices[vert3].getPointer() );
 		}
 		glEnd();
 
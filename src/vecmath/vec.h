@@ -421,6 +421,18 @@ typedef Vec3<int> Vec3i;
 typedef Vec3<float> Vec3f;
 typedef Vec3<double> Vec3d;
 
+// The precision of the ray tracer's hot path: rays against the BVH boxes
+// and the triangles. Building with SINGLE_PRECISION defined (make
+// DEFINES=-DSINGLE_PRECISION) does that in float, which is half the bytes
+// to move and twice the SIMD lanes. Parsing, transforms and shading stay
+// in double either way.
+#ifdef SINGLE_PRECISION
+typedef float Real;
+#else
+typedef double Real;
+#endif
+typedef Vec3<Real> Vec3r;
+
 //==========[ class Vec4 ]=================================
 
 template <class T>